@@ -0,0 +1,420 @@
+/*
+ * Benchmarks for the context runtime hot paths.
+ *
+ * Usage: bench [-n iterations] [-t max_threads] [-c contexts,...]
+ *              [-d delegators,...] [-l log_modes,...] [-f text|csv|json]
+ *
+ * Times the runtime entry points (instrument_indicator,
+ * instrument_delegator, instrument_del_indicator, get_thread_ctx,
+ * update_thread_ctx) and the tables under them (map.h with string keys,
+ * pre-formatted or, as the runtime once did, sprintf'd on every call, and
+ * ctbl with int keys) for every combination of:
+ *   - 1, 2, 4, ... up to max_threads threads (default: online CPUs),
+ *   - the number of distinct contexts and delegators cycled through,
+ *   - LCTX_LOG_MODE (default "off,sync"; any mode ctxlog.h accepts).
+ * Each combination runs in a forked process, so it starts from empty
+ * tables and its own log mode. The table benchmarks do not log, so they
+ * only run with the first log mode.
+ *
+ * Every row is the mean ns/op seen by one thread plus the aggregate
+ * Mops/s, or, for map_set_grow*, the worst single insert while a map
+ * grows to `contexts` keys. csv and json (one object per line) are meant
+ * for scripts comparing runs.
+ *
+ * Build optimized and without debug output, e.g.
+ * `make CFLAGS_DEBUG=-O2 bench`. Logging modes write context.log in the
+ * current directory.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "ctbl.h"
+#include "delegation.h"
+#include "map.h"
+
+#define MAX_LIST 16
+
+enum op {
+  OP_INDICATOR,
+  OP_DELEGATOR,
+  OP_DEL_INDICATOR,
+  OP_GET_THREAD_CTX,
+  OP_UPDATE_THREAD_CTX,
+  OP_MAP_SET,
+  OP_MAP_GET,
+  OP_MAP_SET_SPRINTF,
+  OP_MAP_GET_SPRINTF,
+  OP_CTBL_SET,
+  OP_CTBL_GET,
+  N_OPS
+};
+
+static const char *op_names[N_OPS] = {
+  "instrument_indicator",
+  "instrument_delegator",
+  "instrument_del_indicator",
+  "get_thread_ctx",
+  "update_thread_ctx",
+  "map_set",
+  "map_get",
+  "map_set_sprintf",
+  "map_get_sprintf",
+  "ctbl_set",
+  "ctbl_get",
+};
+
+// The first op that does not go through the runtime (and its log).
+#define FIRST_TABLE_OP OP_MAP_SET
+
+enum format { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+struct config {
+  const char *log;
+  int threads, contexts, delegators;
+  int tables;   // also run the table benchmarks
+};
+
+struct worker {
+  pthread_t th;
+  int idx;
+  double ns;
+  // map ops: this thread's map and its pre-formatted keys.
+  map_int_t map;
+  char **keys;
+};
+
+static long n_iters = 200000;
+static enum format format = FMT_TEXT;
+static const struct config *cur;
+static enum op cur_op;
+static pthread_barrier_t barrier;
+static ctbl_t(int) shared_tbl;
+// Keeps the compiler from dropping lookups whose result is unused.
+static volatile long sink;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void emit(const char *op, const char *stat, double ns, double mops)
+{
+  const struct config *c = cur;
+
+  switch (format) {
+  case FMT_TEXT:
+    printf("%-26s %-4s %3d thr %7d ctx %7d del log=%-5s %10.1f ns",
+           op, stat, c->threads, c->contexts, c->delegators, c->log, ns);
+    if (mops > 0)
+      printf(" %8.2f Mops/s", mops);
+    printf("\n");
+    break;
+  case FMT_CSV:
+    printf("%s,%s,%d,%d,%d,%s,%ld,%.1f,%.3f\n", op, stat, c->threads,
+           c->contexts, c->delegators, c->log, n_iters, ns, mops);
+    break;
+  case FMT_JSON:
+    printf("{\"op\":\"%s\",\"stat\":\"%s\",\"threads\":%d,\"contexts\":%d,"
+           "\"delegators\":%d,\"log\":\"%s\",\"iters\":%ld,"
+           "\"ns_per_op\":%.1f,\"mops\":%.3f}\n", op, stat, c->threads,
+           c->contexts, c->delegators, c->log, n_iters, ns, mops);
+    break;
+  }
+}
+
+static int is_map_op(enum op op)
+{
+  return op >= OP_MAP_SET && op <= OP_MAP_GET_SPRINTF;
+}
+
+static void run_op(struct worker *w, enum op op)
+{
+  long tid = lctx_gettid(), i;
+  int off = w->idx * 7, nc = cur->contexts, nd = cur->delegators, v;
+  char key[17];
+
+  for (i = 0; i < n_iters; i++) {
+    switch (op) {
+    case OP_INDICATOR:
+      instrument_indicator((i + off) % nc);
+      break;
+    case OP_DELEGATOR:
+      instrument_delegator((i + off) % nd);
+      break;
+    case OP_DEL_INDICATOR:
+      instrument_del_indicator((i + off) % nc);
+      break;
+    case OP_GET_THREAD_CTX:
+      sink += (long) get_thread_ctx(tid);
+      break;
+    case OP_UPDATE_THREAD_CTX:
+      update_thread_ctx(tid, (i + off) % nc);
+      break;
+    case OP_MAP_SET:
+      map_set(&w->map, w->keys[(i + off) % nc], i);
+      break;
+    case OP_MAP_GET:
+      sink += *map_get(&w->map, w->keys[(i + off) % nc]);
+      break;
+    case OP_MAP_SET_SPRINTF:
+      sprintf(key, "%d", (int) ((i + off) % nc));
+      map_set(&w->map, key, i);
+      break;
+    case OP_MAP_GET_SPRINTF:
+      sprintf(key, "%d", (int) ((i + off) % nc));
+      sink += *map_get(&w->map, key);
+      break;
+    case OP_CTBL_SET:
+      ctbl_set(&shared_tbl, (i + off) % nc, i);
+      break;
+    case OP_CTBL_GET:
+      if (!ctbl_get(&shared_tbl, (i + off) % nc, &v))
+        sink += v;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  double start;
+  int i;
+
+  // Untimed setup: register the thread and fill its map.
+  instrument_indicator(w->idx % cur->contexts);
+  if (is_map_op(cur_op)) {
+    map_init(&w->map);
+    for (i = 0; i < cur->contexts; i++)
+      map_set(&w->map, w->keys[i], i);
+  }
+
+  pthread_barrier_wait(&barrier);
+  start = now_ns();
+  run_op(w, cur_op);
+  w->ns = now_ns() - start;
+
+  if (is_map_op(cur_op))
+    map_deinit(&w->map);
+  return NULL;
+}
+
+static void bench_op(struct worker *ws, enum op op)
+{
+  double ns = 0, worst = 0;
+  int i;
+
+  cur_op = op;
+  if (op == OP_CTBL_GET || op == OP_CTBL_SET) {
+    ctbl_init(&shared_tbl);
+    for (i = 0; i < cur->contexts; i++)
+      ctbl_set(&shared_tbl, i, i);
+  }
+
+  pthread_barrier_init(&barrier, NULL, cur->threads);
+  for (i = 0; i < cur->threads; i++) {
+    if (pthread_create(&ws[i].th, NULL, worker_main, &ws[i]))
+      fail("Failed to start benchmark thread!\n");
+  }
+  for (i = 0; i < cur->threads; i++) {
+    pthread_join(ws[i].th, NULL);
+    ns += ws[i].ns;
+    if (ws[i].ns > worst)
+      worst = ws[i].ns;
+  }
+  pthread_barrier_destroy(&barrier);
+
+  if (op == OP_CTBL_GET || op == OP_CTBL_SET)
+    ctbl_deinit(&shared_tbl);
+  emit(op_names[op], "mean", ns / cur->threads / n_iters,
+       cur->threads * n_iters / worst * 1e3);
+}
+
+/* Worst single map_set while a map grows from empty to `contexts` keys,
+ * which is what an unlucky caller pays for a resize, with and without
+ * map_reserve. */
+static void bench_map_growth(char **keys, int reserve)
+{
+  map_int_t m;
+  double start, t, worst = 0;
+  int i;
+
+  map_init(&m);
+  if (reserve)
+    map_reserve(&m, cur->contexts);
+  for (i = 0; i < cur->contexts; i++) {
+    start = now_ns();
+    map_set(&m, keys[i], i);
+    t = now_ns() - start;
+    if (t > worst)
+      worst = t;
+  }
+  emit(reserve ? "map_set_grow_reserved" : "map_set_grow", "max", worst, 0);
+  map_deinit(&m);
+}
+
+// One configuration, in a fresh process.
+static void run_config(const struct config *c)
+{
+  struct worker *ws;
+  char **keys;
+  int i, n = c->contexts;
+  enum op op;
+
+  cur = c;
+  if (setenv("LCTX_LOG_MODE", c->log, 1))
+    fail("Failed to set LCTX_LOG_MODE!\n");
+  init_lctx();
+  // Bind every delegator to a context so instrument_delegator stores one.
+  instrument_indicator(0);
+  for (i = 0; i < c->delegators; i++)
+    instrument_delegator(i);
+  for (i = 0; i < n; i++)
+    add_ctx(i);
+
+  keys = malloc(n * sizeof(*keys));
+  ws = calloc(c->threads, sizeof(*ws));
+  if (!keys || !ws)
+    fail("Failed to allocate benchmark state!\n");
+  for (i = 0; i < n; i++) {
+    keys[i] = malloc(12);
+    if (!keys[i])
+      fail("Failed to allocate benchmark keys!\n");
+    sprintf(keys[i], "%d", i);
+  }
+  for (i = 0; i < c->threads; i++) {
+    ws[i].idx = i;
+    ws[i].keys = keys;
+  }
+
+  for (op = 0; op < N_OPS; op++) {
+    if (op < FIRST_TABLE_OP || c->tables)
+      bench_op(ws, op);
+  }
+  if (c->tables && c->threads == 1) {
+    bench_map_growth(keys, 0);
+    bench_map_growth(keys, 1);
+  }
+  fflush(stdout);
+}
+
+// Split "a,b,c" into at most MAX_LIST entries of list.
+static int split(char *s, char **list)
+{
+  int n = 0;
+  char *tok;
+
+  for (tok = strtok(s, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+    list[n++] = tok;
+  return n;
+}
+
+static int split_ints(char *s, int *list)
+{
+  char *strs[MAX_LIST];
+  int i, n = split(s, strs);
+
+  for (i = 0; i < n; i++) {
+    list[i] = atoi(strs[i]);
+    if (list[i] < 1)
+      fail("Counts must be positive, not %s\n", strs[i]);
+  }
+  return n;
+}
+
+// 1, 2, 4, ... below max, then max.
+static int thread_counts(int max, int *list)
+{
+  int n = 0, t;
+
+  for (t = 1; t < max && n < MAX_LIST - 1; t *= 2)
+    list[n++] = t;
+  list[n++] = max;
+  return n;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: bench [-n iterations] [-t max_threads] "
+          "[-c contexts,...] [-d delegators,...] [-l log_modes,...] "
+          "[-f text|csv|json]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  char ctx_arg[] = "16,4096", del_arg[] = "16,4096", log_arg[] = "off,sync";
+  char *logs[MAX_LIST];
+  int ctxs[MAX_LIST], dels[MAX_LIST], thrs[MAX_LIST];
+  int n_logs, n_ctxs, n_dels, n_thrs, l, c, d, t, opt;
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct config cfg;
+  pid_t pid;
+  int status;
+
+  n_ctxs = split_ints(ctx_arg, ctxs);
+  n_dels = split_ints(del_arg, dels);
+  n_logs = split(log_arg, logs);
+  while ((opt = getopt(argc, argv, "n:t:c:d:l:f:")) != -1) {
+    switch (opt) {
+    case 'n': n_iters = atol(optarg); break;
+    case 't': max_threads = atoi(optarg); break;
+    case 'c': n_ctxs = split_ints(optarg, ctxs); break;
+    case 'd': n_dels = split_ints(optarg, dels); break;
+    case 'l': n_logs = split(optarg, logs); break;
+    case 'f':
+      if (!strcmp(optarg, "text"))
+        format = FMT_TEXT;
+      else if (!strcmp(optarg, "csv"))
+        format = FMT_CSV;
+      else if (!strcmp(optarg, "json"))
+        format = FMT_JSON;
+      else
+        usage();
+      break;
+    default: usage();
+    }
+  }
+  if (n_iters < 1 || max_threads < 1 || !n_ctxs || !n_dels || !n_logs)
+    usage();
+  n_thrs = thread_counts(max_threads, thrs);
+
+  if (format == FMT_CSV)
+    printf("op,stat,threads,contexts,delegators,log,iters,ns_per_op,mops\n");
+  for (l = 0; l < n_logs; l++)
+    for (c = 0; c < n_ctxs; c++)
+      for (d = 0; d < n_dels; d++)
+        for (t = 0; t < n_thrs; t++) {
+          cfg.log = logs[l];
+          cfg.threads = thrs[t];
+          cfg.contexts = ctxs[c];
+          cfg.delegators = dels[d];
+          // The tables do not depend on the delegator count or the log.
+          cfg.tables = l == 0 && d == 0;
+          fflush(stdout);
+          pid = fork();
+          if (pid < 0)
+            fail("Failed to fork!\n");
+          if (!pid) {
+            run_config(&cfg);
+            exit(0);
+          }
+          if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+              WEXITSTATUS(status))
+            fail("Benchmark run failed (%d threads, %d contexts, "
+                 "%d delegators, log %s)\n", thrs[t], ctxs[c], dels[d],
+                 logs[l]);
+        }
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Test for the MPI layer (include/ctxmpi.h).
+ *
+ * Usage: mpirun -np <ranks> mpi [rounds]
+ *
+ * Build with `make CFLAGS_DEBUG= mpi`; needs at least 2 ranks. Each round
+ * rank 0 sends every other rank a batch in one context, a message in a
+ * second context and one outside any context, on separate tags, and the
+ * receivers take them out of order. Every other rank then passes the
+ * round's context on to the next one, so it crosses every process.
+ */
+#define _GNU_SOURCE
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "ctxmpi.h"
+#include "delegation.h"
+
+#define TAG_BULK 10
+#define TAG_OTHER 11
+#define TAG_NONE 12
+#define TAG_FWD 13
+#define N_BULK 16
+
+static int rank, n_ranks, n_rounds = 1000;
+static int errors;
+
+static void check(int ok, const char *what, int r)
+{
+  if (!ok) {
+    fprintf(stderr, "rank %d, round %d: %s (in ctx %d)\n", rank, r, what,
+            lctx_cur_ctx);
+    errors++;
+  }
+}
+
+static void send_int(int v, int dest, int tag)
+{
+  MPI_Send(&v, 1, MPI_INT, dest, tag, MPI_COMM_WORLD);
+}
+
+static int recv_int(int source, int tag)
+{
+  int v;
+
+  MPI_Recv(&v, 1, MPI_INT, source, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  return v;
+}
+
+// Contexts of round r: a batch, the other message and the next round's.
+static int ctx_of(int r, int which)
+{
+  return r * 2 + which;
+}
+
+static void originate(int r)
+{
+  int dest, i;
+
+  for (dest = 1; dest < n_ranks; dest++) {
+    instrument_indicator(ctx_of(r, 0));
+    for (i = 0; i < N_BULK / 2; i++)
+      send_int(ctx_of(r, 0), dest, TAG_BULK);
+    instrument_indicator(ctx_of(r, 1));
+    send_int(ctx_of(r, 1), dest, TAG_OTHER);
+    instrument_indicator(ctx_of(r, 0));
+    for (; i < N_BULK; i++)
+      send_int(ctx_of(r, 0), dest, TAG_BULK);
+    instrument_del_indicator(NO_CTX);
+    send_int(NO_CTX, dest, TAG_NONE);
+  }
+}
+
+static void receive(int r)
+{
+  int i, v;
+
+  // The second context's message overtakes the first batch.
+  v = recv_int(0, TAG_OTHER);
+  check(v == ctx_of(r, 1) && lctx_cur_ctx == v, "wrong context", r);
+  for (i = 0; i < N_BULK; i++) {
+    v = recv_int(0, TAG_BULK);
+    check(v == ctx_of(r, 0) && lctx_cur_ctx == v, "wrong batch context", r);
+  }
+  recv_int(0, TAG_NONE);
+  check(lctx_cur_ctx == ctx_of(r, 0), "context lost without one sent", r);
+
+  if (rank > 1) {
+    v = recv_int(rank - 1, TAG_FWD);
+    check(lctx_cur_ctx == v, "wrong forwarded context", r);
+  }
+  if (rank < n_ranks - 1)
+    send_int(lctx_cur_ctx, rank + 1, TAG_FWD);
+}
+
+int main(int argc, char **argv)
+{
+  struct lctx_mpi_stats st;
+  int r, total;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+  if (argc > 1)
+    n_rounds = atoi(argv[1]);
+  if (n_ranks < 2) {
+    fprintf(stderr, "mpi: needs at least 2 ranks\n");
+    MPI_Abort(MPI_COMM_WORLD, 2);
+  }
+
+  for (r = 0; r < n_rounds; r++) {
+    if (rank == 0)
+      originate(r);
+    else
+      receive(r);
+  }
+
+  lctx_mpi_get_stats(&st);
+  if (rank == 0) {
+    /* One announcement per context change, not per message; the first
+     * message outside a context needs none. */
+    check(st.side_msgs == (unsigned long) (n_rounds * 4 - 1) * (n_ranks - 1),
+          "unexpected announcements", n_rounds);
+    printf("mpi: %d ranks, %lu sends, %lu side messages, %lu records\n",
+           n_ranks, st.sends, st.side_msgs, st.records);
+  } else {
+    check(st.applied == st.recvs - (unsigned long) n_rounds,
+          "unexpected context switches", n_rounds);
+  }
+
+  MPI_Reduce(&errors, &total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (rank == 0)
+    printf("mpi: %d errors\n", total);
+  MPI_Finalize();
+  return rank == 0 && total ? 1 : 0;
+}
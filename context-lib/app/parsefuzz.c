@@ -0,0 +1,339 @@
+/*
+ * Fuzz test for the text log parser (include/ctxparse.h).
+ *
+ * Usage: parsefuzz [rounds] [seed]
+ *
+ * Build with `make parsefuzz`. Each round builds a buffer of valid lines,
+ * lines with values at and past the limits of their fields, and mutated
+ * and garbage lines, and checks that every instruction set the CPU has
+ * parses it into the same columns as a separate reference parser, also
+ * when the columns fill up mid-buffer. ctxparse_aggregate() on 1 to 8
+ * threads must give the totals of the reference columns. The buffer ends
+ * exactly at the end of its allocation, so ASan catches reads past it.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "ctxparse.h"
+
+#define MAX_LINES 2000
+#define MAX_LINE 128
+
+static uint64_t rng_state;
+static int errors;
+
+static uint64_t rnd(void)
+{
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+static void check(int ok, const char *what, int round)
+{
+  if (!ok) {
+    fprintf(stderr, "round %d: %s\n", round, what);
+    errors++;
+  }
+}
+
+/*--------------------------Input generation.-----------------------------*/
+// v in decimal with up to zeros leading zeros.
+static int put_num(char *s, unsigned __int128 v, int zeros)
+{
+  char tmp[48];
+  int n = 0, len = 0;
+
+  zeros = zeros ? (int) (rnd() % (zeros + 1)) : 0;
+  while (zeros--)
+    s[len++] = '0';
+  do {
+    tmp[n++] = '0' + (int) (v % 10);
+    v /= 10;
+  } while (v);
+  while (n)
+    s[len++] = tmp[--n];
+  return len;
+}
+
+// A random value of a random number of digits, near max at times.
+static unsigned __int128 pick(unsigned __int128 max)
+{
+  switch (rnd() % 8) {
+  case 0:
+    return max;
+  case 1:
+    return max + 1 + rnd() % 3;    // just past the limit
+  case 2:
+    return rnd() % 10;
+  case 3:
+    return (unsigned __int128) rnd() * rnd();  // far past most limits
+  default:
+    return rnd() % (max + 1) >> (rnd() % 64);
+  }
+}
+
+static int gen_line(char *s)
+{
+  int len = 0, zeros = rnd() % 4 ? 0 : 3;
+
+  switch (rnd() % 16) {
+  case 0:
+    return 0;    // empty
+  case 1:
+    return sprintf(s, "link|ctx|%d|%d", (int) rnd(), (int) rnd());
+  case 2:
+    while (len < 40 + (int) (rnd() % 60))
+      s[len++] = "0123456789|-\r a"[rnd() % 15];
+    return len;
+  }
+  len += put_num(s + len, pick(UINT64_MAX), zeros);
+  s[len++] = '|';
+  if (rnd() % 2)
+    s[len++] = '-';
+  len += put_num(s + len, pick(s[len - 1] == '-' ? 2147483648U : INT32_MAX),
+                 zeros);
+  s[len++] = '|';
+  len += put_num(s + len, pick(rnd() % 2 ? UINT64_MAX : 2000000000),
+                 zeros);
+  s[len++] = '|';
+  len += put_num(s + len, pick(rnd() % 2 ? UINT32_MAX : 999999), zeros);
+  // Mutate one in four lines.
+  if (!(rnd() % 4)) {
+    int at = rnd() % len;
+
+    switch (rnd() % 3) {
+    case 0:
+      s[at] = "|\n-09a \r"[rnd() % 8];
+      break;
+    case 1:
+      memmove(s + at, s + at + 1, len - at - 1);
+      len--;
+      break;
+    default:
+      memmove(s + at + 1, s + at, len - at);
+      s[at] = "|-0\0"[rnd() % 4];
+      len++;
+    }
+  }
+  return len;
+}
+
+static char *gen_buf(size_t *len)
+{
+  size_t n_lines = rnd() % MAX_LINES, i, n = 0;
+  char *buf = malloc(n_lines * (MAX_LINE + 1) + 1), *out;
+
+  if (!buf)
+    fail("Failed to allocate the input\n");
+  for (i = 0; i < n_lines; i++) {
+    n += gen_line(buf + n);
+    if (i + 1 < n_lines || rnd() % 2)
+      buf[n++] = '\n';
+  }
+  // Copy into a buffer of exactly n bytes.
+  out = malloc(n ? n : 1);
+  if (!out)
+    fail("Failed to allocate the input\n");
+  memcpy(out, buf, n);
+  free(buf);
+  *len = n;
+  return out;
+}
+
+/*------------------------------Reference.--------------------------------*/
+static int ref_uint(const char *s, size_t n, unsigned __int128 max,
+                    unsigned __int128 *v)
+{
+  unsigned __int128 x = 0;
+  size_t i;
+
+  if (n < 1 || n > 20)
+    return -1;
+  for (i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9')
+      return -1;
+    x = x * 10 + (s[i] - '0');
+  }
+  if (x > max)
+    return -1;
+  *v = x;
+  return 0;
+}
+
+static void ref_parse(const char *buf, size_t len, struct ctxparse_cols *c)
+{
+  const char *f[4], *line = buf, *end = buf + len, *le, *q;
+  size_t fl[4];
+  unsigned __int128 v[4];
+  int n, neg;
+
+  while (line < end) {
+    le = line;
+    while (le < end && *le != '\n')
+      le++;
+    // Split on '|'.
+    n = 0;
+    f[0] = line;
+    for (q = line; q <= le && n < 5; q++) {
+      if (q == le || *q == '|') {
+        if (n < 4)
+          fl[n] = q - f[n];
+        n++;
+        if (n < 4)
+          f[n] = q + 1;
+      }
+    }
+    neg = n == 4 && fl[1] && f[1][0] == '-';
+    if (n != 4 || ref_uint(f[0], fl[0], UINT64_MAX, &v[0]) ||
+        ref_uint(f[1] + neg, fl[1] - neg, (unsigned) INT32_MAX + neg,
+                 &v[1]) ||
+        ref_uint(f[2], fl[2], UINT64_MAX, &v[2]) ||
+        ref_uint(f[3], fl[3], UINT32_MAX, &v[3])) {
+      c->bad++;
+    } else {
+      c->tid[c->n] = v[0];
+      c->ctx[c->n] = neg ? (int32_t) -(int64_t) v[1] : (int32_t) v[1];
+      c->sec[c->n] = v[2];
+      c->usec[c->n] = v[3];
+      c->n++;
+    }
+    line = le + 1;
+  }
+}
+
+static int same_cols(const struct ctxparse_cols *a,
+                     const struct ctxparse_cols *b)
+{
+  return a->n == b->n && a->bad == b->bad &&
+         !memcmp(a->tid, b->tid, a->n * sizeof(*a->tid)) &&
+         !memcmp(a->ctx, b->ctx, a->n * sizeof(*a->ctx)) &&
+         !memcmp(a->sec, b->sec, a->n * sizeof(*a->sec)) &&
+         !memcmp(a->usec, b->usec, a->n * sizeof(*a->usec));
+}
+
+static int cmp_ctx(const void *a, const void *b)
+{
+  int32_t x = ((const struct ctxparse_agg *) a)->ctx;
+  int32_t y = ((const struct ctxparse_agg *) b)->ctx;
+
+  return (x > y) - (x < y);
+}
+
+static int before(uint64_t s1, uint32_t u1, uint64_t s2, uint32_t u2)
+{
+  return s1 < s2 || (s1 == s2 && u1 < u2);
+}
+
+// The reference columns' totals, sorted by ctx. Returns how many.
+static size_t ref_agg(const struct ctxparse_cols *ref,
+                      struct ctxparse_agg *out)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < ref->n; i++)
+    out[i] = (struct ctxparse_agg) { ref->ctx[i], 1, ref->sec[i],
+                                     ref->sec[i], ref->usec[i],
+                                     ref->usec[i] };
+  qsort(out, ref->n, sizeof(*out), cmp_ctx);
+  for (i = 0; i < ref->n; i++) {
+    if (n && out[n - 1].ctx == out[i].ctx) {
+      out[n - 1].records++;
+      if (before(out[i].first_sec, out[i].first_usec, out[n - 1].first_sec,
+                 out[n - 1].first_usec)) {
+        out[n - 1].first_sec = out[i].first_sec;
+        out[n - 1].first_usec = out[i].first_usec;
+      }
+      if (before(out[n - 1].last_sec, out[n - 1].last_usec, out[i].last_sec,
+                 out[i].last_usec)) {
+        out[n - 1].last_sec = out[i].last_sec;
+        out[n - 1].last_usec = out[i].last_usec;
+      }
+    } else {
+      out[n++] = out[i];
+    }
+  }
+  return n;
+}
+
+// Check ctxparse_aggregate() against the reference totals.
+static void check_agg(const char *buf, size_t len,
+                      const struct ctxparse_cols *ref,
+                      const struct ctxparse_agg *want, size_t n_want,
+                      int n_threads, int round)
+{
+  struct ctxparse_agg *agg;
+  size_t lines, bad, i;
+  long n = ctxparse_aggregate(buf, len, n_threads, &agg, &lines, &bad);
+
+  check(n >= 0, "aggregation failed", round);
+  if (n < 0)
+    return;
+  check(lines == ref->n && bad == ref->bad, "aggregate line counts", round);
+  check((size_t) n == n_want, "aggregate context count", round);
+  for (i = 0; i < (size_t) n && i < n_want; i++)
+    check(agg[i].ctx == want[i].ctx && agg[i].records == want[i].records &&
+          agg[i].first_sec == want[i].first_sec &&
+          agg[i].first_usec == want[i].first_usec &&
+          agg[i].last_sec == want[i].last_sec &&
+          agg[i].last_usec == want[i].last_usec, "wrong aggregate", round);
+  free(agg);
+}
+
+int main(int argc, char **argv)
+{
+  struct ctxparse_cols ref, got;
+  int rounds = 2000, round, isa, best = ctxparse_best_isa(), t;
+  const char *p;
+  struct ctxparse_agg want[MAX_LINES];
+  size_t len, cap, caps[2], n_want;
+  char *buf;
+  int k;
+
+  if (argc > 1)
+    rounds = atoi(argv[1]);
+  rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x5eed;
+  if (!rng_state)
+    rng_state = 1;
+  if (ctxparse_cols_init(&ref, MAX_LINES) ||
+      ctxparse_cols_init(&got, MAX_LINES))
+    fail("Failed to allocate columns\n");
+
+  for (round = 0; round < rounds; round++) {
+    buf = gen_buf(&len);
+    ref.n = ref.bad = 0;
+    ref_parse(buf, len, &ref);
+    for (isa = CTXPARSE_SCALAR; isa <= best; isa++) {
+      ctxparse_set_isa(isa);
+      // All at once, then in batches of a random size.
+      caps[0] = MAX_LINES;
+      caps[1] = 1 + rnd() % 50;
+      for (k = 0; k < 2; k++) {
+        cap = caps[k];
+        got.n = got.bad = 0;
+        p = buf;
+        while (p < buf + len && got.n < MAX_LINES) {
+          got.cap = got.n + cap < MAX_LINES ? got.n + cap : MAX_LINES;
+          ctxparse_lines(&p, buf + len, &got);
+        }
+        check(same_cols(&got, &ref), isa == CTXPARSE_SCALAR ?
+              "scalar parser differs" : "vector parser differs", round);
+      }
+    }
+    n_want = ref_agg(&ref, want);
+    for (t = 1; t <= 8; t *= 2)
+      check_agg(buf, len, &ref, want, n_want, t, round);
+    free(buf);
+  }
+
+  ctxparse_cols_free(&ref);
+  ctxparse_cols_free(&got);
+  printf("parsefuzz: %d rounds, %d instruction sets: %d errors\n", rounds,
+         best + 1, errors);
+  return errors != 0;
+}
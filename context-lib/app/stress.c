@@ -0,0 +1,351 @@
+/*
+ * Stress test for the shared context tables.
+ *
+ * Usage: stress [threads] [iterations]
+ *
+ * Build without debug output, e.g. `make CFLAGS_DEBUG= stress`. Run with
+ * LCTX_RECLAIM=1 or LCTX_MEM_CAP to check that the churn and server phases
+ * stay bounded (the server phase never releases its delegators), with
+ * LCTX_CHAINS=1 to check the chains of the pipeline phase, and with
+ * LCTX_SHM=1 to read the runtime phase's shared memory from another thread
+ * as a monitor would. With LCTX_LOG_MODE=mmap, a log
+ * phase fills several segments of context.log from every thread and
+ * checks that each record made it in.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "ctbl.h"
+#include "ctxlog.h"
+#include "ctxshm.h"
+#include "delegation.h"
+#include "epoch.h"
+
+#define N_CTX 64
+#define N_DEL 32
+#define N_STAGES 4
+// Segments the log phase fills, and the ctx_id of its records.
+#define LOG_SEGS 3
+#define LOG_CTX (1 << 30)
+
+static int n_iters = 100000;
+static int n_threads = 8;
+static _Atomic long *tids;
+static int errors;
+static ctbl_t(int) tbl;
+static _Atomic int shm_done;
+
+static void check(int ok, const char *what, int t, int i)
+{
+  if (!ok) {
+    fprintf(stderr, "thread %d, iteration %d: %s\n", t, i, what);
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Drive the runtime the way instrumented workers do.
+static void *runtime_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  long tid = syscall(SYS_gettid), peer;
+  struct context *ctx;
+  struct delegator *del;
+  int i, c_id;
+
+  tids[t] = tid;
+  for (i = 0; i < n_iters; i++) {
+    c_id = (i * 7 + t) % N_CTX;
+    instrument_indicator(c_id);
+    ctx = get_thread_ctx(tid);
+    check(ctx && ctx->id == c_id, "wrong thread context", t, i);
+
+    instrument_delegator(i % N_DEL);
+    del = _get_del(i % N_DEL);
+    check(del && del->id == i % N_DEL, "missing delegator", t, i);
+
+    instrument_del_indicator(N_CTX + t);
+    ctx = get_thread_ctx(tid);
+    check(ctx == NULL, "del indicator context was registered", t, i);
+
+    // Cross-thread query; the peer may not have started or may be done.
+    if ((peer = tids[(t + 1) % n_threads])) {
+      epoch_enter();
+      ctx = get_thread_ctx(peer);
+      check(!ctx || (ctx->id >= 0 && ctx->id < N_CTX), "bad peer context",
+            t, i);
+      epoch_exit();
+    }
+  }
+  return NULL;
+}
+
+/* Read the thread slots of LCTX_SHM while the runtime workers switch: every
+ * copy must be a context they use, and a thread's switches never go back. */
+static void *shm_reader(void *arg)
+{
+  const struct ctxshm_hdr *hdr;
+  const struct ctxshm_thread *slots;
+  struct ctxshm_thread_snap snap;
+  uint64_t *last;
+  long *last_tid, reads = 0;
+  char name[NAME_MAX];
+  uint32_t i;
+
+  (void) arg;
+  ctxshm_name(name, sizeof(name), getenv("LCTX_SHM"), getpid());
+  hdr = ctxshm_map(name);
+  check(hdr != NULL, "shared memory is missing", -1, -1);
+  if (!hdr)
+    return NULL;
+  slots = ctxshm_threads(hdr);
+  last = calloc(hdr->n_threads, sizeof(*last));
+  last_tid = calloc(hdr->n_threads, sizeof(*last_tid));
+  while (!atomic_load(&shm_done)) {
+    for (i = 0; i < ctxshm_n_threads(hdr); i++) {
+      if (ctxshm_read_thread(&slots[i], &snap))
+        continue;
+      reads++;
+      check(snap.ctx_id == CTXSHM_NO_CTX ||
+            (snap.ctx_id >= 0 && snap.ctx_id < N_CTX + n_threads),
+            "bad shared context", -1, i);
+      if (snap.tid == last_tid[i])
+        check(snap.switches >= last[i], "shared switches went back", -1, i);
+      last_tid[i] = snap.tid;
+      last[i] = snap.switches;
+    }
+  }
+  check(reads > 0, "no shared thread slot was read", -1, -1);
+  free(last);
+  free(last_tid);
+  return NULL;
+}
+
+/* A context per request, as in a long-running server: each is entered once,
+ * handed to a delegator and released, with a few hot contexts in between. */
+static void *churn_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  int i, c_id;
+
+  for (i = 0; i < n_iters; i++) {
+    c_id = 2 * N_CTX + t * n_iters + i;
+    instrument_indicator(c_id);
+    check(get_current_ctx() && get_current_ctx()->id == c_id,
+          "wrong churn context", t, i);
+    instrument_delegator(c_id);
+    if (i % 16)
+      lctx_release_delegator(c_id);
+    instrument_indicator(i % N_CTX);
+  }
+  return NULL;
+}
+
+/* The same without lctx_release_delegator(), as PartitionPass and the MPI
+ * layer instrument code: each request's delegator is entered once and then
+ * left for the sweeps to find idle. */
+static void *server_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  int i, c_id;
+
+  for (i = 0; i < n_iters; i++) {
+    // Past the pipeline phase's ids.
+    c_id = 4 * N_CTX + (2 * n_threads + t) * n_iters + i;
+    instrument_indicator(c_id);
+    instrument_delegator(c_id);
+    instrument_del_enter(c_id);
+    check(get_current_ctx() && get_current_ctx()->id == c_id,
+          "wrong delegated context", t, i);
+    instrument_del_indicator(i % N_CTX);
+  }
+  return NULL;
+}
+
+/* Nested delegation: each stage enters the subtask the previous one
+ * created, derives a context of its own and creates the next subtask. */
+static void *pipeline_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  int i, s, base, chain[N_STAGES];
+
+  for (i = 0; i < n_iters / N_STAGES; i++) {
+    base = 4 * N_CTX + (t * n_iters + i * N_STAGES) * 2;
+    // Back to work outside any delegation, so base is a root.
+    instrument_del_indicator(NO_CTX);
+    for (s = 0; s < N_STAGES; s++) {
+      if (s)
+        instrument_del_enter(base + 2 * s - 1);
+      instrument_indicator(base + 2 * s);
+      instrument_delegator(base + 2 * s + 1);
+    }
+    if (!lctx_chains)
+      continue;
+    check(lctx_chain_ancestors(LCTX_CHAIN_CTX, base + 2 * (N_STAGES - 1),
+                               chain, N_STAGES) == N_STAGES - 1,
+          "wrong chain length", t, i);
+    for (s = 0; s < N_STAGES - 1; s++)
+      check(chain[s] == base + 2 * (N_STAGES - 2 - s), "wrong ancestor", t,
+            i);
+    check(lctx_chain_is_ancestor(LCTX_CHAIN_CTX, base,
+                                 base + 2 * (N_STAGES - 1)),
+          "root is not an ancestor", t, i);
+    check(!lctx_chain_is_ancestor(LCTX_CHAIN_CTX, base + 2 * (N_STAGES - 1),
+                                  base), "leaf is an ancestor", t, i);
+    check(lctx_chain_depth(LCTX_CHAIN_DEL, base + 2 * N_STAGES - 1) ==
+          N_STAGES - 1, "wrong delegator depth", t, i);
+  }
+  return NULL;
+}
+
+// Hammer one table directly: disjoint inserts, shared reads, removals.
+static void *table_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  int i, v;
+
+  for (i = 0; i < n_iters; i++) {
+    check(ctbl_set(&tbl, t * n_iters + i, i) == 0, "insert failed", t, i);
+    check(!ctbl_get(&tbl, t * n_iters + i, &v) && v == i, "lost insert", t, i);
+    if (!ctbl_get(&tbl, (t + 1) % n_threads * n_iters + i / 2, &v))
+      check(v == i / 2, "bad value from other thread", t, i);
+    if (i & 1)
+      ctbl_remove(&tbl, t * n_iters + i);
+  }
+  return NULL;
+}
+
+// Append straight to the mmap log, as thread t + 1.
+static void *log_worker(void *arg)
+{
+  int t = (int) (long) arg;
+  int i, n = LOG_SEGS * CTXLOG_SEG_RECS / n_threads + CTXLOG_SEG_CHUNK;
+
+  for (i = 0; i < n; i++)
+    check(ctxlog_mmap_append(t + 1, LOG_CTX, i, 0), "log is full", t, i);
+  return NULL;
+}
+
+// Count the log phase's records of each thread in every segment.
+static void check_log(void)
+{
+  struct ctxlog_rec recs[4096];
+  char path[64];
+  long *got = calloc(n_threads, sizeof(*got));
+  int t, seg, n = LOG_SEGS * CTXLOG_SEG_RECS / n_threads + CTXLOG_SEG_CHUNK;
+  size_t i, k;
+  FILE *in;
+
+  for (seg = 0;; seg++) {
+    if (seg)
+      snprintf(path, sizeof(path), "context.log.%d", seg);
+    else
+      snprintf(path, sizeof(path), "context.log");
+    in = fopen(path, "rb");
+    if (!in)
+      break;
+    fseek(in, sizeof(struct ctxlog_hdr), SEEK_SET);
+    while ((k = fread(recs, sizeof(recs[0]), 4096, in)) > 0) {
+      for (i = 0; i < k; i++) {
+        if (recs[i].ctx_id == LOG_CTX && recs[i].tid >= 1 &&
+            recs[i].tid <= (uint32_t) n_threads)
+          got[recs[i].tid - 1]++;
+      }
+    }
+    fclose(in);
+  }
+  check(seg > LOG_SEGS, "log did not rotate", -1, -1);
+  for (t = 0; t < n_threads; t++)
+    check(got[t] == n, "log records missing", t, -1);
+  free(got);
+}
+
+static void run(void *(*fn)(void *))
+{
+  pthread_t *threads = malloc(sizeof(*threads) * n_threads);
+  long t;
+
+  for (t = 0; t < n_threads; t++)
+    if (pthread_create(&threads[t], NULL, fn, (void *) t))
+      fail("Failed to create thread %ld\n", t);
+  for (t = 0; t < n_threads; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+}
+
+int main(int argc, char **argv)
+{
+  struct lctx_mem_stats mem;
+  pthread_t reader;
+  const char *mode;
+  int t, i, v, found;
+
+  if (argc > 1)
+    n_threads = atoi(argv[1]);
+  if (argc > 2)
+    n_iters = atoi(argv[2]);
+  tids = calloc(n_threads, sizeof(*tids));
+
+  // Segments left by an earlier, longer run would be counted by check_log().
+  mode = getenv("LCTX_LOG_MODE");
+  if (mode && !strcmp(mode, "mmap")) {
+    char path[64];
+
+    for (i = 1;; i++) {
+      snprintf(path, sizeof(path), "context.log.%d", i);
+      if (unlink(path))
+        break;
+    }
+  }
+
+  init_lctx();
+  if (lctx_shm && pthread_create(&reader, NULL, shm_reader, NULL))
+    fail("Failed to create the shared memory reader\n");
+  run(runtime_worker);
+  if (lctx_shm) {
+    atomic_store(&shm_done, 1);
+    pthread_join(reader, NULL);
+  }
+  run(churn_worker);
+  // Before the pipeline, whose delegators keep their contexts.
+  lctx_get_mem_stats(&mem);
+  if (lctx_reclaim)
+    check(mem.contexts < (size_t) n_threads * n_iters / 4 +
+          2 * RECLAIM_SWEEP_EVERY,
+          "contexts were not reclaimed", -1, -1);
+  run(server_worker);
+  // Idle delegators, and then their contexts, go within a few sweeps.
+  lctx_get_mem_stats(&mem);
+  if (lctx_reclaim)
+    check(mem.contexts + mem.delegators <
+          (RECLAIM_DEL_IDLE_SWEEPS + 2) * RECLAIM_SWEEP_EVERY +
+          4 * N_CTX + n_threads,
+          "delegators were not reclaimed", -1, -1);
+  run(pipeline_worker);
+
+  ctbl_init(&tbl);
+  run(table_worker);
+  for (t = 0; t < n_threads; t++) {
+    for (i = 0; i < n_iters; i++) {
+      found = !ctbl_get(&tbl, t * n_iters + i, &v);
+      check((i & 1) ? !found : found && v == i, "final table state", t, i);
+    }
+  }
+  ctbl_deinit(&tbl);
+
+  if (mode && !strcmp(mode, "mmap")) {
+    run(log_worker);
+    ctxlog_mmap_flush(1);
+    check_log();
+  }
+
+  printf("%d threads x %d iterations: %d errors\n", n_threads, n_iters,
+         errors);
+  return errors != 0;
+}
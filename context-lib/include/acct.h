@@ -0,0 +1,68 @@
+#ifndef __ACCT_H__
+#define __ACCT_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "pmu.h"
+
+/*
+ * Per-context time accounting.
+ *
+ * With LCTX_ACCT=wall each context switch charges the interval the thread
+ * just spent to the context it is leaving, and counts a switch into the
+ * one it enters. LCTX_ACCT=cpu also charges the thread's CPU time, which
+ * costs a clock_gettime(CLOCK_THREAD_CPUTIME_ID) per switch.
+ *
+ * Wall time is read with rdtsc where available (CLOCK_MONOTONIC_COARSE
+ * elsewhere) and converted to ns when queried, against CLOCK_MONOTONIC
+ * over the life of the process. Time a thread spends in a context id that
+ * was never added is not charged.
+ *
+ * Totals include an interval once it is closed: by a switch, by its
+ * thread exiting, or, for the calling thread, by a query. At exit the
+ * totals are written to LCTX_ACCT_FILE (default context.acct) as
+ * ctx|switches|wall_ns|cpu_ns lines sorted by ctx, followed by
+ * |<counter>|<counter>|<counter> with LCTX_PMU (see pmu.h). A context
+ * freed by LCTX_RECLAIM takes its totals with it.
+ */
+
+#define ACCT_WALL 1
+#define ACCT_CPU 2
+
+// A context's accumulators; updated by every thread.
+struct ctx_acct {
+  _Atomic uint64_t ticks;
+  _Atomic uint64_t cpu_ns;
+  _Atomic uint64_t switches;
+  _Atomic uint64_t pmu[PMU_EVENTS];
+};
+
+struct lctx_ctx_stats {
+  int ctx_id;
+  uint64_t switches;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;    // 0 unless LCTX_ACCT=cpu
+  uint64_t pmu[PMU_EVENTS];   // 0 unless LCTX_PMU
+};
+
+struct context;
+
+// 0, ACCT_WALL or ACCT_CPU, from LCTX_ACCT (or LCTX_PMU).
+extern int lctx_acct;
+
+void acct_init(void);
+// Close the calling thread's interval in from and open one in to.
+void acct_switch(struct context *from, struct context *to);
+/* The ticks and CLOCK_MONOTONIC ns of one moment in acct_init(). Returns 1
+ * if ticks are rdtsc cycles, 0 if they are ns. */
+int acct_epoch(uint64_t *ticks0, uint64_t *ns0);
+
+// Returns 0, or -1 if ctx_id was never added.
+int lctx_ctx_stats(int ctx_id, struct lctx_ctx_stats *st);
+/* Every context, sorted by ctx_id. Returns how many were stored in *out
+ * (malloc'd, freed by the caller), or -1 on allocation failure. */
+long lctx_all_ctx_stats(struct lctx_ctx_stats **out);
+// Write all totals to path in the LCTX_ACCT_FILE format.
+int lctx_acct_dump(const char *path);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * Per-thread bump allocator for runtime records (contexts, delegators).
+ *
+ * Each thread carves small records out of its own ARENA_CHUNK_SIZE chunks
+ * without locking. Memory is not returned to the system; a thread that
+ * exits leaves its arena, including the unused tail of its chunk, to the
+ * next thread that starts.
+ *
+ * Freed records of up to ARENA_FREE_MAX bytes go on the freeing thread's
+ * free list for their size and are handed out again before the chunk is
+ * bumped, so a workload that frees as much as it allocates stays bounded.
+ */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+#define ARENA_FREE_MAX 256
+
+struct arena_stats {
+  size_t chunks;    // chunks obtained from malloc
+  size_t reserved;  // bytes in those chunks
+  size_t used;      // bytes handed out
+  size_t allocs;    // records handed out
+};
+
+void *arena_alloc(size_t size);
+/* Undo the calling thread's most recent arena_alloc() of size bytes: roll
+ * the bump pointer back, or arena_free() p if it did not come from there. */
+void arena_unalloc(void *p, size_t size);
+// Give back a record of size bytes; any thread may free any record.
+void arena_free(void *p, size_t size);
+void arena_get_stats(struct arena_stats *stats);
+
+#endif
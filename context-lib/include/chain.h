@@ -0,0 +1,52 @@
+#ifndef __CHAIN_H__
+#define __CHAIN_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Delegation chains (LCTX_CHAINS=1).
+ *
+ * A thread that enters delegated work, through instrument_del_enter() or
+ * instrument_del_indicator(), runs on behalf of that context (and
+ * delegator) until it enters the next one. Contexts it switches to with an
+ * indicator meanwhile are children of that context, and delegators it
+ * creates are children of that delegator. So a subtask spawned by a
+ * subtask points back at the one that spawned it, however deep the
+ * pipeline. Threads that never entered delegated work create roots.
+ *
+ * Each id gets its parent once, from the first thread that links it, and
+ * a parent is always linked before its children, so chains cannot loop.
+ * Links are 8-byte entries in arrays indexed by id, allocated
+ * CHAIN_PAGE_IDS entries at a time on first use; negative ids are not
+ * tracked. Each new link is also logged, see ctxlog.h. Links outlive the
+ * records reclaim.h frees.
+ */
+
+#define CHAIN_PAGE_IDS 4096
+// Deepest chain the queries follow.
+#define CHAIN_MAX_DEPTH 4096
+
+enum lctx_chain_kind {
+  LCTX_CHAIN_CTX,
+  LCTX_CHAIN_DEL,
+};
+
+extern int lctx_chains;
+
+void chain_init(void);
+// Make parent the parent of id unless id already has one.
+void chain_link(enum lctx_chain_kind kind, int id, int parent);
+
+// id's parent, or NO_CTX for a root or an id that was never linked.
+int lctx_chain_parent(enum lctx_chain_kind kind, int id);
+// Links between id and its root.
+int lctx_chain_depth(enum lctx_chain_kind kind, int id);
+// Whether anc is id or one of its ancestors.
+int lctx_chain_is_ancestor(enum lctx_chain_kind kind, int anc, int id);
+/* Store up to max ancestors of id in out, parent first. Returns how many
+ * id has, which may be more than were stored. */
+int lctx_chain_ancestors(enum lctx_chain_kind kind, int id, int *out,
+                         int max);
+
+#endif
@@ -35,11 +35,15 @@
     fprintf(stderr, __VA_ARGS__); \
 }
 
+#ifdef CONFIG_DEBUG
 #define T_DEBUG(...) \
 {\
     fprintf(stderr, "[DEBUG][%s:%d|%s]: ", __FILE__, __LINE__, __func__); \
     fprintf(stderr, __VA_ARGS__); \
 }
+#else
+#define T_DEBUG(...) {}
+#endif
 
 #define T_ERROR(...) \
 {\
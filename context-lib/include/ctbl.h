@@ -0,0 +1,109 @@
+#ifndef __CTBL_H__
+#define __CTBL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Concurrent hash table keyed by int with word-sized values (an int or a
+ * pointer to a record) stored inline in the slot.
+ *
+ * The table is split into CTBL_SHARDS shards chosen by key hash. Each shard
+ * is a linear-probing array of 16-byte slots, four to a cache line.
+ * Lookups and updates of existing keys are lock-free; inserts, removals and
+ * resizes take the shard's lock, so writers only contend when they hash to
+ * the same shard. Replaced slot arrays are freed through epoch.h once no
+ * reader can still see them.
+ *
+ * Values are returned by copy. Records hung off a pointer value are owned
+ * by the caller.
+ */
+
+#define CTBL_SHARDS 16
+
+struct ctbl_arr;
+
+struct ctbl_shard {
+  pthread_mutex_t lock;
+  _Atomic(struct ctbl_arr *) arr;
+  // Live and removed slots; both count towards the load factor.
+  unsigned nused;
+} __attribute__((aligned(64)));
+
+typedef struct {
+  struct ctbl_shard shards[CTBL_SHARDS];
+} ctbl_base_t;
+
+
+#define ctbl_t(T)\
+  struct { ctbl_base_t base; T *ref; }
+
+
+#define ctbl_init(m)\
+  ctbl_init_(&(m)->base)
+
+
+#define ctbl_deinit(m)\
+  ctbl_deinit_(&(m)->base)
+
+
+// Returns 0 and stores the value in *out if key exists, -1 otherwise.
+#define ctbl_get(m, key, out)\
+  ({ uintptr_t ctbl_v_;\
+     int ctbl_r_ = ctbl_get_(&(m)->base, key, &ctbl_v_);\
+     if (!ctbl_r_) *(out) = (__typeof__(*(m)->ref)) ctbl_v_;\
+     ctbl_r_; })
+
+
+#define ctbl_set(m, key, value)\
+  ctbl_set_(&(m)->base, key, (uintptr_t) (value))
+
+
+/* Insert value unless key exists, and store whichever value ends up in the
+ * table in *out. Returns 1 if value was inserted, 0 if key existed and -1
+ * on allocation failure. */
+#define ctbl_get_or_set(m, key, value, out)\
+  ({ uintptr_t ctbl_v_;\
+     int ctbl_r_ = ctbl_get_or_set_(&(m)->base, key, (uintptr_t) (value),\
+                                    &ctbl_v_);\
+     if (ctbl_r_ >= 0) *(out) = (__typeof__(*(m)->ref)) ctbl_v_;\
+     ctbl_r_; })
+
+
+#define ctbl_remove(m, key)\
+  ctbl_remove_(&(m)->base, key)
+
+
+/* Size the shards for about n keys, spread evenly, so inserts up to then
+ * do not resize. Returns -1 on allocation failure. */
+#define ctbl_reserve(m, n)\
+  ctbl_reserve_(&(m)->base, n)
+
+
+/* Call fn(key, value, arg) for every key in the table. Keys inserted or
+ * removed during the walk may or may not be visited. fn runs inside an
+ * epoch section and must not modify the table. */
+#define ctbl_foreach(m, fn, arg)\
+  ctbl_foreach_(&(m)->base, fn, arg)
+
+
+// Bytes held by the slot arrays.
+#define ctbl_bytes(m)\
+  ctbl_bytes_(&(m)->base)
+
+
+void ctbl_init_(ctbl_base_t *m);
+void ctbl_deinit_(ctbl_base_t *m);
+int ctbl_get_(ctbl_base_t *m, int key, uintptr_t *value);
+int ctbl_set_(ctbl_base_t *m, int key, uintptr_t value);
+int ctbl_get_or_set_(ctbl_base_t *m, int key, uintptr_t value,
+                     uintptr_t *stored);
+void ctbl_remove_(ctbl_base_t *m, int key);
+int ctbl_reserve_(ctbl_base_t *m, unsigned n);
+size_t ctbl_bytes_(ctbl_base_t *m);
+void ctbl_foreach_(ctbl_base_t *m, void (*fn)(int, uintptr_t, void *),
+                   void *arg);
+
+#endif
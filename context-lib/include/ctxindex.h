@@ -0,0 +1,132 @@
+#ifndef __CTXINDEX_H__
+#define __CTXINDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Columnar index over a binary context log (see ctxlog.h), for the offline
+ * tools. Not part of the runtime.
+ *
+ * Each log record other than a chain link starts an interval: its thread
+ * is in ctx_id from the record's time until that thread's next record, or
+ * until the last timestamp in the log for the thread's final record.
+ * Times are microseconds since the epoch.
+ *
+ * The index holds those intervals twice: sorted by (tid, start) and by
+ * (ctx_id, start). Each copy has a directory with per-thread and
+ * per-context totals, so the common questions are answered with binary
+ * searches instead of a scan. It is built by external merge sort in runs
+ * of at most run_recs records, so logs much larger than memory are fine,
+ * and is read back with mmap.
+ *
+ * ctxindex_build_parallel() builds the same index in memory on several
+ * threads: each sorts a share of the mapped log, then the threads' and
+ * then the contexts' sorted runs from every share are merged, each worker
+ * taking a range of them with about the same number of records. It needs
+ * about 48 bytes of memory per record, and a thread or context with most
+ * of the log's records limits how far it scales.
+ */
+
+#define CTXIDX_MAGIC "LCTXIDX"
+#define CTXIDX_VERSION 1
+// Default records per in-memory sort run (about 100 MB).
+#define CTXIDX_RUN_RECS (1 << 22)
+
+struct ctxidx_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  // The log the index was built from; a mismatch means it is stale.
+  uint64_t log_size;
+  uint64_t log_mtime;
+  uint64_t nrecs;
+  uint64_t nthreads;
+  uint64_t nctxs;
+  uint64_t t_min;
+  uint64_t t_max;
+  // File offsets of the columns and directories below.
+  uint64_t off_t_ctx;       // int32_t[nrecs], by thread
+  uint64_t off_t_start;     // uint64_t[nrecs], by thread
+  uint64_t off_c_tid;       // uint32_t[nrecs], by context
+  uint64_t off_c_start;     // uint64_t[nrecs], by context
+  uint64_t off_c_end;       // uint64_t[nrecs], by context
+  uint64_t off_c_maxend;    // running max of c_end within each context
+  uint64_t off_threads;     // struct ctxidx_thread[nthreads]
+  uint64_t off_ctxs;        // struct ctxidx_ctx[nctxs]
+};
+
+// A thread's rows are [first, first + count) of the by-thread columns.
+struct ctxidx_thread {
+  uint32_t tid;
+  uint32_t reserved;
+  uint64_t first;
+  uint64_t count;
+  // Records whose ctx_id differs from the thread's previous one.
+  uint64_t switches;
+  uint64_t t_first;
+  uint64_t t_last;
+};
+
+// A context's rows are [first, first + count) of the by-context columns.
+struct ctxidx_ctx {
+  int32_t ctx_id;
+  uint32_t reserved;
+  uint64_t first;
+  uint64_t count;
+  // Time spent in the context, summed over threads.
+  uint64_t residency;
+};
+
+struct ctxindex {
+  const struct ctxidx_hdr *hdr;
+  const int32_t *t_ctx;
+  const uint64_t *t_start;
+  const uint32_t *c_tid;
+  const uint64_t *c_start;
+  const uint64_t *c_end;
+  const uint64_t *c_maxend;
+  const struct ctxidx_thread *threads;
+  const struct ctxidx_ctx *ctxs;
+  size_t map_size;
+};
+
+/* Build idx_path from the log at log_path (following mmap-mode segments).
+ * Returns 0, or -1 if the log cannot be read. */
+int ctxindex_build(const char *log_path, const char *idx_path,
+                   size_t run_recs);
+
+/* ctxindex_build() in memory on n_threads threads (0: one per CPU).
+ * Returns 0, or -1 if the log cannot be read. */
+int ctxindex_build_parallel(const char *log_path, const char *idx_path,
+                            int n_threads);
+
+/* Map idx_path, first (re)building it if it is missing or older than the
+ * log: by external sort if n_threads < 0, else in parallel. idx_path may
+ * be NULL for <log_path>.idx. Returns NULL on error. */
+struct ctxindex *ctxindex_open(const char *log_path, const char *idx_path,
+                               size_t run_recs, int n_threads);
+void ctxindex_close(struct ctxindex *ix);
+
+// Directory lookups; NULL if the thread or context never appears.
+const struct ctxidx_thread *ctxindex_thread(const struct ctxindex *ix,
+                                            uint32_t tid);
+const struct ctxidx_ctx *ctxindex_ctx(const struct ctxindex *ix,
+                                      int32_t ctx_id);
+
+/* Threads that were in ctx_id at some point in [t0, t1], sorted and
+ * without duplicates. Returns how many were stored in *tids (malloc'd,
+ * freed by the caller), or -1 on allocation failure. */
+long ctxindex_threads_in(const struct ctxindex *ix, int32_t ctx_id,
+                         uint64_t t0, uint64_t t1, uint32_t **tids);
+
+/* The by-thread rows of tid whose intervals overlap [t0, t1], as
+ * [*first, *first + return value). */
+size_t ctxindex_thread_rows(const struct ctxindex *ix, uint32_t tid,
+                            uint64_t t0, uint64_t t1, size_t *first);
+
+// End of by-thread row i: the next row's start, or t_max for the last.
+uint64_t ctxindex_row_end(const struct ctxindex *ix,
+                          const struct ctxidx_thread *t, size_t i);
+
+#endif
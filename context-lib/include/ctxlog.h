@@ -0,0 +1,111 @@
+#ifndef __CTXLOG_H__
+#define __CTXLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary context log.
+ *
+ * context.log starts with a ctxlog_hdr followed by a flat array of
+ * fixed-size ctxlog_rec records, one per context switch. Records are staged
+ * in a per-thread ring and written out in batches, so a switch costs a
+ * store into the ring rather than a formatted write + fflush.
+ *
+ * Records are ordered per thread, not globally: each ring is drained as a
+ * unit. Use tools/ctxdecode to turn the file back into tid|ctx|sec|usec text.
+ *
+ * By default a thread whose ring fills up writes it out itself. With
+ * LCTX_LOG_MODE=async (or ctxlog_start_writer()) a background thread drains
+ * all rings in batched writev calls instead, and LCTX_LOG_OVERFLOW=
+ * block|drop|spill picks what a thread does if its ring still fills up.
+ *
+ * LCTX_LOG_MODE=mmap skips the rings: records are written straight into
+ * preallocated, memory-mapped segment files (context.log, context.log.1,
+ * ...) of CTXLOG_SEG_RECS records each. A record's tid is stored last, so
+ * after a crash every record with a nonzero tid is complete; readers skip
+ * the rest.
+ *
+ * In any mode, LCTX_SAMPLE=<fraction> logs a random fraction of context
+ * switches and LCTX_SAMPLE_QUANTUM_US=<us> at most one per thread per
+ * quantum. Only the log is sampled; the runtime tables stay exact. The
+ * header's sample_ppm gives the share of switches that made it in.
+ *
+ * LCTX_LOG_MODE=off disables the log entirely.
+ *
+ * With LCTX_CHAINS (see chain.h) the log also holds link records, whose
+ * tid is CTXLOG_LINK_TID: ctx_id is a context, or a delegator if usec is
+ * CTXLOG_LINK_DEL, and sec is its parent as an int32_t. A link is logged
+ * once, when it is made, so a chain is rebuilt by following links back
+ * from its last element. Links are never sampled.
+ */
+
+#define CTXLOG_MAGIC "LCTXLOG"
+#define CTXLOG_VERSION 1
+
+// Records per thread ring. Must be a power of 2.
+#define CTXLOG_RING_RECS 512
+// How often the writer thread drains the rings when nobody wakes it.
+#define CTXLOG_WRITER_PERIOD_MS 10
+// Records per mmap segment file, and per reservation from a segment.
+#define CTXLOG_SEG_RECS (1 << 20)
+#define CTXLOG_SEG_CHUNK 64
+#define CTXLOG_MAX_SEGS 4096
+
+// ctxlog_hdr.flags
+#define CTXLOG_F_SEGMENTED 1   // mmap log: continues in <path>.<segment + 1>
+#define CTXLOG_F_SAMPLED 2     // not every context switch was logged
+#define CTXLOG_LINK_TID UINT32_MAX
+// ctxlog_rec.usec of a link record
+#define CTXLOG_LINK_CTX 0
+#define CTXLOG_LINK_DEL 1
+// Switches counted per thread before they are added to the totals.
+#define CTXLOG_SAMPLE_BATCH 256
+
+// What a thread does when its ring is full and the writer has not caught up.
+enum ctxlog_overflow {
+  CTXLOG_BLOCK,   // wait for the writer
+  CTXLOG_DROP,    // discard the record and count it in ctxlog_hdr.dropped
+  CTXLOG_SPILL,   // write the ring out from this thread, as without a writer
+};
+
+struct ctxlog_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t rec_size;
+  uint32_t dropped;   // updated by ctxlog_flush()
+  uint32_t flags;
+  uint32_t segment;
+  // CTXLOG_F_SAMPLED: logged switches per million, updated by ctxlog_flush().
+  uint32_t sample_ppm;
+};
+
+struct ctxlog_rec {
+  uint32_t tid;
+  int32_t ctx_id;
+  uint32_t sec;
+  uint32_t usec;
+};
+
+void ctxlog_open(const char *path);
+void ctxlog_append(long tid, int ctx_id);
+// Log that id (a CTXLOG_LINK_* kind) has parent.
+void ctxlog_append_link(int kind, int id, int parent);
+// Drain every thread's ring to the log file.
+void ctxlog_flush(void);
+void ctxlog_close(void);
+// Hand draining to a background writer thread; stopped at exit.
+void ctxlog_start_writer(enum ctxlog_overflow policy);
+unsigned long ctxlog_dropped(void);
+
+// The mmap backend (ctxlog_mmap.c), used by the calls above in mmap mode.
+// flags are added to every segment's header.
+void ctxlog_mmap_open(const char *path, uint32_t flags);
+// Store v in the first segment's header at offset off.
+void ctxlog_mmap_set_hdr(size_t off, uint32_t v);
+// Returns 0 if the record could not be stored.
+int ctxlog_mmap_append(uint32_t tid, int ctx_id, uint32_t sec, uint32_t usec);
+void ctxlog_mmap_flush(int sync);
+void ctxlog_mmap_close(void);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __CTXMPI_H__
+#define __CTXMPI_H__
+
+/*
+ * Contexts across MPI ranks (mpi/ctxmpi.c, libcontext_mpi).
+ *
+ * Linked ahead of MPI, the layer wraps MPI_Init, MPI_Finalize, the
+ * blocking and MPI_Isend sends, MPI_Recv and MPI_Sendrecv through the PMPI
+ * profiling interface. Data messages are sent unchanged. Each (peer, tag)
+ * pair is a stream whose messages MPI delivers in order, and the receiver
+ * numbers them as the sender does. When a send goes out in a different
+ * context than the last one on its stream, the sender first tells the
+ * receiver, on a communicator of its own, the message number the new
+ * context starts at. Sends in an unchanged context cost a table lookup.
+ *
+ * One side message batches every stream to the same peer: each other
+ * stream that was last used in a different context is announced in the
+ * new one as well. A later announcement for the same message number
+ * overrides it, so a stream that goes on in its old context corrects the
+ * guess at its next send.
+ *
+ * MPI_Recv and MPI_Sendrecv apply the context of the message they
+ * received with instrument_del_indicator(): the receiving thread then
+ * works on behalf of the sender's context, and what it delegates descends
+ * from it. Messages sent outside any context leave the receiver's context
+ * alone.
+ *
+ * Caveats:
+ *   - ctx_ids are used as they are; programs must keep them unique across
+ *     ranks (e.g. from the rank and a local counter).
+ *   - Every rank must link the layer, and receive on a stream only with
+ *     MPI_Recv or MPI_Sendrecv, or message numbers drift apart; other
+ *     receives are not attributed.
+ *   - Streams are per peer and tag, on any communicator.
+ *   - Announcements are sent before their message, but MPI only orders
+ *     messages within one communicator. Open MPI and MPICH deliver them in
+ *     order between two processes; elsewhere a context can arrive one
+ *     message late.
+ *   - Concurrent sends on one stream from threads in different contexts
+ *     may be attributed to each other, as MPI does not order them either.
+ */
+
+struct lctx_mpi_stats {
+  unsigned long sends;        // data messages sent on streams
+  unsigned long recvs;        // data messages received on streams
+  unsigned long side_msgs;    // announcement messages sent
+  unsigned long records;      // stream announcements they carried
+  unsigned long applied;      // receives that switched context
+};
+
+// This rank's counters; all zero without MPI_Init through the layer.
+void lctx_mpi_get_stats(struct lctx_mpi_stats *st);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __CTXPARSE_H__
+#define __CTXPARSE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parser for text context logs, for the offline tools. Not part of the
+ * runtime.
+ *
+ * The text form is what ctxdecode prints and what the runtime wrote
+ * before context.log went binary: one tid|ctx|sec|usec line per record.
+ * A line is valid if tid and sec are 1-20 decimal digits that fit in
+ * 64 bits, ctx is an optionally negative decimal that fits in an int32_t,
+ * usec is decimal that fits in 32 bits, and it ends with '\n' or the
+ * end of the input. Anything else, including link|... lines and empty
+ * lines, is counted as bad and skipped.
+ *
+ * Lines are parsed into columns. With SSE4.2 (pcmpistrm) or AVX2 a line's
+ * delimiters are found with one or two vector compares, and fields of up
+ * to 16 digits are checked and converted with SSSE3/SSE4.1 multiply-adds.
+ * Anything else, and the last 64 bytes of the input, goes through the
+ * scalar parser, which is the one that defines the format. The best level
+ * the CPU has is picked at run time.
+ *
+ * ctxparse_aggregate() splits a buffer at line boundaries across threads,
+ * each parsing its part in batches and folding every batch into
+ * per-context totals, which are merged at the end.
+ */
+
+#define CTXPARSE_BATCH 4096
+
+enum ctxparse_isa {
+  CTXPARSE_SCALAR,
+  CTXPARSE_SSE42,
+  CTXPARSE_AVX2,
+};
+
+// Parsed records, one array per field; cap is the room in each.
+struct ctxparse_cols {
+  uint64_t *tid;
+  int32_t *ctx;
+  uint64_t *sec;
+  uint32_t *usec;
+  size_t n, cap;
+  // Bad lines skipped so far.
+  size_t bad;
+};
+
+// A context's records, and the earliest and latest of their times.
+struct ctxparse_agg {
+  int32_t ctx;
+  uint64_t records;
+  uint64_t first_sec, last_sec;
+  uint32_t first_usec, last_usec;
+};
+
+// The best level this CPU supports.
+enum ctxparse_isa ctxparse_best_isa(void);
+/* Parse with isa from now on (lowered to what the CPU supports). Returns
+ * the level used. */
+enum ctxparse_isa ctxparse_set_isa(enum ctxparse_isa isa);
+
+int ctxparse_cols_init(struct ctxparse_cols *c, size_t cap);
+void ctxparse_cols_free(struct ctxparse_cols *c);
+
+/* Parse lines from *p until end or until c is full, appending to c and
+ * advancing *p past the last line parsed. */
+void ctxparse_lines(const char **p, const char *end,
+                    struct ctxparse_cols *c);
+
+/* Per-context totals of buf on n_threads threads (0: one per CPU). Returns
+ * how many contexts were stored in *out (malloc'd, sorted by ctx), or -1.
+ * *lines and *bad get the record and bad line counts. */
+long ctxparse_aggregate(const char *buf, size_t len, int n_threads,
+                        struct ctxparse_agg **out, size_t *lines,
+                        size_t *bad);
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef __CTXSHM_H__
+#define __CTXSHM_H__
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "acct.h"
+
+/*
+ * Live context state in POSIX shared memory (LCTX_SHM).
+ *
+ * LCTX_SHM=<name> publishes each thread's current context, and the
+ * per-context counters of acct.h, in the shared memory object <name>
+ * ("/lctx.<pid>" for LCTX_SHM=1), for a monitor process to read (see
+ * tools/ctxtop.c). The object is unlinked when the process exits.
+ * LCTX_SHM_THREADS and LCTX_SHM_CTXS size it (default 1024 threads and
+ * 65536 contexts); threads and contexts beyond that are not published.
+ *
+ * The segment is a ctxshm_hdr, then n_threads ctxshm_thread slots, then
+ * n_ctxs ctxshm_ctx slots, each on its own cache line. A thread owns its
+ * slot: a switch bumps the slot's sequence number to odd, stores the new
+ * context and bumps it back to even, with no locks, atomic read-modify-
+ * writes or syscalls. A reader copies a slot between two loads of seq and
+ * retries if they differ or are odd. A context's counters are the ones
+ * acct.h updates, so they count with LCTX_ACCT or LCTX_PMU only; its
+ * slot's seq only covers which context the slot holds, as slots are reused
+ * once LCTX_RECLAIM frees theirs. Slots at or past threads_hw and ctxs_hw were
+ * never used.
+ *
+ * update_thread_ctx() for another thread shows up once that thread
+ * switches itself.
+ */
+
+#define CTXSHM_MAGIC 0x7874636cU  // "lctx"
+#define CTXSHM_VERSION 2
+// tid of a free thread slot.
+#define CTXSHM_FREE 0
+// ctx_id of a thread outside any context (NO_CTX) and of a free ctx slot.
+#define CTXSHM_NO_CTX INT_MIN
+#define CTXSHM_FREE_CTX CTXSHM_NO_CTX
+
+struct ctxshm_hdr {
+  // Set last, once the rest is valid.
+  _Atomic uint32_t magic;
+  uint32_t version;
+  int64_t pid;
+  uint32_t n_threads, n_ctxs;
+  // Slots ever claimed, which may run past n_threads and n_ctxs.
+  _Atomic uint32_t threads_hw, ctxs_hw;
+  _Atomic uint32_t exited;
+  // Ticks are rdtsc cycles if set, else ns; see acct.h.
+  uint32_t tsc;
+  // Ticks and CLOCK_MONOTONIC ns at the same moment, to convert ticks.
+  uint64_t t0_ticks, t0_ns;
+  uint64_t threads_off, ctxs_off;
+};
+
+struct ctxshm_thread {
+  _Atomic uint32_t seq;
+  _Atomic int32_t ctx_id;
+  _Atomic int64_t tid;
+  // Context switches the thread has made.
+  _Atomic uint64_t switches;
+} __attribute__((aligned(64)));
+
+struct ctxshm_ctx {
+  _Atomic uint32_t seq;
+  _Atomic int32_t ctx_id;
+  struct ctx_acct acct;
+} __attribute__((aligned(64)));
+
+// Consistent copies of a slot.
+struct ctxshm_thread_snap {
+  long tid;
+  int ctx_id;
+  uint64_t switches;
+};
+
+struct ctxshm_ctx_snap {
+  int ctx_id;
+  uint64_t ticks, cpu_ns, switches;
+  uint64_t pmu[PMU_EVENTS];
+};
+
+extern int lctx_shm;
+
+void ctxshm_init(void);
+// A slot for the calling thread, NULL if there is none left.
+struct ctxshm_thread *ctxshm_thread_claim(long tid);
+void ctxshm_thread_switch(struct ctxshm_thread *t, int ctx_id);
+void ctxshm_thread_release(struct ctxshm_thread *t);
+// Counters for a new context in a slot of its own, NULL if there is none.
+struct ctx_acct *ctxshm_ctx_claim(int ctx_id);
+// Give back acct's slot; no-op unless it came from ctxshm_ctx_claim().
+void ctxshm_ctx_release(struct ctx_acct *acct);
+
+/*----------------------------Reader side.---------------------------------*/
+static inline void ctxshm_name(char *buf, size_t size, const char *name,
+                               long pid)
+{
+  if (!name || !strcmp(name, "1"))
+    snprintf(buf, size, "/lctx.%ld", pid);
+  else
+    snprintf(buf, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+// Map the segment name read-only; NULL if it is missing or not a segment.
+static inline const struct ctxshm_hdr *ctxshm_map(const char *name)
+{
+  struct ctxshm_hdr *hdr;
+  struct stat st;
+  int fd = shm_open(name, O_RDONLY, 0);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return NULL;
+  }
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED)
+    return NULL;
+  if (atomic_load_explicit(&hdr->magic, memory_order_acquire) !=
+          CTXSHM_MAGIC || hdr->version != CTXSHM_VERSION) {
+    munmap(hdr, st.st_size);
+    return NULL;
+  }
+  return hdr;
+}
+
+static inline const struct ctxshm_thread *
+ctxshm_threads(const struct ctxshm_hdr *hdr)
+{
+  return (const void *) ((const char *) hdr + hdr->threads_off);
+}
+
+static inline const struct ctxshm_ctx *
+ctxshm_ctxs(const struct ctxshm_hdr *hdr)
+{
+  return (const void *) ((const char *) hdr + hdr->ctxs_off);
+}
+
+// Slots a reader has to look at.
+static inline uint32_t ctxshm_n_threads(const struct ctxshm_hdr *hdr)
+{
+  uint32_t hw = atomic_load_explicit(&hdr->threads_hw, memory_order_acquire);
+
+  return hw < hdr->n_threads ? hw : hdr->n_threads;
+}
+
+static inline uint32_t ctxshm_n_ctxs(const struct ctxshm_hdr *hdr)
+{
+  uint32_t hw = atomic_load_explicit(&hdr->ctxs_hw, memory_order_acquire);
+
+  return hw < hdr->n_ctxs ? hw : hdr->n_ctxs;
+}
+
+#define CTXSHM_READ_TRIES 64
+
+/* Copy slot t into *out. Returns 0, or -1 if the slot is free or kept
+ * changing. */
+static inline int ctxshm_read_thread(const struct ctxshm_thread *t,
+                                     struct ctxshm_thread_snap *out)
+{
+  uint32_t s;
+  int i;
+
+  for (i = 0; i < CTXSHM_READ_TRIES; i++) {
+    s = atomic_load_explicit(&t->seq, memory_order_acquire);
+    if (s & 1)
+      continue;
+    out->tid = atomic_load_explicit(&t->tid, memory_order_relaxed);
+    out->ctx_id = atomic_load_explicit(&t->ctx_id, memory_order_relaxed);
+    out->switches = atomic_load_explicit(&t->switches, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&t->seq, memory_order_relaxed) == s)
+      return out->tid == CTXSHM_FREE ? -1 : 0;
+  }
+  return -1;
+}
+
+static inline int ctxshm_read_ctx(const struct ctxshm_ctx *c,
+                                  struct ctxshm_ctx_snap *out)
+{
+  uint32_t s;
+  int i, j;
+
+  for (i = 0; i < CTXSHM_READ_TRIES; i++) {
+    s = atomic_load_explicit(&c->seq, memory_order_acquire);
+    if (s & 1)
+      continue;
+    out->ctx_id = atomic_load_explicit(&c->ctx_id, memory_order_relaxed);
+    out->ticks = atomic_load_explicit(&c->acct.ticks, memory_order_relaxed);
+    out->cpu_ns = atomic_load_explicit(&c->acct.cpu_ns,
+                                       memory_order_relaxed);
+    out->switches = atomic_load_explicit(&c->acct.switches,
+                                         memory_order_relaxed);
+    for (j = 0; j < PMU_EVENTS; j++)
+      out->pmu[j] = atomic_load_explicit(&c->acct.pmu[j],
+                                         memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&c->seq, memory_order_relaxed) == s)
+      return out->ctx_id == CTXSHM_FREE_CTX ? -1 : 0;
+  }
+  return -1;
+}
+
+#endif
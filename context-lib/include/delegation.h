@@ -1,45 +1,86 @@
 #ifndef __DELEGATION_H__
 #define __DELEGATION_H__
 
+#include <limits.h>
 #include <stdlib.h>
+#include "acct.h"
+#include "chain.h"
 #include "common.h"
-#include "map.h"
+#include "ctbl.h"
+#include "ctxshm.h"
+#include "reclaim.h"
 
+// ctx_id of a delegator created outside of any context.
+#define NO_CTX INT_MIN
+
+// refs and gen are only maintained with LCTX_RECLAIM; see reclaim.h.
 struct context
 {
-    char *id;
+    int id;
+    _Atomic int refs;
+    _Atomic unsigned gen;
+    // own_acct, or a slot of the LCTX_SHM segment (see ctxshm.h).
+    struct ctx_acct *acct;
+    struct ctx_acct own_acct;
 };
 
 struct delegator
 {
-    char *id;
-    char *ctx_id;
+    int id;
+    int ctx_id;
+    _Atomic unsigned gen;
 };
 
-typedef map_t(struct delegator) del_map_t;
-typedef map_t(struct context) ctx_map_t;
+// Per-thread state, shared with threads that query its context.
+struct lctx_thread
+{
+    long tid;
+    _Atomic int ctx_id;
+    // The thread's LCTX_SHM slot, if it has one.
+    struct ctxshm_thread *shm;
+};
 
-struct {
-    del_map_t m;
-} del_tbl;
+/* The tables are shared by every instrumented thread; see ctbl.h. ctx_tbl
+ * and del_tbl hold pointers to records allocated from arena.h, which are
+ * only freed with LCTX_RECLAIM. thread_tbl entries are freed through
+ * epoch.h when their thread exits. */
+typedef ctbl_t(struct delegator *) del_tbl_t;
+typedef ctbl_t(struct context *) ctx_tbl_t;
+typedef ctbl_t(struct lctx_thread *) thread_tbl_t;
 
-struct {
-    map_int_t m;
-} thread_tbl;
+extern del_tbl_t del_tbl;
+extern thread_tbl_t thread_tbl;
+extern ctx_tbl_t ctx_tbl;
 
-struct {
-    ctx_map_t m;
-} ctx_tbl;
+/* The calling thread's context id, NO_CTX if it has none. Code built with
+ * PartitionPass -partition-inline-fastpath reads it directly to skip
+ * instrument_indicator calls that would not change the context. */
+extern __thread int lctx_cur_ctx;
 
+/* LCTX_EXPECTED_CTXS=<n> presizes ctx_tbl and del_tbl for n entries.
+ * LCTX_ACCT turns on per-context time accounting; see acct.h. LCTX_PMU
+ * adds hardware counters to it; see pmu.h.
+ * LCTX_RECLAIM and LCTX_MEM_CAP bound the tables; see reclaim.h.
+ * LCTX_CHAINS tracks which delegated work each context came from; see
+ * chain.h. LCTX_SHM publishes live contexts to other processes; see
+ * ctxshm.h. */
 void init_lctx();
+long lctx_gettid();
 
 void update_thread_ctx(int tid, int ctx_id);
-void add_ctx(int ctx_id);
+/* With LCTX_RECLAIM, the records these return are only valid inside an
+ * epoch section; see reclaim.h. */
+struct context *add_ctx(int ctx_id);
 struct context *get_thread_ctx(int tid);
+// get_thread_ctx() for the calling thread, without a table lookup.
+struct context *get_current_ctx();
 
 // Instrumentation functions.
 void instrument_indicator(int c_id);
 void instrument_delegator(int del_id);
+void instrument_del_indicator(int ctx_id);
+// instrument_del_indicator() for the context del_id carries.
+void instrument_del_enter(int del_id);
 
 struct delegator *_get_del(int del_id);
 struct context *_get_ctx(int ctx_id);
@@ -0,0 +1,20 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/*
+ * Epoch-based memory reclamation.
+ *
+ * Lock-free readers bracket their accesses with epoch_enter()/epoch_exit().
+ * Writers that unlink an object hand it to epoch_retire(); it is freed once
+ * every thread that could still hold a reference has left its epoch.
+ * Sections nest and are cheap: enter/exit touch only thread-local state and
+ * one shared word per thread.
+ */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *p, void (*free_fn)(void *));
+// Try to advance the global epoch and free what is safe to free.
+void epoch_reclaim(void);
+
+#endif
@@ -15,9 +15,24 @@
 struct map_node_t;
 typedef struct map_node_t map_node_t;
 
+/* Nodes per bucket before the table doubles. */
+#ifndef MAP_MAX_LOAD
+#define MAP_MAX_LOAD 1
+#endif
+
+/* Old buckets moved into the new array by each map_set/map_remove while a
+ * resize is in progress. */
+#ifndef MAP_MIGRATE_STEP
+#define MAP_MIGRATE_STEP 4
+#endif
+
 typedef struct {
   map_node_t **buckets;
   unsigned nbuckets, nnodes;
+  /* The array being migrated away from; buckets below `migrated` are
+   * already empty. */
+  map_node_t **oldbuckets;
+  unsigned noldbuckets, migrated;
 } map_base_t;
 
 typedef struct {
@@ -51,6 +66,11 @@ typedef struct {
   map_remove_(&(m)->base, key)
 
 
+/* Size the table for n entries up front so it does not grow until then. */
+#define map_reserve(m, n)\
+  map_reserve_(&(m)->base, n)
+
+
 #define map_iter(m)\
   map_iter_()
 
@@ -63,6 +83,7 @@ void map_deinit_(map_base_t *m);
 void *map_get_(map_base_t *m, const char *key);
 int map_set_(map_base_t *m, const char *key, void *value, int vsize);
 void map_remove_(map_base_t *m, const char *key);
+int map_reserve_(map_base_t *m, unsigned n);
 map_iter_t map_iter_(void);
 const char *map_next_(map_base_t *m, map_iter_t *iter);
 
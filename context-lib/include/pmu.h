@@ -0,0 +1,56 @@
+#ifndef __PMU_H__
+#define __PMU_H__
+
+#include <stdint.h>
+
+/*
+ * Hardware counters per context (LCTX_PMU).
+ *
+ * LCTX_PMU=hw (or 1) charges PMU_EVENTS counters to contexts the way acct.h
+ * charges time, and turns on LCTX_ACCT=wall if it is off. Each thread
+ * opens its counters with perf_event_open() on its first switch, and each
+ * switch reads them and charges the deltas to the context the thread
+ * leaves. The counters come from the best source the process can open:
+ *
+ *   hw      cycles|instructions|cache-misses. Read with rdpmc from the
+ *           events' mmap'd pages where the kernel allows it, else with
+ *           one read() of the event group.
+ *   sw      task-clock|page-faults|context-switches: kernel software
+ *           events, which need no PMU (VMs, most containers). One read()
+ *           per switch.
+ *   rusage  the same three from getrusage(RUSAGE_THREAD), where
+ *           perf_event_open() is not allowed at all; task-clock is only as
+ *           fine as the kernel's CPU time accounting.
+ *
+ * LCTX_PMU=sw or rusage starts from that source instead; the choice is
+ * made once, in init_lctx(). A thread that cannot open its counters (e.g.
+ * out of fds) charges none. Kernel-side counts are included where
+ * perf_event_paranoid allows. Counters are not scaled when the kernel
+ * multiplexes them.
+ *
+ * The counts show up in lctx_ctx_stats.pmu, as three more columns of
+ * LCTX_ACCT_FILE, and in ctxshm.h's context slots.
+ */
+
+#define PMU_EVENTS 3
+
+#define PMU_HW 1
+#define PMU_SW 2
+#define PMU_RUSAGE 3
+
+// 0, or the PMU_* source in use, from LCTX_PMU.
+extern int lctx_pmu;
+
+void pmu_init(void);
+/* Read the calling thread's counters, opening them on first use. Returns
+ * 0, or -1 if the thread has none. */
+int pmu_read(uint64_t v[PMU_EVENTS]);
+// Close the calling thread's counters.
+void pmu_thread_exit(void);
+
+// "hw", "sw", "rusage" or "off".
+const char *lctx_pmu_source(void);
+// Name of counter i of the source in use.
+const char *lctx_pmu_name(int i);
+
+#endif
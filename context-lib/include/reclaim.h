@@ -0,0 +1,88 @@
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Reclamation of contexts and delegators (LCTX_RECLAIM=1).
+ *
+ * Contexts are reference counted: a thread holds a reference to its
+ * current context, and a delegator to the context it was created in. Every
+ * RECLAIM_SWEEP_EVERY new records a sweep frees the delegators that have
+ * not been created, bound or entered for RECLAIM_DEL_IDLE_SWEEPS sweeps,
+ * dropping their context references, and then the contexts that nobody
+ * has referenced since the previous sweep. A delegator freed while idle
+ * forgets its context, like an evicted one. lctx_release_delegator()
+ * frees one the program is done with right away.
+ *
+ * LCTX_MEM_CAP=<bytes>[k|m|g] implies LCTX_RECLAIM and caps the memory held
+ * by records and table slots. Usage is checked every RECLAIM_CHECK_EVERY
+ * new records; over the cap, unreferenced contexts and delegators are
+ * evicted least recently used first until usage is below
+ * RECLAIM_LOW_WATER of the cap. An evicted delegator forgets its context.
+ * Contexts that threads are in cannot be evicted, so usage can exceed a
+ * cap smaller than they need.
+ *
+ * Records are freed through epoch.h. With reclamation on, a record from
+ * _get_ctx(), _get_del() or get_thread_ctx() is only valid inside an epoch
+ * section.
+ *
+ * LCTX_MEM_STATS=1 prints the lctx_mem_stats at exit.
+ */
+
+#define RECLAIM_CHECK_EVERY 64
+#define RECLAIM_SWEEP_EVERY 4096
+#define RECLAIM_DEL_IDLE_SWEEPS 8
+#define RECLAIM_LOW_WATER 0.875
+
+// struct context.refs of a context that is being freed.
+#define CTX_DEAD (-(1 << 30))
+// struct delegator.ctx_id of a delegator that is being freed.
+#define DEL_DEAD (INT_MIN + 1)
+
+struct lctx_mem_stats {
+  size_t contexts;            // live records
+  size_t delegators;
+  size_t bytes;               // records plus table slots
+  size_t peak_bytes;          // as of the last check
+  unsigned long reclaimed;    // contexts and delegators freed by sweeps
+  unsigned long evicted;      // contexts and delegators evicted for the cap
+  long maxrss_kb;             // peak RSS of the whole process
+};
+
+struct context;
+struct delegator;
+
+// Reference counting and sweeps are on.
+extern int lctx_reclaim;
+// LRU clock; records are stamped with it when used.
+extern _Atomic unsigned lctx_lru_gen;
+
+// Mark a record as used in the current LRU generation.
+static inline void reclaim_touch(_Atomic unsigned *gen)
+{
+  unsigned g = atomic_load_explicit(&lctx_lru_gen, memory_order_relaxed);
+
+  if (atomic_load_explicit(gen, memory_order_relaxed) != g)
+    atomic_store_explicit(gen, g, memory_order_relaxed);
+}
+
+void reclaim_init(void);
+// Count a new context (del = 0) or delegator, and sweep if one is due.
+void reclaim_added(int del);
+
+/* Take a reference to ctx, found in ctx_tbl inside an epoch section.
+ * Returns -1 if it is being freed. */
+int ctx_tryget(struct context *ctx);
+// Drop a reference taken with ctx_tryget() or held by a delegator.
+void ctx_put(struct context *ctx);
+// Drop the delegator reference to the context with id ctx_id.
+void ctx_put_id(int ctx_id);
+
+// Forget a delegator the program is done with, and drop its context.
+void lctx_release_delegator(int del_id);
+void lctx_get_mem_stats(struct lctx_mem_stats *st);
+
+#endif
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <mpi.h>
+#include <pthread.h>
+#include "ctxmpi.h"
+#include "delegation.h"
+
+#if MPI_VERSION >= 3
+#define MPI_CONST const
+#else
+#define MPI_CONST
+#endif
+
+// Tag of announcements on side_comm.
+#define SIDE_TAG 1
+// Announcements per side message, so it stays an eager send.
+#define SIDE_MAX 64
+
+// Message seq on stream tag, and those after it, run in ctx.
+struct record {
+  int tag;
+  unsigned seq;
+  int ctx;
+};
+
+struct stream {
+  int tag;
+  // Messages sent or received so far.
+  unsigned seq;
+  // Send: context last announced. Recv: context of the last message.
+  int ctx;
+  // Recv: announcements not reached yet, in seq order, from head.
+  struct record *ahead;
+  size_t head, n_ahead, cap_ahead;
+};
+
+struct streams {
+  struct stream *s;
+  int n, cap;
+};
+
+struct peer {
+  struct streams send, recv;
+};
+
+static MPI_Comm side_comm = MPI_COMM_NULL;
+static MPI_Group world_group;
+static int world_size;
+// Indexed by rank in MPI_COMM_WORLD; all guarded by lock.
+static struct peer *peers;
+static struct lctx_mpi_stats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stream *find_stream(struct streams *ss, int tag)
+{
+  struct stream *s;
+  int i;
+
+  for (i = 0; i < ss->n; i++) {
+    if (ss->s[i].tag == tag)
+      return &ss->s[i];
+  }
+  if (ss->n == ss->cap) {
+    ss->cap = ss->cap ? ss->cap * 2 : 4;
+    ss->s = realloc(ss->s, ss->cap * sizeof(*ss->s));
+    if (!ss->s)
+      fail("Failed to allocate MPI streams!\n");
+  }
+  s = &ss->s[ss->n++];
+  memset(s, 0, sizeof(*s));
+  s->tag = tag;
+  s->ctx = NO_CTX;
+  return s;
+}
+
+// rank of comm (its remote group for an intercommunicator) in the world.
+static int world_rank(MPI_Comm comm, int rank)
+{
+  MPI_Group group;
+  int inter, w = MPI_UNDEFINED;
+
+  if (comm == MPI_COMM_WORLD)
+    return rank;
+  PMPI_Comm_test_inter(comm, &inter);
+  if (inter)
+    PMPI_Comm_remote_group(comm, &group);
+  else
+    PMPI_Comm_group(comm, &group);
+  PMPI_Group_translate_ranks(group, 1, &rank, world_group, &w);
+  PMPI_Group_free(&group);
+  return w == MPI_UNDEFINED ? -1 : w;
+}
+
+/* Count a send to dest on stream tag, announcing first if the calling
+ * thread's context is not the one the stream last ran in. */
+static void note_send(int dest, int tag, MPI_Comm comm)
+{
+  struct record out[SIDE_MAX];
+  struct stream *s, *o;
+  struct peer *p;
+  int ctx = lctx_cur_ctx, peer, n = 0, i;
+
+  if (side_comm == MPI_COMM_NULL || dest == MPI_PROC_NULL ||
+      (peer = world_rank(comm, dest)) < 0)
+    return;
+
+  pthread_mutex_lock(&lock);
+  p = &peers[peer];
+  s = find_stream(&p->send, tag);
+  if (s->ctx != ctx) {
+    out[n++] = (struct record) { tag, s->seq, ctx };
+    s->ctx = ctx;
+    // Guess the peer's other streams go on in this context too.
+    for (i = 0; i < p->send.n && n < SIDE_MAX; i++) {
+      o = &p->send.s[i];
+      if (o->ctx != ctx) {
+        out[n++] = (struct record) { o->tag, o->seq, ctx };
+        o->ctx = ctx;
+      }
+    }
+  }
+  s->seq++;
+  stats.sends++;
+  if (n) {
+    // Small enough to complete without the peer receiving it.
+    PMPI_Send(out, n * 3, MPI_INT, peer, SIDE_TAG, side_comm);
+    stats.side_msgs++;
+    stats.records += n;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void announce(struct peer *p, const struct record *r)
+{
+  struct stream *s = find_stream(&p->recv, r->tag);
+  struct record *last = s->n_ahead > s->head ? &s->ahead[s->n_ahead - 1] :
+                                               NULL;
+
+  // A correction of the guess made for the same message.
+  if (last && last->seq == r->seq) {
+    last->ctx = r->ctx;
+    return;
+  }
+  if (s->n_ahead == s->cap_ahead) {
+    s->cap_ahead = s->cap_ahead ? s->cap_ahead * 2 : 4;
+    s->ahead = realloc(s->ahead, s->cap_ahead * sizeof(*s->ahead));
+    if (!s->ahead)
+      fail("Failed to allocate MPI announcements!\n");
+  }
+  s->ahead[s->n_ahead++] = *r;
+}
+
+// Take the announcements peer has sent so far. Caller holds lock.
+static void drain(int peer)
+{
+  struct record in[SIDE_MAX];
+  MPI_Status st;
+  int flag, n, i;
+
+  for (;;) {
+    PMPI_Iprobe(peer, SIDE_TAG, side_comm, &flag, &st);
+    if (!flag)
+      return;
+    PMPI_Recv(in, SIDE_MAX * 3, MPI_INT, st.MPI_SOURCE, SIDE_TAG, side_comm,
+              &st);
+    PMPI_Get_count(&st, MPI_INT, &n);
+    for (i = 0; i < n / 3; i++)
+      announce(&peers[st.MPI_SOURCE], &in[i]);
+  }
+}
+
+// Count a message received from source on stream tag; returns its context.
+static int note_recv(int source, int tag, MPI_Comm comm)
+{
+  struct stream *s;
+  unsigned seq;
+  int peer, ctx;
+
+  if (side_comm == MPI_COMM_NULL || source == MPI_PROC_NULL ||
+      (peer = world_rank(comm, source)) < 0)
+    return NO_CTX;
+
+  pthread_mutex_lock(&lock);
+  drain(peer);
+  s = find_stream(&peers[peer].recv, tag);
+  seq = s->seq++;
+  while (s->head < s->n_ahead && (int) (s->ahead[s->head].seq - seq) <= 0)
+    s->ctx = s->ahead[s->head++].ctx;
+  if (s->head == s->n_ahead)
+    s->head = s->n_ahead = 0;
+  ctx = s->ctx;
+  stats.recvs++;
+  if (ctx != NO_CTX)
+    stats.applied++;
+  pthread_mutex_unlock(&lock);
+  return ctx;
+}
+
+static void setup(void)
+{
+  init_lctx();
+  PMPI_Comm_size(MPI_COMM_WORLD, &world_size);
+  peers = calloc(world_size, sizeof(*peers));
+  if (!peers)
+    fail("Failed to allocate MPI peers!\n");
+  PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  PMPI_Comm_dup(MPI_COMM_WORLD, &side_comm);
+}
+
+void lctx_mpi_get_stats(struct lctx_mpi_stats *st)
+{
+  pthread_mutex_lock(&lock);
+  *st = stats;
+  pthread_mutex_unlock(&lock);
+}
+
+/*--------------------------PMPI wrappers.--------------------------------*/
+int MPI_Init(int *argc, char ***argv)
+{
+  int err = PMPI_Init(argc, argv);
+
+  if (err == MPI_SUCCESS)
+    setup();
+  return err;
+}
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided)
+{
+  int err = PMPI_Init_thread(argc, argv, required, provided);
+
+  if (err == MPI_SUCCESS)
+    setup();
+  return err;
+}
+
+int MPI_Finalize(void)
+{
+  int i, j;
+
+  if (side_comm != MPI_COMM_NULL) {
+    // Every rank is done sending; take what is left of the side channel.
+    PMPI_Barrier(side_comm);
+    pthread_mutex_lock(&lock);
+    drain(MPI_ANY_SOURCE);
+    for (i = 0; i < world_size; i++) {
+      for (j = 0; j < peers[i].recv.n; j++)
+        free(peers[i].recv.s[j].ahead);
+      free(peers[i].recv.s);
+      free(peers[i].send.s);
+    }
+    free(peers);
+    peers = NULL;
+    PMPI_Comm_free(&side_comm);
+    PMPI_Group_free(&world_group);
+    pthread_mutex_unlock(&lock);
+  }
+  return PMPI_Finalize();
+}
+
+int MPI_Send(MPI_CONST void *buf, int count, MPI_Datatype type, int dest,
+             int tag, MPI_Comm comm)
+{
+  note_send(dest, tag, comm);
+  return PMPI_Send(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Bsend(MPI_CONST void *buf, int count, MPI_Datatype type, int dest,
+              int tag, MPI_Comm comm)
+{
+  note_send(dest, tag, comm);
+  return PMPI_Bsend(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Ssend(MPI_CONST void *buf, int count, MPI_Datatype type, int dest,
+              int tag, MPI_Comm comm)
+{
+  note_send(dest, tag, comm);
+  return PMPI_Ssend(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Rsend(MPI_CONST void *buf, int count, MPI_Datatype type, int dest,
+              int tag, MPI_Comm comm)
+{
+  note_send(dest, tag, comm);
+  return PMPI_Rsend(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Isend(MPI_CONST void *buf, int count, MPI_Datatype type, int dest,
+              int tag, MPI_Comm comm, MPI_Request *req)
+{
+  note_send(dest, tag, comm);
+  return PMPI_Isend(buf, count, type, dest, tag, comm, req);
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype type, int source, int tag,
+             MPI_Comm comm, MPI_Status *status)
+{
+  MPI_Status st;
+  int err, ctx;
+
+  if (status == MPI_STATUS_IGNORE)
+    status = &st;
+  err = PMPI_Recv(buf, count, type, source, tag, comm, status);
+  if (err == MPI_SUCCESS &&
+      (ctx = note_recv(status->MPI_SOURCE, status->MPI_TAG, comm)) != NO_CTX)
+    instrument_del_indicator(ctx);
+  return err;
+}
+
+int MPI_Sendrecv(MPI_CONST void *sbuf, int scount, MPI_Datatype stype,
+                 int dest, int stag, void *rbuf, int rcount,
+                 MPI_Datatype rtype, int source, int rtag, MPI_Comm comm,
+                 MPI_Status *status)
+{
+  MPI_Status st;
+  int err, ctx;
+
+  if (status == MPI_STATUS_IGNORE)
+    status = &st;
+  note_send(dest, stag, comm);
+  err = PMPI_Sendrecv(sbuf, scount, stype, dest, stag, rbuf, rcount, rtype,
+                      source, rtag, comm, status);
+  if (err == MPI_SUCCESS &&
+      (ctx = note_recv(status->MPI_SOURCE, status->MPI_TAG, comm)) != NO_CTX)
+    instrument_del_indicator(ctx);
+  return err;
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "acct.h"
+#include "delegation.h"
+#include "epoch.h"
+
+int lctx_acct;
+
+static const char *acct_path = "context.acct";
+// Reference point for converting ticks to ns.
+static uint64_t t0_ticks, t0_ns;
+
+// Start of the calling thread's open interval.
+static __thread uint64_t since_ticks, since_cpu;
+// Its counters, if since_has_pmu.
+static __thread uint64_t since_pmu[PMU_EVENTS];
+static __thread int since_has_pmu;
+
+static uint64_t clock_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return clock_ns(CLOCK_MONOTONIC_COARSE);
+#endif
+}
+
+// Ticks per ns, measured over everything since acct_init().
+static double tick_rate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ns = clock_ns(CLOCK_MONOTONIC) - t0_ns;
+  uint64_t t = ticks() - t0_ticks;
+
+  return ns && t ? (double) t / ns : 1;
+#else
+  return 1;
+#endif
+}
+
+static void acct_exit(void)
+{
+  if (lctx_acct_dump(acct_path))
+    T_DEBUG("Failed to write %s: %s\n", acct_path, strerror(errno));
+}
+
+void acct_init(void)
+{
+  const char *mode = getenv("LCTX_ACCT");
+  const char *path = getenv("LCTX_ACCT_FILE");
+
+  t0_ns = clock_ns(CLOCK_MONOTONIC);
+  t0_ticks = ticks();
+  pmu_init();
+  if (!mode || !strcmp(mode, "off")) {
+    // Counters are charged along with wall time.
+    if (!lctx_pmu)
+      return;
+    lctx_acct = ACCT_WALL;
+  } else if (!strcmp(mode, "wall"))
+    lctx_acct = ACCT_WALL;
+  else if (!strcmp(mode, "cpu"))
+    lctx_acct = ACCT_CPU;
+  else
+    fail("LCTX_ACCT must be off, wall or cpu, not %s\n", mode);
+  if (path)
+    acct_path = path;
+  atexit(acct_exit);
+}
+
+int acct_epoch(uint64_t *ticks0, uint64_t *ns0)
+{
+  *ticks0 = t0_ticks;
+  *ns0 = t0_ns;
+#if defined(__x86_64__) || defined(__i386__)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// Charge the calling thread's open interval to ctx and start a new one.
+static void charge(struct context *ctx)
+{
+  uint64_t now = ticks(), cpu = 0, pmu[PMU_EVENTS];
+  int has_pmu = lctx_pmu && !pmu_read(pmu), i;
+
+  if (lctx_acct == ACCT_CPU)
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  if (ctx && since_ticks) {
+    atomic_fetch_add_explicit(&ctx->acct->ticks, now - since_ticks,
+                              memory_order_relaxed);
+    if (cpu)
+      atomic_fetch_add_explicit(&ctx->acct->cpu_ns, cpu - since_cpu,
+                                memory_order_relaxed);
+    for (i = 0; has_pmu && since_has_pmu && i < PMU_EVENTS; i++)
+      atomic_fetch_add_explicit(&ctx->acct->pmu[i], pmu[i] - since_pmu[i],
+                                memory_order_relaxed);
+  }
+  since_ticks = now;
+  since_cpu = cpu;
+  if ((since_has_pmu = has_pmu))
+    memcpy(since_pmu, pmu, sizeof(pmu));
+}
+
+void acct_switch(struct context *from, struct context *to)
+{
+  charge(from);
+  if (to)
+    atomic_fetch_add_explicit(&to->acct->switches, 1, memory_order_relaxed);
+}
+
+static void read_stats(const struct context *ctx, double rate,
+                       struct lctx_ctx_stats *st)
+{
+  int i;
+
+  st->ctx_id = ctx->id;
+  st->switches = atomic_load_explicit(&ctx->acct->switches,
+                                      memory_order_relaxed);
+  st->wall_ns = atomic_load_explicit(&ctx->acct->ticks,
+                                     memory_order_relaxed) / rate;
+  st->cpu_ns = atomic_load_explicit(&ctx->acct->cpu_ns,
+                                    memory_order_relaxed);
+  for (i = 0; i < PMU_EVENTS; i++)
+    st->pmu[i] = atomic_load_explicit(&ctx->acct->pmu[i],
+                                      memory_order_relaxed);
+}
+
+int lctx_ctx_stats(int ctx_id, struct lctx_ctx_stats *st)
+{
+  struct context *ctx;
+
+  if (lctx_acct)
+    charge(get_current_ctx());
+  epoch_enter();
+  ctx = _get_ctx(ctx_id);
+  if (ctx)
+    read_stats(ctx, tick_rate(), st);
+  epoch_exit();
+  return ctx ? 0 : -1;
+}
+
+struct stats_buf {
+  struct lctx_ctx_stats *st;
+  size_t n, cap;
+  double rate;
+  int failed;
+};
+
+static void collect(int ctx_id, uintptr_t value, void *arg)
+{
+  struct stats_buf *b = arg;
+  struct lctx_ctx_stats *st;
+
+  (void) ctx_id;
+  if (b->n == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    st = realloc(b->st, b->cap * sizeof(*st));
+    if (!st) {
+      b->failed = 1;
+      b->n = 0;
+      return;
+    }
+    b->st = st;
+  }
+  if (!b->failed)
+    read_stats((struct context *) value, b->rate, &b->st[b->n++]);
+}
+
+static int cmp_stats(const void *a, const void *b)
+{
+  int x = ((const struct lctx_ctx_stats *) a)->ctx_id;
+  int y = ((const struct lctx_ctx_stats *) b)->ctx_id;
+
+  return (x > y) - (x < y);
+}
+
+long lctx_all_ctx_stats(struct lctx_ctx_stats **out)
+{
+  struct stats_buf b = { .rate = tick_rate() };
+
+  if (lctx_acct)
+    charge(get_current_ctx());
+  ctbl_foreach(&ctx_tbl, collect, &b);
+  if (b.failed) {
+    free(b.st);
+    return -1;
+  }
+  qsort(b.st, b.n, sizeof(*b.st), cmp_stats);
+  *out = b.st;
+  return b.n;
+}
+
+int lctx_acct_dump(const char *path)
+{
+  struct lctx_ctx_stats *st;
+  long i, n = lctx_all_ctx_stats(&st);
+  FILE *f;
+  int j;
+
+  if (n < 0)
+    return -1;
+  f = fopen(path, "w");
+  if (!f) {
+    free(st);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%d|%lu|%lu|%lu", st[i].ctx_id,
+            (unsigned long) st[i].switches, (unsigned long) st[i].wall_ns,
+            (unsigned long) st[i].cpu_ns);
+    for (j = 0; lctx_pmu && j < PMU_EVENTS; j++)
+      fprintf(f, "|%lu", (unsigned long) st[i].pmu[j]);
+    fputc('\n', f);
+  }
+  free(st);
+  return fclose(f) ? -1 : 0;
+}
@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+#define FREE_LIST(a, size) (&(a)->free[(size) / ARENA_ALIGN - 1])
+
+/*
+ * Arenas are never unlinked from the list; one released by an exiting
+ * thread is adopted by the next new thread. Counters are only written by
+ * the owner and read by arena_get_stats().
+ */
+struct arena {
+  char *cur, *end;
+  // Freed records by size class, linked through their first word.
+  void *free[ARENA_FREE_MAX / ARENA_ALIGN];
+  _Atomic size_t chunks, reserved, used, allocs;
+  _Atomic int in_use;
+  struct arena *next;
+};
+
+static _Atomic(struct arena *) arenas;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static __thread struct arena *my_arena;
+
+#define BUMP(ctr, n) \
+  atomic_store_explicit(&(ctr), \
+      atomic_load_explicit(&(ctr), memory_order_relaxed) + (n), \
+      memory_order_relaxed)
+
+static void release_arena(void *arg)
+{
+  struct arena *a = arg;
+  atomic_store(&a->in_use, 0);
+}
+
+static void make_arena_key(void)
+{
+  if (pthread_key_create(&arena_key, release_arena))
+    fail("Failed to create arena key!\n");
+}
+
+static struct arena *get_arena(void)
+{
+  struct arena *a = my_arena;
+  int expected;
+
+  if (a)
+    return a;
+
+  pthread_once(&arena_key_once, make_arena_key);
+  for (a = atomic_load(&arenas); a; a = a->next) {
+    expected = 0;
+    if (atomic_compare_exchange_strong(&a->in_use, &expected, 1))
+      break;
+  }
+  if (!a) {
+    a = calloc(1, sizeof(*a));
+    if (!a)
+      fail("Failed to allocate arena!\n");
+    atomic_store(&a->in_use, 1);
+    a->next = atomic_load(&arenas);
+    while (!atomic_compare_exchange_weak(&arenas, &a->next, a))
+      ;
+  }
+  pthread_setspecific(arena_key, a);
+  my_arena = a;
+  return a;
+}
+
+void *arena_alloc(size_t size)
+{
+  struct arena *a = get_arena();
+  size_t chunk = ARENA_CHUNK_SIZE;
+  void *p;
+
+  size = ARENA_ROUND(size);
+  if (size && size <= ARENA_FREE_MAX && (p = *FREE_LIST(a, size))) {
+    *FREE_LIST(a, size) = *(void **) p;
+    goto out;
+  }
+  if ((size_t) (a->end - a->cur) < size) {
+    if (size > chunk)
+      chunk = size;
+    // The old chunk's tail is abandoned.
+    a->cur = malloc(chunk);
+    if (!a->cur)
+      fail("Failed to allocate arena chunk!\n");
+    a->end = a->cur + chunk;
+    BUMP(a->chunks, 1);
+    BUMP(a->reserved, chunk);
+  }
+  p = a->cur;
+  a->cur += size;
+out:
+  BUMP(a->used, size);
+  BUMP(a->allocs, 1);
+  return p;
+}
+
+void arena_unalloc(void *p, size_t size)
+{
+  struct arena *a = get_arena();
+
+  size = ARENA_ROUND(size);
+  // A record that came off a free list (or an older chunk) goes back there.
+  if ((char *) p + size != a->cur) {
+    arena_free(p, size);
+    return;
+  }
+  a->cur = p;
+  BUMP(a->used, -size);
+  BUMP(a->allocs, -1);
+}
+
+void arena_free(void *p, size_t size)
+{
+  struct arena *a = get_arena();
+
+  size = ARENA_ROUND(size);
+  // Larger records are rare enough to leak.
+  if (size && size <= ARENA_FREE_MAX) {
+    *(void **) p = *FREE_LIST(a, size);
+    *FREE_LIST(a, size) = p;
+  }
+  BUMP(a->used, -size);
+  BUMP(a->allocs, -1);
+}
+
+void arena_get_stats(struct arena_stats *stats)
+{
+  struct arena *a;
+
+  memset(stats, 0, sizeof(*stats));
+  for (a = atomic_load(&arenas); a; a = a->next) {
+    stats->chunks += atomic_load_explicit(&a->chunks, memory_order_relaxed);
+    stats->reserved += atomic_load_explicit(&a->reserved,
+                                            memory_order_relaxed);
+    stats->used += atomic_load_explicit(&a->used, memory_order_relaxed);
+    stats->allocs += atomic_load_explicit(&a->allocs, memory_order_relaxed);
+  }
+}
@@ -0,0 +1,128 @@
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "chain.h"
+#include "common.h"
+#include "ctxlog.h"
+#include "delegation.h"
+
+#define CHAIN_PAGES (INT_MAX / CHAIN_PAGE_IDS + 1)
+
+/* An entry holds the parent id in its low half and the depth + 1 in its
+ * high half, so 0 is an id that was never linked. */
+#define ENT(parent, depth) \
+  ((uint64_t) ((depth) + 1) << 32 | (uint32_t) (parent))
+#define ENT_PARENT(e) ((int) (uint32_t) (e))
+#define ENT_DEPTH(e) ((int) ((e) >> 32) - 1)
+
+int lctx_chains;
+// Per kind, CHAIN_PAGES pointers to pages of CHAIN_PAGE_IDS entries.
+static _Atomic(_Atomic uint64_t *) *pages[2];
+
+static _Atomic uint64_t *entry(enum lctx_chain_kind kind, int id, int create)
+{
+  _Atomic(_Atomic uint64_t *) *slot;
+  _Atomic uint64_t *p, *expected = NULL;
+
+  if (id < 0 || !pages[kind])
+    return NULL;
+  slot = &pages[kind][id / CHAIN_PAGE_IDS];
+  p = atomic_load_explicit(slot, memory_order_acquire);
+  if (!p && create) {
+    p = calloc(CHAIN_PAGE_IDS, sizeof(*p));
+    if (!p)
+      fail("Failed to allocate chain page!\n");
+    if (!atomic_compare_exchange_strong(slot, &expected, p)) {
+      free(p);
+      p = expected;
+    }
+  }
+  return p ? &p[id % CHAIN_PAGE_IDS] : NULL;
+}
+
+static uint64_t load(enum lctx_chain_kind kind, int id)
+{
+  _Atomic uint64_t *e = entry(kind, id, 0);
+
+  return e ? atomic_load_explicit(e, memory_order_acquire) : 0;
+}
+
+void chain_init(void)
+{
+  const char *chains = getenv("LCTX_CHAINS");
+  int k;
+
+  if (!chains || !strcmp(chains, "0"))
+    return;
+  // Untouched pointer pages cost no memory.
+  for (k = 0; k < 2; k++) {
+    pages[k] = calloc(CHAIN_PAGES, sizeof(*pages[k]));
+    if (!pages[k])
+      fail("Failed to allocate chain table!\n");
+  }
+  lctx_chains = 1;
+}
+
+void chain_link(enum lctx_chain_kind kind, int id, int parent)
+{
+  _Atomic uint64_t *e, *pe;
+  uint64_t pv, unset = 0;
+
+  if (id == parent || id < 0 || parent < 0)
+    return;
+  e = entry(kind, id, 1);
+  if (atomic_load_explicit(e, memory_order_relaxed))
+    return;
+
+  // A parent nobody linked is a root.
+  pe = entry(kind, parent, 1);
+  pv = atomic_load_explicit(pe, memory_order_acquire);
+  if (!pv && atomic_compare_exchange_strong(pe, &pv, ENT(NO_CTX, 0)))
+    pv = ENT(NO_CTX, 0);
+
+  if (atomic_compare_exchange_strong(e, &unset,
+                                     ENT(parent, ENT_DEPTH(pv) + 1)))
+    ctxlog_append_link(kind == LCTX_CHAIN_DEL ? CTXLOG_LINK_DEL :
+                                                CTXLOG_LINK_CTX, id, parent);
+}
+
+int lctx_chain_parent(enum lctx_chain_kind kind, int id)
+{
+  uint64_t e = load(kind, id);
+
+  return e ? ENT_PARENT(e) : NO_CTX;
+}
+
+int lctx_chain_depth(enum lctx_chain_kind kind, int id)
+{
+  uint64_t e = load(kind, id);
+
+  return e ? ENT_DEPTH(e) : 0;
+}
+
+int lctx_chain_is_ancestor(enum lctx_chain_kind kind, int anc, int id)
+{
+  int depth = lctx_chain_depth(kind, anc);
+  uint64_t e;
+
+  // Only ids deeper than anc can be below it.
+  while (id != anc && (e = load(kind, id)) && ENT_DEPTH(e) > depth)
+    id = ENT_PARENT(e);
+  return id == anc;
+}
+
+int lctx_chain_ancestors(enum lctx_chain_kind kind, int id, int *out,
+                         int max)
+{
+  uint64_t e;
+  int n = 0;
+
+  while (n < CHAIN_MAX_DEPTH && (e = load(kind, id)) &&
+         ENT_PARENT(e) != NO_CTX) {
+    id = ENT_PARENT(e);
+    if (n < max)
+      out[n] = id;
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctbl.h"
+#include "epoch.h"
+
+#define CTBL_MIN_SLOTS 8
+
+/* Slot keys are the int key tagged with CTBL_LIVE, so zeroed memory is an
+ * empty table. Removed keys leave CTBL_REMOVED behind to keep probe
+ * sequences intact until the next resize drops them. */
+#define CTBL_EMPTY 0
+#define CTBL_LIVE (1ULL << 32)
+#define CTBL_REMOVED (1ULL << 33)
+#define CTBL_KEY(k) (CTBL_LIVE | (uint32_t) (k))
+
+struct ctbl_slot {
+  _Atomic uint64_t key;
+  _Atomic uintptr_t value;
+};
+
+struct ctbl_arr {
+  unsigned nslots;
+  // Set once the array is being copied into its replacement.
+  _Atomic int moving;
+  struct ctbl_slot slots[];
+};
+
+
+static unsigned ctbl_hash(int key) {
+  unsigned hash = key;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+
+static struct ctbl_shard *ctbl_shard(ctbl_base_t *m, unsigned hash) {
+  return &m->shards[hash >> 28 & (CTBL_SHARDS - 1)];
+}
+
+
+static struct ctbl_slot *ctbl_find(struct ctbl_arr *a, unsigned hash,
+                                   uint64_t key) {
+  struct ctbl_slot *slot;
+  unsigned i, mask = a->nslots - 1;
+  uint64_t k;
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &a->slots[i];
+    k = atomic_load_explicit(&slot->key, memory_order_acquire);
+    if (k == key) return slot;
+    if (k == CTBL_EMPTY) return NULL;
+  }
+}
+
+
+/* Copy live slots into a fresh array, sized for at least want keys, and
+ * publish it. Readers still walking the old array see a consistent
+ * snapshot; it is freed after a grace period. Lock-free updaters that raced
+ * with the copy notice the moving flag and redo their update under the
+ * lock. Caller holds the shard lock. */
+static int ctbl_resize(struct ctbl_shard *s, unsigned want) {
+  struct ctbl_arr *old, *a;
+  unsigned i, j, live = 0, nslots = CTBL_MIN_SLOTS;
+  uint64_t k;
+
+  old = atomic_load_explicit(&s->arr, memory_order_relaxed);
+  if (old) {
+    for (i = 0; i < old->nslots; i++) {
+      k = atomic_load_explicit(&old->slots[i].key, memory_order_relaxed);
+      if (k & CTBL_LIVE) live++;
+    }
+  }
+  if (want < live) want = live;
+  while (nslots < want * 2 + 2) nslots <<= 1;
+
+  a = calloc(1, sizeof(*a) + nslots * sizeof(a->slots[0]));
+  if (!a) return -1;
+  a->nslots = nslots;
+  if (old) {
+    atomic_store(&old->moving, 1);
+    for (i = 0; i < old->nslots; i++) {
+      k = atomic_load_explicit(&old->slots[i].key, memory_order_relaxed);
+      if (!(k & CTBL_LIVE)) continue;
+      j = ctbl_hash((int) k) & (nslots - 1);
+      while (atomic_load_explicit(&a->slots[j].key, memory_order_relaxed))
+        j = (j + 1) & (nslots - 1);
+      atomic_store_explicit(&a->slots[j].value,
+                            atomic_load(&old->slots[i].value),
+                            memory_order_relaxed);
+      atomic_store_explicit(&a->slots[j].key, k, memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&s->arr, a, memory_order_release);
+  s->nused = live;
+  if (old) epoch_retire(old, free);
+  return 0;
+}
+
+
+static int ctbl_insert(ctbl_base_t *m, int key, uintptr_t value, int replace,
+                       uintptr_t *stored) {
+  unsigned i, mask, hash = ctbl_hash(key);
+  struct ctbl_shard *s = ctbl_shard(m, hash);
+  struct ctbl_slot *slot;
+  struct ctbl_arr *a;
+  int ret = 0;
+
+  pthread_mutex_lock(&s->lock);
+  a = atomic_load_explicit(&s->arr, memory_order_relaxed);
+  if (a && (slot = ctbl_find(a, hash, CTBL_KEY(key)))) {
+    if (replace) atomic_store(&slot->value, value);
+    if (stored) *stored = atomic_load(&slot->value);
+    goto out;
+  }
+
+  if (!a || (s->nused + 1) * 4 > a->nslots * 3) {
+    if (ctbl_resize(s, 0)) {
+      ret = -1;
+      goto out;
+    }
+    a = atomic_load_explicit(&s->arr, memory_order_relaxed);
+  }
+
+  mask = a->nslots - 1;
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &a->slots[i];
+    if (atomic_load_explicit(&slot->key, memory_order_relaxed) == CTBL_EMPTY)
+      break;
+  }
+  atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+  atomic_store_explicit(&slot->key, CTBL_KEY(key), memory_order_release);
+  s->nused++;
+  if (stored) *stored = value;
+  ret = 1;
+out:
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+
+void ctbl_init_(ctbl_base_t *m) {
+  int i;
+  memset(m, 0, sizeof(*m));
+  for (i = 0; i < CTBL_SHARDS; i++)
+    pthread_mutex_init(&m->shards[i].lock, NULL);
+}
+
+
+/* Not safe against concurrent users. */
+void ctbl_deinit_(ctbl_base_t *m) {
+  int i;
+  for (i = 0; i < CTBL_SHARDS; i++) {
+    free(atomic_load(&m->shards[i].arr));
+    pthread_mutex_destroy(&m->shards[i].lock);
+  }
+  memset(m, 0, sizeof(*m));
+}
+
+
+int ctbl_get_(ctbl_base_t *m, int key, uintptr_t *value) {
+  unsigned hash = ctbl_hash(key);
+  struct ctbl_shard *s = ctbl_shard(m, hash);
+  struct ctbl_slot *slot = NULL;
+  struct ctbl_arr *a;
+
+  epoch_enter();
+  a = atomic_load_explicit(&s->arr, memory_order_acquire);
+  if (a && (slot = ctbl_find(a, hash, CTBL_KEY(key))))
+    *value = atomic_load_explicit(&slot->value, memory_order_acquire);
+  epoch_exit();
+  return slot ? 0 : -1;
+}
+
+
+int ctbl_set_(ctbl_base_t *m, int key, uintptr_t value) {
+  unsigned hash = ctbl_hash(key);
+  struct ctbl_shard *s = ctbl_shard(m, hash);
+  struct ctbl_slot *slot;
+  struct ctbl_arr *a;
+  int moving = 1;
+
+  /* Existing key: store in place unless a resize may have copied the slot
+   * before our store landed. */
+  epoch_enter();
+  a = atomic_load_explicit(&s->arr, memory_order_acquire);
+  if (a && (slot = ctbl_find(a, hash, CTBL_KEY(key)))) {
+    atomic_store(&slot->value, value);
+    moving = atomic_load(&a->moving);
+  }
+  epoch_exit();
+  if (!moving) return 0;
+
+  return ctbl_insert(m, key, value, 1, NULL) < 0 ? -1 : 0;
+}
+
+
+int ctbl_get_or_set_(ctbl_base_t *m, int key, uintptr_t value,
+                     uintptr_t *stored) {
+  if (!ctbl_get_(m, key, stored)) return 0;
+  return ctbl_insert(m, key, value, 0, stored);
+}
+
+
+int ctbl_reserve_(ctbl_base_t *m, unsigned n) {
+  unsigned i, want = (n + CTBL_SHARDS - 1) / CTBL_SHARDS;
+  struct ctbl_shard *s;
+  struct ctbl_arr *a;
+  int ret = 0;
+
+  for (i = 0; i < CTBL_SHARDS && !ret; i++) {
+    s = &m->shards[i];
+    pthread_mutex_lock(&s->lock);
+    a = atomic_load_explicit(&s->arr, memory_order_relaxed);
+    if (!a || (want + 1) * 4 > a->nslots * 3)
+      ret = ctbl_resize(s, want);
+    pthread_mutex_unlock(&s->lock);
+  }
+  return ret;
+}
+
+
+void ctbl_remove_(ctbl_base_t *m, int key) {
+  unsigned hash = ctbl_hash(key);
+  struct ctbl_shard *s = ctbl_shard(m, hash);
+  struct ctbl_slot *slot;
+  struct ctbl_arr *a;
+
+  pthread_mutex_lock(&s->lock);
+  a = atomic_load_explicit(&s->arr, memory_order_relaxed);
+  if (a && (slot = ctbl_find(a, hash, CTBL_KEY(key))))
+    atomic_store_explicit(&slot->key, CTBL_REMOVED, memory_order_release);
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+size_t ctbl_bytes_(ctbl_base_t *m) {
+  struct ctbl_arr *a;
+  size_t bytes = 0;
+  unsigned i;
+
+  epoch_enter();
+  for (i = 0; i < CTBL_SHARDS; i++) {
+    a = atomic_load_explicit(&m->shards[i].arr, memory_order_acquire);
+    if (a) bytes += sizeof(*a) + a->nslots * sizeof(a->slots[0]);
+  }
+  epoch_exit();
+  return bytes;
+}
+
+
+void ctbl_foreach_(ctbl_base_t *m, void (*fn)(int, uintptr_t, void *),
+                   void *arg) {
+  struct ctbl_arr *a;
+  unsigned i, j;
+  uint64_t k;
+
+  epoch_enter();
+  for (i = 0; i < CTBL_SHARDS; i++) {
+    a = atomic_load_explicit(&m->shards[i].arr, memory_order_acquire);
+    for (j = 0; a && j < a->nslots; j++) {
+      k = atomic_load_explicit(&a->slots[j].key, memory_order_acquire);
+      if (k & CTBL_LIVE)
+        fn((int) k, atomic_load_explicit(&a->slots[j].value,
+                                         memory_order_acquire), arg);
+    }
+  }
+  epoch_exit();
+}
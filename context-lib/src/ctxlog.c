@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "common.h"
+#include "ctxlog.h"
+
+/*
+ * Per-thread single-producer ring. The owning thread advances head; whoever
+ * holds log_lock drains [tail, head) and advances tail. That lets the owner
+ * append without locking while still allowing ctxlog_flush() or the writer
+ * thread to drain other threads' rings.
+ */
+struct ctxlog_ring {
+  struct ctxlog_rec recs[CTXLOG_RING_RECS];
+  _Atomic unsigned head;
+  _Atomic unsigned tail;
+  // The owner exited; the writer drains and frees the ring.
+  _Atomic int orphaned;
+  struct ctxlog_ring *next;
+};
+
+// Rings gathered into one writev by the writer thread.
+#define WRITER_BATCH 64
+
+static int log_fd = -1;
+// LCTX_LOG_MODE=mmap: everything goes to ctxlog_mmap.c instead.
+static int use_mmap;
+// LCTX_LOG_MODE=off: no log at all.
+static int log_off;
+// Serializes drains and protects the ring list.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ctxlog_ring *rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct ctxlog_ring *my_ring;
+
+/*
+ * Background writer. Appenders wake it (writer_cv) when a ring is half full
+ * and wait on space_cv, which it broadcasts after every pass, under the
+ * block policy. writer_kicked keeps a burst of appenders from all
+ * signalling it.
+ */
+static pthread_t writer;
+static _Atomic int writer_running;
+static _Atomic int writer_kicked;
+static enum ctxlog_overflow overflow;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cv = PTHREAD_COND_INITIALIZER;
+static _Atomic unsigned long dropped;
+
+/*
+ * Sampling (LCTX_SAMPLE, LCTX_SAMPLE_QUANTUM_US). Each thread decides on
+ * its own with a private PRNG and clock, and counts seen and logged
+ * switches locally; the counts reach sample_seen/sample_logged every
+ * CTXLOG_SAMPLE_BATCH switches and at thread exit.
+ */
+struct ctxlog_sampler {
+  uint64_t rng;
+  // Quantum mode: no record before this sample_clock time.
+  uint64_t next_ns;
+  unsigned seen, logged;
+};
+
+static int sampling;
+// Log a switch if the next 32 random bits are below this; 2^32 logs all.
+static uint64_t sample_thresh = 1ULL << 32;
+static uint64_t sample_quantum_ns;
+// CLOCK_MONOTONIC_COARSE unless it is too coarse for the quantum.
+static clockid_t sample_clock = CLOCK_MONOTONIC_COARSE;
+static _Atomic unsigned long sample_seen, sample_logged;
+static pthread_key_t sampler_key;
+static __thread struct ctxlog_sampler my_sampler;
+
+static void write_all(struct iovec *iov, int cnt)
+{
+  ssize_t n;
+
+  while (cnt) {
+    n = writev(log_fd, iov, cnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      T_DEBUG("Dropping context records: %s\n", strerror(errno));
+      return;
+    }
+    while (cnt && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// Describe r's pending records in up to 2 iovecs; *head is where they end.
+static int ring_iov(struct ctxlog_ring *r, struct iovec *iov, unsigned *head)
+{
+  unsigned tail, start, n, first;
+
+  *head = atomic_load_explicit(&r->head, memory_order_acquire);
+  tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  n = *head - tail;
+  if (!n)
+    return 0;
+
+  start = tail & (CTXLOG_RING_RECS - 1);
+  first = CTXLOG_RING_RECS - start;
+  if (first > n)
+    first = n;
+  iov[0].iov_base = &r->recs[start];
+  iov[0].iov_len = first * sizeof(struct ctxlog_rec);
+  if (n == first)
+    return 1;
+  iov[1].iov_base = &r->recs[0];
+  iov[1].iov_len = (n - first) * sizeof(struct ctxlog_rec);
+  return 2;
+}
+
+// Caller holds log_lock.
+static void drain_ring(struct ctxlog_ring *r)
+{
+  struct iovec iov[2];
+  unsigned head;
+  int cnt;
+
+  cnt = ring_iov(r, iov, &head);
+  if (!cnt)
+    return;
+  // Once the log is closed, records are dropped.
+  if (log_fd >= 0)
+    write_all(iov, cnt);
+  atomic_store_explicit(&r->tail, head, memory_order_release);
+}
+
+static void kick_writer(void)
+{
+  if (!atomic_exchange(&writer_kicked, 1))
+    pthread_cond_signal(&writer_cv);
+}
+
+// Thread exit: write out what is left and retire the ring.
+static void release_ring(void *arg)
+{
+  struct ctxlog_ring *r = arg, **p;
+
+  // Leave it to the writer rather than writing from the exiting thread.
+  if (atomic_load(&writer_running)) {
+    atomic_store(&r->orphaned, 1);
+    kick_writer();
+    return;
+  }
+
+  pthread_mutex_lock(&log_lock);
+  drain_ring(r);
+  for (p = &rings; *p; p = &(*p)->next) {
+    if (*p == r) {
+      *p = r->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+  free(r);
+}
+
+static void make_ring_key(void)
+{
+  if (pthread_key_create(&ring_key, release_ring))
+    fail("Failed to create context log key!\n");
+}
+
+static struct ctxlog_ring *get_ring(void)
+{
+  struct ctxlog_ring *r = my_ring;
+
+  if (r)
+    return r;
+
+  r = calloc(1, sizeof(*r));
+  if (!r)
+    fail("Failed to allocate context log ring!\n");
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_setspecific(ring_key, r);
+
+  pthread_mutex_lock(&log_lock);
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&log_lock);
+
+  my_ring = r;
+  return r;
+}
+
+// One writer pass: drain every ring, WRITER_BATCH rings per writev.
+static void writer_pass(void)
+{
+  struct iovec iov[2 * WRITER_BATCH];
+  struct ctxlog_ring *batch[WRITER_BATCH], *r, **p;
+  unsigned heads[WRITER_BATCH];
+  int cnt = 0, nr = 0, n, i;
+
+  pthread_mutex_lock(&log_lock);
+  for (r = rings; ; r = r->next) {
+    if (nr == WRITER_BATCH || (!r && nr)) {
+      if (log_fd >= 0)
+        write_all(iov, cnt);
+      for (i = 0; i < nr; i++)
+        atomic_store_explicit(&batch[i]->tail, heads[i],
+                              memory_order_release);
+      cnt = nr = 0;
+    }
+    if (!r)
+      break;
+    n = ring_iov(r, &iov[cnt], &heads[nr]);
+    if (n) {
+      batch[nr++] = r;
+      cnt += n;
+    }
+  }
+
+  for (p = &rings; (r = *p); ) {
+    if (atomic_load(&r->orphaned)) {
+      drain_ring(r);
+      *p = r->next;
+      free(r);
+    } else {
+      p = &r->next;
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void *writer_main(void *arg)
+{
+  struct timespec ts;
+
+  (void) arg;
+  pthread_mutex_lock(&writer_lock);
+  while (atomic_load(&writer_running)) {
+    pthread_mutex_unlock(&writer_lock);
+    writer_pass();
+    pthread_mutex_lock(&writer_lock);
+    pthread_cond_broadcast(&space_cv);
+    if (atomic_exchange(&writer_kicked, 0) || !atomic_load(&writer_running))
+      continue;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += CTXLOG_WRITER_PERIOD_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&writer_cv, &writer_lock, &ts);
+    atomic_store(&writer_kicked, 0);
+  }
+  pthread_mutex_unlock(&writer_lock);
+  return NULL;
+}
+
+static void stop_writer(void)
+{
+  pthread_mutex_lock(&writer_lock);
+  if (!atomic_exchange(&writer_running, 0)) {
+    pthread_mutex_unlock(&writer_lock);
+    return;
+  }
+  pthread_cond_signal(&writer_cv);
+  pthread_cond_broadcast(&space_cv);
+  pthread_mutex_unlock(&writer_lock);
+  pthread_join(writer, NULL);
+}
+
+void ctxlog_start_writer(enum ctxlog_overflow policy)
+{
+  static int registered;
+
+  if (atomic_load(&writer_running))
+    return;
+  overflow = policy;
+  atomic_store(&writer_running, 1);
+  if (pthread_create(&writer, NULL, writer_main, NULL))
+    fail("Failed to start context log writer!\n");
+  pthread_setname_np(writer, "lctx-writer");
+  // Runs before the ctxlog_flush() registered by ctxlog_open().
+  if (!registered)
+    atexit(stop_writer);
+  registered = 1;
+}
+
+static void fold_sampler(struct ctxlog_sampler *s)
+{
+  atomic_fetch_add_explicit(&sample_seen, s->seen, memory_order_relaxed);
+  atomic_fetch_add_explicit(&sample_logged, s->logged, memory_order_relaxed);
+  s->seen = s->logged = 0;
+}
+
+static void release_sampler(void *arg)
+{
+  fold_sampler(arg);
+}
+
+// Whether the calling thread's current context switch should be logged.
+static int sample(long tid)
+{
+  struct ctxlog_sampler *s = &my_sampler;
+  struct timespec ts;
+  uint64_t x, now;
+  int keep = 1;
+
+  if (!s->rng) {
+    s->rng = ((uint64_t) tid << 32 | (uintptr_t) s) | 1;
+    pthread_setspecific(sampler_key, s);
+  }
+  if (sample_thresh >> 32 == 0) {
+    // xorshift64
+    x = s->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    s->rng = x;
+    keep = (x >> 32) < sample_thresh;
+  }
+  if (keep && sample_quantum_ns) {
+    clock_gettime(sample_clock, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (now < s->next_ns)
+      keep = 0;
+    else
+      s->next_ns = now + sample_quantum_ns;
+  }
+
+  s->logged += keep;
+  if (++s->seen == CTXLOG_SAMPLE_BATCH)
+    fold_sampler(s);
+  return keep;
+}
+
+// Read LCTX_SAMPLE and LCTX_SAMPLE_QUANTUM_US.
+static void parse_sampling(void)
+{
+  const char *frac = getenv("LCTX_SAMPLE");
+  const char *quantum = getenv("LCTX_SAMPLE_QUANTUM_US");
+  struct timespec res;
+  char *end;
+  double f;
+
+  if (frac) {
+    f = strtod(frac, &end);
+    if (end == frac || *end || !(f > 0 && f <= 1))
+      fail("LCTX_SAMPLE must be a fraction in (0, 1], not %s\n", frac);
+    sample_thresh = (uint64_t) (f * (1ULL << 32));
+    sampling = f < 1;
+  }
+  if (quantum) {
+    sample_quantum_ns = strtoull(quantum, &end, 10) * 1000;
+    if (end == quantum || *end)
+      fail("LCTX_SAMPLE_QUANTUM_US must be a number of microseconds\n");
+    sampling |= sample_quantum_ns > 0;
+    if (clock_getres(sample_clock, &res) ||
+        res.tv_sec * 1000000000ULL + res.tv_nsec > sample_quantum_ns)
+      sample_clock = CLOCK_MONOTONIC;
+  }
+  if (sampling && pthread_key_create(&sampler_key, release_sampler))
+    fail("Failed to create context log key!\n");
+}
+
+// Store v at offset off of the log header.
+static void set_hdr(size_t off, uint32_t v)
+{
+  if (use_mmap)
+    ctxlog_mmap_set_hdr(off, v);
+  else if (log_fd >= 0 && pwrite(log_fd, &v, sizeof(v), off) < 0)
+    T_DEBUG("Failed to update context log header: %s\n", strerror(errno));
+}
+
+static enum ctxlog_overflow parse_overflow(const char *s)
+{
+  if (!s || !strcmp(s, "block"))
+    return CTXLOG_BLOCK;
+  if (!strcmp(s, "drop"))
+    return CTXLOG_DROP;
+  if (!strcmp(s, "spill"))
+    return CTXLOG_SPILL;
+  fail("Unknown LCTX_LOG_OVERFLOW policy %s\n", s);
+}
+
+void ctxlog_open(const char *path)
+{
+  const char *mode = getenv("LCTX_LOG_MODE");
+  struct ctxlog_hdr hdr;
+  struct iovec iov;
+
+  if (mode && !strcmp(mode, "off")) {
+    log_off = 1;
+    return;
+  }
+  parse_sampling();
+  if (mode && !strcmp(mode, "mmap")) {
+    use_mmap = 1;
+    ctxlog_mmap_open(path, sampling ? CTXLOG_F_SAMPLED : 0);
+    atexit(ctxlog_flush);
+    return;
+  }
+
+  log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log_fd < 0)
+    fail("Failed to open context log!\n");
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CTXLOG_MAGIC, sizeof(CTXLOG_MAGIC));
+  hdr.version = CTXLOG_VERSION;
+  hdr.rec_size = sizeof(struct ctxlog_rec);
+  if (sampling)
+    hdr.flags = CTXLOG_F_SAMPLED;
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  write_all(&iov, 1);
+
+  // The main thread never runs its key destructor.
+  atexit(ctxlog_flush);
+
+  if (mode && !strcmp(mode, "async"))
+    ctxlog_start_writer(parse_overflow(getenv("LCTX_LOG_OVERFLOW")));
+}
+
+// Under the block policy, wait until the writer has made room in r.
+static void wait_for_space(struct ctxlog_ring *r, unsigned head)
+{
+  pthread_mutex_lock(&writer_lock);
+  while (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+         CTXLOG_RING_RECS && atomic_load(&writer_running)) {
+    kick_writer();
+    pthread_cond_wait(&space_cv, &writer_lock);
+  }
+  pthread_mutex_unlock(&writer_lock);
+}
+
+// r is full. Returns 0 if the new record should be dropped.
+static int make_room(struct ctxlog_ring *r, unsigned head)
+{
+  if (atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+    if (overflow == CTXLOG_DROP) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      kick_writer();
+      return 0;
+    }
+    if (overflow == CTXLOG_BLOCK)
+      wait_for_space(r, head);
+  }
+  // No writer, CTXLOG_SPILL, or the writer stopped while we waited.
+  if (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+      CTXLOG_RING_RECS) {
+    pthread_mutex_lock(&log_lock);
+    drain_ring(r);
+    pthread_mutex_unlock(&log_lock);
+  }
+  return 1;
+}
+
+static void append(uint32_t tid, int ctx_id, uint32_t sec, uint32_t usec)
+{
+  struct ctxlog_ring *r;
+  struct ctxlog_rec *rec;
+  unsigned head, used;
+
+  if (use_mmap) {
+    if (!ctxlog_mmap_append(tid, ctx_id, sec, usec))
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  r = get_ring();
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (used == CTXLOG_RING_RECS) {
+    if (!make_room(r, head))
+      return;
+  } else if (used == CTXLOG_RING_RECS / 2 &&
+             atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+    kick_writer();
+  }
+
+  rec = &r->recs[head & (CTXLOG_RING_RECS - 1)];
+  rec->tid = tid;
+  rec->ctx_id = ctx_id;
+  rec->sec = sec;
+  rec->usec = usec;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void ctxlog_append(long tid, int ctx_id)
+{
+  struct timeval tv;
+
+  if (log_off || (sampling && !sample(tid)))
+    return;
+  gettimeofday(&tv, NULL);
+  append(tid, ctx_id, tv.tv_sec, tv.tv_usec);
+}
+
+void ctxlog_append_link(int kind, int id, int parent)
+{
+  if (!log_off)
+    append(CTXLOG_LINK_TID, id, (uint32_t) parent, kind);
+}
+
+// Share of context switches logged so far, in parts per million.
+static uint32_t sample_ppm(void)
+{
+  unsigned long seen, logged;
+
+  // The main thread never runs its key destructor.
+  fold_sampler(&my_sampler);
+  seen = atomic_load_explicit(&sample_seen, memory_order_relaxed);
+  logged = atomic_load_explicit(&sample_logged, memory_order_relaxed);
+  return seen ? (uint32_t) (logged * 1000000.0 / seen) : 1000000;
+}
+
+void ctxlog_flush(void)
+{
+  struct ctxlog_ring *r;
+  uint32_t n = ctxlog_dropped();
+
+  if (use_mmap) {
+    ctxlog_mmap_flush(0);
+  } else {
+    pthread_mutex_lock(&log_lock);
+    for (r = rings; r; r = r->next)
+      drain_ring(r);
+    pthread_mutex_unlock(&log_lock);
+  }
+
+  pthread_mutex_lock(&log_lock);
+  if (n)
+    set_hdr(offsetof(struct ctxlog_hdr, dropped), n);
+  if (sampling)
+    set_hdr(offsetof(struct ctxlog_hdr, sample_ppm), sample_ppm());
+  pthread_mutex_unlock(&log_lock);
+}
+
+unsigned long ctxlog_dropped(void)
+{
+  return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void ctxlog_close(void)
+{
+  if (use_mmap) {
+    ctxlog_mmap_close();
+    return;
+  }
+  stop_writer();
+  ctxlog_flush();
+  pthread_mutex_lock(&log_lock);
+  if (log_fd >= 0)
+    close(log_fd);
+  log_fd = -1;
+  pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+#include "ctxlog.h"
+
+/*
+ * Memory-mapped context log.
+ *
+ * Slots are numbered across all segments; segment n holds slots
+ * [n * CTXLOG_SEG_RECS, (n + 1) * CTXLOG_SEG_RECS). A thread reserves
+ * CTXLOG_SEG_CHUNK slots with one fetch-add and fills them in order, so
+ * the shared counter is touched once per chunk rather than per record.
+ * Slots a thread never fills (it exited mid-chunk) stay zero.
+ *
+ * A segment is mapped by the first thread to reserve from it and unmapped
+ * once all of its chunks have been returned. Counting returned chunks
+ * rather than threads holding one keeps a segment mapped for a thread that
+ * has reserved a chunk but not yet looked the segment up.
+ */
+#define SEG_CHUNKS (CTXLOG_SEG_RECS / CTXLOG_SEG_CHUNK)
+
+struct ctxlog_seg {
+  struct ctxlog_rec *recs;
+  void *map;
+  // Chunks of this segment that have been returned.
+  _Atomic unsigned done;
+};
+
+struct ctxlog_chunk {
+  struct ctxlog_seg *seg;
+  struct ctxlog_rec *cur, *end;
+};
+
+#define SEG_BYTES (sizeof(struct ctxlog_hdr) + \
+                   (size_t) CTXLOG_SEG_RECS * sizeof(struct ctxlog_rec))
+
+static char seg_path[PATH_MAX];
+static uint32_t seg_flags;
+// Segment 0 stays open for header updates after it is unmapped.
+static int hdr_fd = -1;
+static _Atomic uint64_t next_slot;
+static _Atomic int log_closed;
+static _Atomic(struct ctxlog_seg *) segs[CTXLOG_MAX_SEGS];
+// Serializes mapping, unmapping and msync of segments.
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t chunk_key;
+static pthread_once_t chunk_key_once = PTHREAD_ONCE_INIT;
+static __thread struct ctxlog_chunk my_chunk;
+
+// Caller holds seg_lock.
+static struct ctxlog_seg *map_seg(unsigned n)
+{
+  struct ctxlog_seg *seg;
+  struct ctxlog_hdr *hdr;
+  char path[PATH_MAX + 16];
+  int fd, err;
+
+  if (n)
+    snprintf(path, sizeof(path), "%s.%u", seg_path, n);
+  else
+    snprintf(path, sizeof(path), "%s", seg_path);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    fail("Failed to open context log segment %s!\n", path);
+  // Reserve the blocks now so a full disk is an error here rather than a
+  // SIGBUS on some later store.
+  err = posix_fallocate(fd, 0, SEG_BYTES);
+  if (err == EOPNOTSUPP || err == EINVAL)
+    err = ftruncate(fd, SEG_BYTES) ? errno : 0;
+  if (err) {
+    errno = err;
+    fail("Failed to preallocate context log segment %s!\n", path);
+  }
+
+  seg = calloc(1, sizeof(*seg));
+  if (!seg)
+    fail("Failed to allocate context log segment!\n");
+  seg->map = mmap(NULL, SEG_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (seg->map == MAP_FAILED)
+    fail("Failed to map context log segment %s!\n", path);
+  if (n)
+    close(fd);
+  else
+    hdr_fd = fd;
+
+  hdr = seg->map;
+  memcpy(hdr->magic, CTXLOG_MAGIC, sizeof(CTXLOG_MAGIC));
+  hdr->version = CTXLOG_VERSION;
+  hdr->rec_size = sizeof(struct ctxlog_rec);
+  hdr->flags = CTXLOG_F_SEGMENTED | seg_flags;
+  hdr->segment = n;
+  seg->recs = (struct ctxlog_rec *) (hdr + 1);
+  return seg;
+}
+
+static struct ctxlog_seg *get_seg(unsigned n)
+{
+  struct ctxlog_seg *seg = atomic_load(&segs[n]);
+
+  if (seg)
+    return seg;
+  pthread_mutex_lock(&seg_lock);
+  seg = atomic_load(&segs[n]);
+  if (!seg) {
+    seg = map_seg(n);
+    atomic_store(&segs[n], seg);
+  }
+  pthread_mutex_unlock(&seg_lock);
+  return seg;
+}
+
+// Return a chunk of seg; the last one unmaps it.
+static void put_seg(struct ctxlog_seg *seg)
+{
+  if (atomic_fetch_add(&seg->done, 1) != SEG_CHUNKS - 1)
+    return;
+  pthread_mutex_lock(&seg_lock);
+  munmap(seg->map, SEG_BYTES);
+  seg->map = NULL;
+  seg->recs = NULL;
+  pthread_mutex_unlock(&seg_lock);
+}
+
+static void release_chunk(void *arg)
+{
+  struct ctxlog_chunk *c = arg;
+
+  if (c->seg)
+    put_seg(c->seg);
+  c->seg = NULL;
+}
+
+static void make_chunk_key(void)
+{
+  if (pthread_key_create(&chunk_key, release_chunk))
+    fail("Failed to create context log key!\n");
+}
+
+// Point my_chunk at a fresh chunk. Returns 0 when the log is full.
+static int next_chunk(void)
+{
+  struct ctxlog_chunk *c = &my_chunk;
+  struct ctxlog_seg *seg;
+  uint64_t slot;
+  unsigned n, off;
+
+  if (c->seg) {
+    put_seg(c->seg);
+    c->seg = NULL;
+  } else {
+    pthread_once(&chunk_key_once, make_chunk_key);
+    pthread_setspecific(chunk_key, c);
+  }
+
+  slot = atomic_fetch_add(&next_slot, CTXLOG_SEG_CHUNK);
+  n = slot / CTXLOG_SEG_RECS;
+  off = slot % CTXLOG_SEG_RECS;
+  if (n >= CTXLOG_MAX_SEGS)
+    return 0;
+
+  seg = get_seg(n);
+  c->seg = seg;
+  c->cur = seg->recs + off;
+  c->end = c->cur + CTXLOG_SEG_CHUNK;
+  return 1;
+}
+
+void ctxlog_mmap_open(const char *path, uint32_t flags)
+{
+  if (strlen(path) >= sizeof(seg_path))
+    fail("Context log path too long!\n");
+  strcpy(seg_path, path);
+  seg_flags = flags;
+  get_seg(0);
+}
+
+void ctxlog_mmap_set_hdr(size_t off, uint32_t v)
+{
+  if (hdr_fd >= 0 && pwrite(hdr_fd, &v, sizeof(v), off) < 0)
+    T_DEBUG("Failed to update context log header: %s\n", strerror(errno));
+}
+
+int ctxlog_mmap_append(uint32_t tid, int ctx_id, uint32_t sec, uint32_t usec)
+{
+  struct ctxlog_chunk *c = &my_chunk;
+  struct ctxlog_rec *rec;
+
+  if (atomic_load_explicit(&log_closed, memory_order_relaxed))
+    return 0;
+  if (c->cur == c->end && !next_chunk())
+    return 0;
+
+  rec = c->cur++;
+  rec->ctx_id = ctx_id;
+  rec->sec = sec;
+  rec->usec = usec;
+  // The commit marker: readers ignore records whose tid is still 0.
+  __atomic_store_n(&rec->tid, tid, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Write back every mapped segment; sync waits for the writes to finish.
+void ctxlog_mmap_flush(int sync)
+{
+  struct ctxlog_seg *seg;
+  unsigned n;
+
+  pthread_mutex_lock(&seg_lock);
+  for (n = 0; n < CTXLOG_MAX_SEGS; n++) {
+    seg = atomic_load(&segs[n]);
+    if (!seg)
+      break;
+    if (seg->map)
+      msync(seg->map, SEG_BYTES, sync ? MS_SYNC : MS_ASYNC);
+  }
+  pthread_mutex_unlock(&seg_lock);
+}
+
+/* Segments other threads may still be writing into stay mapped; their
+ * later records are dropped. */
+void ctxlog_mmap_close(void)
+{
+  atomic_store(&log_closed, 1);
+  ctxlog_mmap_flush(1);
+}
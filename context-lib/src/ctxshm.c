@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ctxshm.h"
+#include "delegation.h"
+
+int lctx_shm;
+
+/* Free slot indices, as a stack linked through next[]. head holds the top
+ * index + 1 (0: empty) in its low half and a count of pops in its high
+ * half, so a pop racing with a pop and push of the same slot fails. */
+struct slot_pool {
+  _Atomic uint64_t head;
+  _Atomic uint32_t *next;
+  _Atomic uint32_t *hw;
+  uint32_t cap;
+};
+
+static char shm_name[NAME_MAX];
+static struct ctxshm_hdr *hdr;
+static struct ctxshm_thread *threads;
+static struct ctxshm_ctx *ctxs;
+static struct slot_pool thread_pool, ctx_pool;
+
+static long claim(struct slot_pool *p)
+{
+  uint64_t head = atomic_load(&p->head), top;
+  uint32_t hw;
+
+  while ((top = (uint32_t) head)) {
+    if (atomic_compare_exchange_weak(
+            &p->head, &head,
+            ((head >> 32) + 1) << 32 |
+                atomic_load_explicit(&p->next[top - 1],
+                                     memory_order_relaxed)))
+      return top - 1;
+  }
+  // Never used ones. hw may run past cap; readers stop at cap.
+  hw = atomic_fetch_add(p->hw, 1);
+  return hw < p->cap ? (long) hw : -1;
+}
+
+static void release(struct slot_pool *p, uint32_t i)
+{
+  uint64_t head = atomic_load(&p->head);
+
+  do {
+    atomic_store_explicit(&p->next[i], (uint32_t) head,
+                          memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak(&p->head, &head,
+                                         (head >> 32) << 32 | (i + 1)));
+}
+
+static inline void write_begin(_Atomic uint32_t *seq)
+{
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed)
+                             + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void write_end(_Atomic uint32_t *seq)
+{
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed)
+                             + 1, memory_order_release);
+}
+
+static void ctxshm_exit(void)
+{
+  atomic_store(&hdr->exited, 1);
+  shm_unlink(shm_name);
+}
+
+static uint32_t env_count(const char *var, uint32_t def)
+{
+  const char *s = getenv(var);
+  char *end;
+  unsigned long n;
+
+  if (!s)
+    return def;
+  n = strtoul(s, &end, 10);
+  if (end == s || *end || !n || n > UINT32_MAX / 2)
+    fail("%s must be a positive count, not %s\n", var, s);
+  return n;
+}
+
+void ctxshm_init(void)
+{
+  const char *name = getenv("LCTX_SHM");
+  uint32_t n_threads, n_ctxs, i;
+  size_t threads_off, ctxs_off, size;
+  int fd;
+
+  if (!name || !strcmp(name, "0"))
+    return;
+  ctxshm_name(shm_name, sizeof(shm_name), name, (long) getpid());
+  n_threads = env_count("LCTX_SHM_THREADS", 1024);
+  n_ctxs = env_count("LCTX_SHM_CTXS", 65536);
+  threads_off = (sizeof(*hdr) + 63) & ~(size_t) 63;
+  ctxs_off = threads_off + (size_t) n_threads * sizeof(*threads);
+  size = ctxs_off + (size_t) n_ctxs * sizeof(*ctxs);
+
+  fd = shm_open(shm_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0)
+    fail("Failed to create shared memory %s!\n", shm_name);
+  if (ftruncate(fd, size))
+    fail("Failed to size shared memory %s!\n", shm_name);
+  hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED)
+    fail("Failed to map shared memory %s!\n", shm_name);
+  threads = (void *) ((char *) hdr + threads_off);
+  ctxs = (void *) ((char *) hdr + ctxs_off);
+
+  thread_pool.next = calloc(n_threads, sizeof(*thread_pool.next));
+  ctx_pool.next = calloc(n_ctxs, sizeof(*ctx_pool.next));
+  if (!thread_pool.next || !ctx_pool.next)
+    fail("Failed to allocate shared memory slot lists!\n");
+  thread_pool.hw = &hdr->threads_hw;
+  thread_pool.cap = n_threads;
+  ctx_pool.hw = &hdr->ctxs_hw;
+  ctx_pool.cap = n_ctxs;
+  // The object starts zeroed; free context slots hold NO_CTX.
+  for (i = 0; i < n_ctxs; i++)
+    atomic_init(&ctxs[i].ctx_id, CTXSHM_FREE_CTX);
+
+  hdr->version = CTXSHM_VERSION;
+  hdr->pid = getpid();
+  hdr->n_threads = n_threads;
+  hdr->n_ctxs = n_ctxs;
+  hdr->tsc = acct_epoch(&hdr->t0_ticks, &hdr->t0_ns);
+  hdr->threads_off = threads_off;
+  hdr->ctxs_off = ctxs_off;
+  atomic_store_explicit(&hdr->magic, CTXSHM_MAGIC, memory_order_release);
+  atexit(ctxshm_exit);
+  lctx_shm = 1;
+}
+
+struct ctxshm_thread *ctxshm_thread_claim(long tid)
+{
+  struct ctxshm_thread *t;
+  long i = claim(&thread_pool);
+
+  if (i < 0)
+    return NULL;
+  t = &threads[i];
+  write_begin(&t->seq);
+  atomic_store_explicit(&t->tid, tid, memory_order_relaxed);
+  atomic_store_explicit(&t->ctx_id, NO_CTX, memory_order_relaxed);
+  atomic_store_explicit(&t->switches, 0, memory_order_relaxed);
+  write_end(&t->seq);
+  return t;
+}
+
+void ctxshm_thread_switch(struct ctxshm_thread *t, int ctx_id)
+{
+  write_begin(&t->seq);
+  atomic_store_explicit(&t->ctx_id, ctx_id, memory_order_relaxed);
+  atomic_store_explicit(&t->switches,
+                        atomic_load_explicit(&t->switches,
+                                             memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  write_end(&t->seq);
+}
+
+void ctxshm_thread_release(struct ctxshm_thread *t)
+{
+  write_begin(&t->seq);
+  atomic_store_explicit(&t->tid, CTXSHM_FREE, memory_order_relaxed);
+  write_end(&t->seq);
+  release(&thread_pool, t - threads);
+}
+
+/* Slots change hands rarely, and by any thread, so their seq is bumped
+ * with read-modify-writes. */
+struct ctx_acct *ctxshm_ctx_claim(int ctx_id)
+{
+  struct ctxshm_ctx *c;
+  long i = claim(&ctx_pool);
+
+  if (i < 0)
+    return NULL;
+  c = &ctxs[i];
+  atomic_fetch_add(&c->seq, 1);
+  atomic_store_explicit(&c->ctx_id, ctx_id, memory_order_relaxed);
+  memset(&c->acct, 0, sizeof(c->acct));
+  atomic_fetch_add(&c->seq, 1);
+  return &c->acct;
+}
+
+void ctxshm_ctx_release(struct ctx_acct *acct)
+{
+  struct ctxshm_ctx *c = (struct ctxshm_ctx *)
+      ((char *) acct - offsetof(struct ctxshm_ctx, acct));
+
+  if (!lctx_shm || c < ctxs || c >= ctxs + ctx_pool.cap)
+    return;
+  atomic_fetch_add(&c->seq, 1);
+  atomic_store_explicit(&c->ctx_id, CTXSHM_FREE_CTX, memory_order_relaxed);
+  atomic_fetch_add(&c->seq, 1);
+  release(&ctx_pool, c - ctxs);
+}
@@ -1,185 +1,379 @@
 #define _GNU_SOURCE
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 #include "delegation.h"
+#include "arena.h"
+#include "chain.h"
+#include "ctxlog.h"
+#include "epoch.h"
 #include <sys/types.h>
 #include <sys/syscall.h>
-#include <sys/time.h>
 
-FILE *fptr;
-int is_initialized = 0;
+del_tbl_t del_tbl;
+thread_tbl_t thread_tbl;
+ctx_tbl_t ctx_tbl;
 
+/* The calling thread's current context. lctx_cur_ctx is what instrumented
+ * code compares against; cur_ctx is its ctx_tbl record (NULL if the id was
+ * never added), and self is this thread's entry in thread_tbl, which other
+ * threads read. */
+__thread int lctx_cur_ctx = NO_CTX;
+static __thread struct context *cur_ctx;
+static __thread struct lctx_thread *self;
+/* The delegated work the thread last entered: what contexts and delegators
+ * it creates descend from (see chain.h). */
+static __thread int origin_ctx = NO_CTX, origin_del = NO_CTX;
 
-void init_lctx()
+static pthread_once_t lctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+
+static void release_thread(void *arg)
 {
-  if(is_initialized)
-    return;
+  struct lctx_thread *t = arg;
+
+  // Close the thread's last interval.
+  if (lctx_acct)
+    acct_switch(cur_ctx, NULL);
+  if (lctx_pmu)
+    pmu_thread_exit();
+  if (lctx_reclaim && cur_ctx)
+    ctx_put(cur_ctx);
+  if (t->shm)
+    ctxshm_thread_release(t->shm);
+  // Cross-thread readers may still hold t inside an epoch section.
+  ctbl_remove(&thread_tbl, t->tid);
+  epoch_retire(t, free);
+}
+
+static void _init_lctx()
+{
+  const char *expected = getenv("LCTX_EXPECTED_CTXS");
 
-  is_initialized = 1;
   T_DEBUG("Initializing lctx!\n");
-  map_init(&del_tbl.m);
-  map_init(&thread_tbl.m);
-  map_init(&ctx_tbl.m);
+  if (pthread_key_create(&thread_key, release_thread))
+    fail("Failed to create thread key!\n");
+  ctbl_init(&del_tbl);
+  ctbl_init(&thread_tbl);
+  ctbl_init(&ctx_tbl);
+
+  /* Presize the context and delegator tables so the first contexts do not
+   * pay for their growth. */
+  if (expected) {
+    unsigned n = strtoul(expected, NULL, 10);
+    if (ctbl_reserve(&ctx_tbl, n) || ctbl_reserve(&del_tbl, n))
+      fail("Failed to presize the context tables!\n");
+  }
 
-  fptr = fopen("context.log", "wr");
-  if (!fptr)
-    fail("Failed to open context log!\n");
+  acct_init();
+  ctxshm_init();
+  reclaim_init();
+  chain_init();
+  ctxlog_open("context.log");
+}
+
+void init_lctx()
+{
+  // Instrumented threads may race to be first.
+  pthread_once(&lctx_once, _init_lctx);
 }
 
 void write_log(long tid, int c_id) {
-  char tmp[256];
-  struct timeval tv;
-  int size;
+  ctxlog_append(tid, c_id);
+}
 
-  gettimeofday(&tv, NULL);
-  memset(&tmp, 0, sizeof(tmp));
-  size = sprintf(tmp, "%lu|%d|%lu|%lu\n", tid, c_id, tv.tv_sec, tv.tv_usec);
-  fwrite(tmp, sizeof(char), sizeof(tmp), fptr);
-  fflush(fptr);
+// Register the calling thread in thread_tbl on its first event.
+static struct lctx_thread *get_self()
+{
+  struct lctx_thread *t = self;
+
+  if (t)
+    return t;
+
+  t = malloc(sizeof(struct lctx_thread));
+  if (!t)
+    fail("Failed to allocate thread state!\n");
+  t->tid = syscall(SYS_gettid);
+  t->ctx_id = NO_CTX;
+  t->shm = lctx_shm ? ctxshm_thread_claim(t->tid) : NULL;
+  if (ctbl_set(&thread_tbl, t->tid, t))
+    fail("Failed to insert thread %ld into thread_tbl.\n", t->tid);
+  pthread_setspecific(thread_key, t);
+  self = t;
+  return t;
+}
+
+/* ctx_id's record, added first if create is set. With LCTX_RECLAIM the
+ * caller gets a reference to it. */
+static struct context *hold_ctx(int ctx_id, int create)
+{
+  struct context *ctx, *p_ctx;
+  int err;
+
+  for (;;) {
+    epoch_enter();
+    ctx = _get_ctx(ctx_id);
+    if (ctx && lctx_reclaim && ctx_tryget(ctx)) {
+      // Being freed; the sweep unlinks it shortly.
+      epoch_exit();
+      continue;
+    }
+    epoch_exit();
+    if (ctx || !create)
+      return ctx;
+
+    ctx = arena_alloc(sizeof(struct context));
+    ctx->id = ctx_id;
+    atomic_init(&ctx->refs, lctx_reclaim);
+    atomic_init(&ctx->gen, atomic_load(&lctx_lru_gen));
+    ctx->acct = lctx_shm ? ctxshm_ctx_claim(ctx_id) : NULL;
+    if (!ctx->acct) {
+      ctx->acct = &ctx->own_acct;
+      memset(ctx->acct, 0, sizeof(*ctx->acct));
+    }
+
+    T_DEBUG("Adding ctx_id %d into ctx table.\n", ctx_id);
+    err = ctbl_get_or_set(&ctx_tbl, ctx_id, ctx, &p_ctx);
+    if (err == 1) {
+      reclaim_added(0);
+      return ctx;
+    }
+    ctxshm_ctx_release(ctx->acct);
+    arena_unalloc(ctx, sizeof(struct context));
+    if (err < 0)
+      return NULL;
+    // Another thread added it first; go take a reference to theirs.
+  }
+}
+
+// The record to switch to ctx_id with, held unless it is already current.
+static struct context *next_ctx(int ctx_id, int create)
+{
+  if (ctx_id == lctx_cur_ctx && (cur_ctx || !create))
+    return cur_ctx;
+  return hold_ctx(ctx_id, create);
+}
+
+/* Switch the calling thread to ctx_id, whose record is ctx. A new ctx
+ * comes from next_ctx(), and its reference passes to the thread. */
+static void switch_ctx(int ctx_id, struct context *ctx)
+{
+  struct lctx_thread *t = get_self();
+
+  if (ctx != cur_ctx) {
+    if (lctx_acct)
+      acct_switch(cur_ctx, ctx);
+    if (lctx_reclaim) {
+      if (ctx)
+        reclaim_touch(&ctx->gen);
+      if (cur_ctx)
+        ctx_put(cur_ctx);
+    }
+  }
+  if (t->shm && ctx_id != lctx_cur_ctx)
+    ctxshm_thread_switch(t->shm, ctx_id);
+  lctx_cur_ctx = ctx_id;
+  cur_ctx = ctx;
+  atomic_store_explicit(&t->ctx_id, ctx_id, memory_order_relaxed);
+  write_log(t->tid, ctx_id);
+}
+
+long lctx_gettid()
+{
+  return get_self()->tid;
 }
 
 void instrument_indicator(int c_id)
 {
-  long tid;
-  struct context *p_ctx = NULL;
+  struct context *ctx;
 
   init_lctx();
   
   // Add New context to ctx map.
-  add_ctx(c_id);
-  tid = syscall(SYS_gettid);
+  ctx = next_ctx(c_id, 1);
+  if (lctx_chains && origin_ctx != NO_CTX)
+    chain_link(LCTX_CHAIN_CTX, c_id, origin_ctx);
 #ifdef CONFIG_DEBUG
-  p_ctx = get_thread_ctx(tid);
-  if (!p_ctx) {
+  if (!cur_ctx) {
     T_DEBUG("Thread context was null, assuming first assignment!\n")
   } else {
-    T_DEBUG("Context Switch: (%s) ~~> (%d)\n", p_ctx->id, c_id);
+    T_DEBUG("Context Switch: (%d) ~~> (%d)\n", cur_ctx->id, c_id);
   }
 #endif
-  update_thread_ctx(tid, c_id);
+  switch_ctx(c_id, ctx);
 }
 
-void add_ctx(int ctx_id)
+struct context *add_ctx(int ctx_id)
 {
-    struct context ctx;
-    int err;
-
-    ctx.id = malloc(sizeof(char)*17);
-    sprintf(ctx.id, "%d", ctx_id);
+    struct context *ctx;
 
-    T_DEBUG("Adding ctx_id %s into ctx table.\n", ctx.id);
-    err = map_set(&ctx_tbl.m, ctx.id, ctx);
-    if (err)
-        T_DEBUG("Failed to insert ctx: %d into ctx_table\n", ctx_id);
+    if (cur_ctx && cur_ctx->id == ctx_id)
+        return cur_ctx;
+    ctx = hold_ctx(ctx_id, 1);
+    // The caller does not keep a reference.
+    if (ctx && lctx_reclaim)
+        ctx_put(ctx);
+    return ctx;
 }
 
 
+/* Bind del to t_ctx, moving its context reference over. Returns -1 if del
+ * is being freed. */
+static int bind_del(struct delegator *del, struct context *t_ctx)
+{
+  int old = __atomic_load_n(&del->ctx_id, __ATOMIC_ACQUIRE);
+
+  reclaim_touch(&del->gen);
+  if (old == t_ctx->id)
+    return 0;
+  // The thread's own reference keeps t_ctx alive.
+  atomic_fetch_add(&t_ctx->refs, 1);
+  do {
+    if (old == DEL_DEAD) {
+      ctx_put(t_ctx);
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&del->ctx_id, &old, t_ctx->id, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (old != NO_CTX)
+    ctx_put_id(old);
+  return 0;
+}
+
 void instrument_delegator(int del_id)
 {
-  long tid;
   int err;
   struct context *t_ctx = NULL;
-  struct delegator *del = NULL;
+  struct delegator *del = NULL, *new_del;
 
   init_lctx();
+  if (lctx_chains && origin_del != NO_CTX)
+    chain_link(LCTX_CHAIN_DEL, del_id, origin_del);
+  epoch_enter();
+retry:
   // Get delegator struct or create new one.
   del = _get_del(del_id);
   if (!del) {
-    del= malloc(sizeof(struct delegator));
-    del->id = malloc(sizeof(char)*17);
-    sprintf(del->id, "%d", del_id);
+    new_del = arena_alloc(sizeof(struct delegator));
+    new_del->id = del_id;
+    new_del->ctx_id = NO_CTX;
+    atomic_init(&new_del->gen, atomic_load(&lctx_lru_gen));
+    err = ctbl_get_or_set(&del_tbl, del_id, new_del, &del);
+    if (err == 1)
+      reclaim_added(1);
+    else
+      arena_unalloc(new_del, sizeof(struct delegator));
+    if (err < 0) {
+      T_DEBUG("Failed to insert delegator: %d into del_table\n", del_id);
+      goto out;
+    }
   }
 
   //Get the current thread's context.
-  tid = syscall(SYS_gettid);
-  t_ctx = get_thread_ctx(tid);
+  t_ctx = cur_ctx;
 
-  // Set delegator's context.
+  // Set delegator's context. Other threads may be reading it.
   if (!t_ctx) {
     T_DEBUG("The current thread does not have have a context!\n");
-  } else {
-    del->ctx_id = t_ctx->id;
-  }
-
-  // Add delegator to del table.
-  err = map_set(&del_tbl.m, del->id, *del);
-  if (err) {
-      T_DEBUG("Failed to insert delegator: %d into del_table\n", del_id);
-  } else {
-    T_DEBUG("Inserted %d  (ctx %s) into del_table\n", 
-            del_id, del->ctx_id);
+  } else if (!lctx_reclaim) {
+    __atomic_store_n(&del->ctx_id, t_ctx->id, __ATOMIC_RELEASE);
+    T_DEBUG("Inserted %d  (ctx %d) into del_table\n", 
+            del_id, t_ctx->id);
+  } else if (bind_del(del, t_ctx)) {
+    goto retry;
   }
+out:
+  epoch_exit();
 }
 
 void instrument_del_indicator(int ctx_id)
 {
-  long tid;
   init_lctx();
   T_DEBUG("Instrumenting del indicator: ctx %d!\n", ctx_id);
-  //long tid;
-  //T_INFO("Calling instrument del indicator!\n");
-  tid = syscall(SYS_gettid);
-  //T_INFO("Setting thread %d ctx to: %d\n", tid, ctx_id);
-  update_thread_ctx(tid, ctx_id);
+  origin_ctx = ctx_id;
+  origin_del = NO_CTX;
+  switch_ctx(ctx_id, next_ctx(ctx_id, 0));
+}
+
+void instrument_del_enter(int del_id)
+{
+  struct delegator *del;
+  int ctx_id = NO_CTX;
+
+  init_lctx();
+  epoch_enter();
+  if ((del = _get_del(del_id))) {
+    ctx_id = __atomic_load_n(&del->ctx_id, __ATOMIC_ACQUIRE);
+    reclaim_touch(&del->gen);
+  }
+  epoch_exit();
+  if (ctx_id == DEL_DEAD)
+    ctx_id = NO_CTX;
+  T_DEBUG("Entering delegator %d: ctx %d!\n", del_id, ctx_id);
+  origin_ctx = ctx_id;
+  origin_del = del_id;
+  switch_ctx(ctx_id, next_ctx(ctx_id, 0));
 }
 
 
 void update_thread_ctx(int tid, int ctx_id)
 {
-  int err;
-  char tmp[17];
+  struct lctx_thread *t;
+
+  T_DEBUG("Adding (%d, %d) into thread_tbl.\n", tid, ctx_id);
+  if (tid == get_self()->tid) {
+    switch_ctx(ctx_id, next_ctx(ctx_id, 0));
+    return;
+  }
 
-  // XXX. Called for debugging.
-  // TODO. We should fail here probably.
-      
-  // Insert tid and ctx_id into thread_tbl.
-  T_DEBUG("Adding (%d, %d) into del_table.\n", tid, ctx_id);
-  sprintf(tmp, "%d", tid);
-  err = map_set(&thread_tbl.m, tmp, ctx_id);
-  if (err)
-      fail("Failed to insert (%d, %d) into ctx_table.\n", tid, ctx_id);
+  // Another thread's context; it owns its entry, so this is best effort.
+  epoch_enter();
+  if (ctbl_get(&thread_tbl, tid, &t)) {
+    T_DEBUG("Thread %d is not in thread_tbl!\n", tid);
+  } else {
+    atomic_store_explicit(&t->ctx_id, ctx_id, memory_order_relaxed);
+    write_log(tid, ctx_id);
+  }
+  epoch_exit();
+}
 
-  write_log(tid, ctx_id);
+struct context *get_current_ctx() {
+  return cur_ctx;
 }
 
 struct context *get_thread_ctx(int tid) {
-  struct context *t_ctx = NULL;
-  int *ctx_id;
-  char tmp[17];
+  struct lctx_thread *t;
+  int ctx_id = NO_CTX;
 
-   sprintf(tmp, "%d", tid);
-   ctx_id = (int *) map_get(&thread_tbl.m, tmp);
+  if (self && tid == self->tid)
+    return cur_ctx;
 
-  if (!ctx_id) {
+  epoch_enter();
+  if (ctbl_get(&thread_tbl, tid, &t)) {
     T_DEBUG("Failed to get thread context!\n");
-    t_ctx = NULL;
   } else {
-    t_ctx = _get_ctx(*ctx_id);
+    ctx_id = atomic_load_explicit(&t->ctx_id, memory_order_relaxed);
   }
+  epoch_exit();
 
-  return t_ctx;
+  return ctx_id == NO_CTX ? NULL : _get_ctx(ctx_id);
 }
 
 
 struct delegator *_get_del(int del_id) {
-    struct delegator *del;
-    char tmp[17];
+    struct delegator *del = NULL;
 
-    sprintf(tmp, "%d", del_id);
-    del = map_get(&del_tbl.m, tmp);
-    if (!del)
+    if (ctbl_get(&del_tbl, del_id, &del))
         T_DEBUG("A delegator with del_id %d does not exist!\n", del_id);
 
     return del;
 }
 
 struct context *_get_ctx(int ctx_id) {
-    struct context *ctx;
-    char tmp[17];
-    sprintf(tmp, "%d", ctx_id);
+    struct context *ctx = NULL;
 
-    ctx = map_get(&ctx_tbl.m, tmp);
-    if (!ctx)
+    if (ctbl_get(&ctx_tbl, ctx_id, &ctx))
         T_DEBUG("A ctx with ctx_id %d does not exist!\n", ctx_id);
 
     return ctx;
@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "epoch.h"
+
+// Attempt to advance the global epoch every this many retirements.
+#define EPOCH_RECLAIM_EVERY 64
+
+struct retired {
+  void *p;
+  void (*free_fn)(void *);
+  struct retired *next;
+};
+
+/*
+ * One record per live thread. Records are never unlinked from the list;
+ * a record released by an exiting thread is adopted by the next new thread,
+ * together with whatever it still had waiting in limbo.
+ */
+struct epoch_rec {
+  // (epoch << 1) | pinned
+  _Atomic unsigned long state;
+  _Atomic int in_use;
+  unsigned depth;
+  // Objects retired in epoch limbo_epoch[i], freed two epochs later.
+  struct retired *limbo[3];
+  unsigned long limbo_epoch[3];
+  unsigned nretired;
+  struct epoch_rec *next;
+};
+
+static _Atomic unsigned long global_epoch = 1;
+static _Atomic(struct epoch_rec *) recs;
+static pthread_key_t rec_key;
+static pthread_once_t rec_key_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_rec *my_rec;
+
+static void free_list(struct retired *r)
+{
+  struct retired *next;
+
+  while (r) {
+    next = r->next;
+    r->free_fn(r->p);
+    free(r);
+    r = next;
+  }
+}
+
+// Free every limbo list that no pinned thread can still observe.
+static void collect(struct epoch_rec *r, unsigned long epoch)
+{
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (r->limbo[i] && r->limbo_epoch[i] + 2 <= epoch) {
+      free_list(r->limbo[i]);
+      r->limbo[i] = NULL;
+    }
+  }
+}
+
+static void release_rec(void *arg)
+{
+  struct epoch_rec *r = arg;
+
+  r->depth = 0;
+  atomic_store(&r->state, 0);
+  atomic_store(&r->in_use, 0);
+}
+
+static void make_rec_key(void)
+{
+  if (pthread_key_create(&rec_key, release_rec))
+    fail("Failed to create epoch key!\n");
+}
+
+static struct epoch_rec *get_rec(void)
+{
+  struct epoch_rec *r = my_rec;
+  int expected;
+
+  if (r)
+    return r;
+
+  pthread_once(&rec_key_once, make_rec_key);
+  for (r = atomic_load(&recs); r; r = r->next) {
+    expected = 0;
+    if (atomic_compare_exchange_strong(&r->in_use, &expected, 1))
+      break;
+  }
+  if (!r) {
+    r = calloc(1, sizeof(*r));
+    if (!r)
+      fail("Failed to allocate epoch record!\n");
+    atomic_store(&r->in_use, 1);
+    r->next = atomic_load(&recs);
+    while (!atomic_compare_exchange_weak(&recs, &r->next, r))
+      ;
+  }
+  pthread_setspecific(rec_key, r);
+  my_rec = r;
+  return r;
+}
+
+void epoch_enter(void)
+{
+  struct epoch_rec *r = get_rec();
+
+  if (r->depth++)
+    return;
+  atomic_store(&r->state, (atomic_load(&global_epoch) << 1) | 1);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+  struct epoch_rec *r = my_rec;
+
+  if (--r->depth)
+    return;
+  atomic_store_explicit(&r->state, 0, memory_order_release);
+}
+
+void epoch_reclaim(void)
+{
+  struct epoch_rec *r;
+  unsigned long epoch, state;
+
+  epoch = atomic_load(&global_epoch);
+  for (r = atomic_load(&recs); r; r = r->next) {
+    state = atomic_load(&r->state);
+    if ((state & 1) && (state >> 1) != epoch)
+      goto out;
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+    epoch++;
+
+out:
+  collect(get_rec(), epoch);
+}
+
+void epoch_retire(void *p, void (*free_fn)(void *))
+{
+  struct epoch_rec *r = get_rec();
+  struct retired *node;
+  unsigned long epoch;
+  int slot;
+
+  node = malloc(sizeof(*node));
+  if (!node)
+    fail("Failed to allocate retired node!\n");
+  node->p = p;
+  node->free_fn = free_fn;
+
+  epoch = atomic_load(&global_epoch);
+  slot = epoch % 3;
+  if (r->limbo_epoch[slot] != epoch) {
+    // Anything left here is at least three epochs old.
+    free_list(r->limbo[slot]);
+    r->limbo[slot] = NULL;
+    r->limbo_epoch[slot] = epoch;
+  }
+  node->next = r->limbo[slot];
+  r->limbo[slot] = node;
+
+  if (++r->nretired % EPOCH_RECLAIM_EVERY == 0)
+    epoch_reclaim();
+}
@@ -48,6 +48,16 @@ static int map_bucketidx(map_base_t *m, unsigned hash) {
 }
 
 
+/* The bucket of the old array that still holds hash, or NULL if that bucket
+ * has been migrated (or no migration is in progress). */
+static map_node_t **map_oldbucket(map_base_t *m, unsigned hash) {
+  unsigned n;
+  if (!m->oldbuckets) return NULL;
+  n = hash & (m->noldbuckets - 1);
+  return (n < m->migrated) ? NULL : &m->oldbuckets[n];
+}
+
+
 static void map_addnode(map_base_t *m, map_node_t *node) {
   int n = map_bucketidx(m, node->hash);
   node->next = m->buckets[n];
@@ -55,6 +65,49 @@ static void map_addnode(map_base_t *m, map_node_t *node) {
 }
 
 
+/* Move up to nsteps buckets of the old array into the current one, and free
+ * the old array once it is empty. */
+static void map_migrate(map_base_t *m, unsigned nsteps) {
+  map_node_t *node, *next;
+  while (m->oldbuckets && nsteps--) {
+    node = m->oldbuckets[m->migrated];
+    while (node) {
+      next = node->next;
+      map_addnode(m, node);
+      node = next;
+    }
+    if (++m->migrated == m->noldbuckets) {
+      free(m->oldbuckets);
+      m->oldbuckets = NULL;
+      m->noldbuckets = m->migrated = 0;
+    }
+  }
+}
+
+
+/* Start growing to nbuckets. The current array becomes the old one and is
+ * drained by later map_set_/map_remove_ calls, MAP_MIGRATE_STEP buckets at
+ * a time, so no single call pays for relinking the whole table. */
+static int map_grow(map_base_t *m, unsigned nbuckets) {
+  map_node_t **buckets;
+  /* Finish any migration still in progress; it only lags this far behind
+   * if most calls were lookups */
+  map_migrate(m, m->noldbuckets);
+  buckets = calloc(nbuckets, sizeof(*buckets));
+  if (buckets == NULL) return -1;
+  if (m->nbuckets > 0) {
+    m->oldbuckets = m->buckets;
+    m->noldbuckets = m->nbuckets;
+    m->migrated = 0;
+  } else {
+    free(m->buckets);
+  }
+  m->buckets = buckets;
+  m->nbuckets = nbuckets;
+  return 0;
+}
+
+
 static int map_resize(map_base_t *m, int nbuckets) {
   map_node_t *nodes, *node, *next;
   map_node_t **buckets;
@@ -92,25 +145,35 @@ static int map_resize(map_base_t *m, int nbuckets) {
 }
 
 
+static map_node_t **map_findref(map_node_t **next, unsigned hash,
+                                const char *key) {
+  while (*next) {
+    if ((*next)->hash == hash && !strcmp((char*) (*next + 1), key)) {
+      return next;
+    }
+    next = &(*next)->next;
+  }
+  return NULL;
+}
+
+
 static map_node_t **map_getref(map_base_t *m, const char *key) {
   unsigned hash = map_hash(key);
-  map_node_t **next;
+  map_node_t **next = NULL;
   if (m->nbuckets > 0) {
-    next = &m->buckets[map_bucketidx(m, hash)];
-    while (*next) {
-      if ((*next)->hash == hash && !strcmp((char*) (*next + 1), key)) {
-        return next;
-      }
-      next = &(*next)->next;
-    }
+    next = map_findref(&m->buckets[map_bucketidx(m, hash)], hash, key);
   }
-  return NULL;
+  if (!next && (next = map_oldbucket(m, hash))) {
+    next = map_findref(next, hash, key);
+  }
+  return next;
 }
 
 
 void map_deinit_(map_base_t *m) {
   map_node_t *next, *node;
   int i;
+  map_migrate(m, m->noldbuckets);
   i = m->nbuckets;
   while (i--) {
     node = m->buckets[i];
@@ -142,11 +205,12 @@ int map_set_(map_base_t *m, const char *key, void *value, int vsize) {
   /* Add new node */
   node = map_newnode(key, value, vsize);
   if (node == NULL) goto fail;
-  if (m->nnodes >= m->nbuckets) {
+  if (m->nnodes >= m->nbuckets * MAP_MAX_LOAD) {
     n = (m->nbuckets > 0) ? (m->nbuckets << 1) : 1;
-    err = map_resize(m, n);
+    err = map_grow(m, n);
     if (err) goto fail;
   }
+  map_migrate(m, MAP_MIGRATE_STEP);
   map_addnode(m, node);
   m->nnodes++;
   return 0;
@@ -156,9 +220,20 @@ int map_set_(map_base_t *m, const char *key, void *value, int vsize) {
 }
 
 
+int map_reserve_(map_base_t *m, unsigned n) {
+  unsigned nbuckets = 1;
+  while (nbuckets * MAP_MAX_LOAD < n) nbuckets <<= 1;
+  map_migrate(m, m->noldbuckets);
+  if (nbuckets <= m->nbuckets) return 0;
+  return map_resize(m, nbuckets);
+}
+
+
 void map_remove_(map_base_t *m, const char *key) {
   map_node_t *node;
-  map_node_t **next = map_getref(m, key);
+  map_node_t **next;
+  map_migrate(m, MAP_MIGRATE_STEP);
+  next = map_getref(m, key);
   if (next) {
     node = *next;
     *next = (*next)->next;
@@ -176,17 +251,25 @@ map_iter_t map_iter_(void) {
 }
 
 
+/* Walks the current buckets, then the old buckets not yet migrated. */
 const char *map_next_(map_base_t *m, map_iter_t *iter) {
+  unsigned i;
   if (iter->node) {
     iter->node = iter->node->next;
     if (iter->node == NULL) goto nextBucket;
   } else {
     nextBucket:
     do {
-      if (++iter->bucketidx >= m->nbuckets) {
+      i = ++iter->bucketidx;
+      if (i < m->nbuckets) {
+        iter->node = m->buckets[i];
+        continue;
+      }
+      i = i - m->nbuckets + m->migrated;
+      if (!m->oldbuckets || i >= m->noldbuckets) {
         return NULL;
       }
-      iter->node = m->buckets[iter->bucketidx];
+      iter->node = m->oldbuckets[i];
     } while (iter->node == NULL);
   }
   return (char*) (iter->node + 1);
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
+#include "pmu.h"
+
+int lctx_pmu;
+
+struct pmu_event {
+  uint32_t type;
+  uint64_t config;
+};
+
+static const struct pmu_event events[][PMU_EVENTS] = {
+  [PMU_HW] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  },
+  [PMU_SW] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  },
+};
+
+static const char *names[][PMU_EVENTS] = {
+  [PMU_HW] = { "cycles", "instructions", "cache-misses" },
+  [PMU_SW] = { "task-clock", "page-faults", "context-switches" },
+  [PMU_RUSAGE] = { "task-clock", "page-faults", "context-switches" },
+};
+
+static const char *sources[] = { "off", "hw", "sw", "rusage" };
+
+// The calling thread's event group; fd[0] leads it.
+struct pmu_thread {
+  int state;    // 0: not opened yet, 1: open, -1: failed
+  int fd[PMU_EVENTS];
+  // For rdpmc, hw only; NULL where the page could not be mapped.
+  struct perf_event_mmap_page *pc[PMU_EVENTS];
+};
+
+static __thread struct pmu_thread pt;
+
+static int perf_open(const struct pmu_event *ev, int group, int exclude)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = ev->type;
+  attr.config = ev->config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = exclude;
+  attr.exclude_hv = exclude;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+static void close_group(struct pmu_thread *p)
+{
+  int i;
+
+  for (i = 0; i < PMU_EVENTS; i++) {
+    if (p->pc[i])
+      munmap(p->pc[i], sysconf(_SC_PAGESIZE));
+    if (p->fd[i] >= 0)
+      close(p->fd[i]);
+    p->pc[i] = NULL;
+    p->fd[i] = -1;
+  }
+}
+
+/* Open source's events for the calling thread as one group. Counts kernel
+ * work too unless perf_event_paranoid forbids it. Returns 0 or -1. */
+static int open_group(int source, struct pmu_thread *p)
+{
+  int i, exclude = 0;
+
+  for (i = 0; i < PMU_EVENTS; i++) {
+    p->fd[i] = -1;
+    p->pc[i] = NULL;
+  }
+  for (i = 0; i < PMU_EVENTS; i++) {
+    p->fd[i] = perf_open(&events[source][i], i ? p->fd[0] : -1, exclude);
+    if (p->fd[i] < 0 && !i && (errno == EACCES || errno == EPERM))
+      p->fd[i] = perf_open(&events[source][i], -1, exclude = 1);
+    if (p->fd[i] < 0) {
+      close_group(p);
+      return -1;
+    }
+    if (source == PMU_HW) {
+      p->pc[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                      p->fd[i], 0);
+      if (p->pc[i] == MAP_FAILED)
+        p->pc[i] = NULL;
+    }
+  }
+  return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Read the counter behind pc from user space, as perf_event.h describes.
+ * Returns -1 if the kernel does not allow it or the event is not
+ * scheduled on a counter right now. */
+static int read_rdpmc(struct perf_event_mmap_page *pc, uint64_t *v)
+{
+  uint32_t seq, idx, lo, hi;
+  uint64_t count;
+  int64_t pmc;
+  int shift;
+
+  do {
+    seq = pc->lock;
+    atomic_signal_fence(memory_order_seq_cst);
+    idx = pc->index;
+    if (!pc->cap_user_rdpmc || !idx)
+      return -1;
+    count = pc->offset;
+    shift = 64 - pc->pmc_width;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+    // The counter is pmc_width bits wide and signed.
+    pmc = (int64_t) ((uint64_t) hi << 32 | lo) << shift >> shift;
+    count += pmc;
+    atomic_signal_fence(memory_order_seq_cst);
+  } while (pc->lock != seq);
+  *v = count;
+  return 0;
+}
+#endif
+
+static int read_group(struct pmu_thread *p, uint64_t v[PMU_EVENTS])
+{
+  uint64_t buf[1 + PMU_EVENTS];
+  int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+  for (i = 0; i < PMU_EVENTS; i++) {
+    if (!p->pc[i] || read_rdpmc(p->pc[i], &v[i]))
+      break;
+  }
+  if (i == PMU_EVENTS)
+    return 0;
+#endif
+  if (read(p->fd[0], buf, sizeof(buf)) != sizeof(buf) ||
+      buf[0] != PMU_EVENTS)
+    return -1;
+  for (i = 0; i < PMU_EVENTS; i++)
+    v[i] = buf[1 + i];
+  return 0;
+}
+
+static int read_rusage(uint64_t v[PMU_EVENTS])
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_THREAD, &ru))
+    return -1;
+  v[0] = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+  v[1] = ru.ru_minflt + ru.ru_majflt;
+  v[2] = ru.ru_nvcsw + ru.ru_nivcsw;
+  return 0;
+}
+
+void pmu_init(void)
+{
+  const char *mode = getenv("LCTX_PMU");
+  struct pmu_thread probe;
+  int source;
+
+  if (!mode || !strcmp(mode, "off") || !strcmp(mode, "0"))
+    return;
+  if (!strcmp(mode, "hw") || !strcmp(mode, "1"))
+    source = PMU_HW;
+  else if (!strcmp(mode, "sw"))
+    source = PMU_SW;
+  else if (!strcmp(mode, "rusage"))
+    source = PMU_RUSAGE;
+  else
+    fail("LCTX_PMU must be off, hw, sw or rusage, not %s\n", mode);
+
+  // Fall back until the calling thread can open a source.
+  for (; source < PMU_RUSAGE; source++) {
+    if (!open_group(source, &probe)) {
+      close_group(&probe);
+      break;
+    }
+    T_DEBUG("No %s counters: %s\n", sources[source], strerror(errno));
+  }
+  lctx_pmu = source;
+}
+
+int pmu_read(uint64_t v[PMU_EVENTS])
+{
+  if (lctx_pmu == PMU_RUSAGE)
+    return read_rusage(v);
+  if (!pt.state)
+    pt.state = open_group(lctx_pmu, &pt) ? -1 : 1;
+  return pt.state > 0 ? read_group(&pt, v) : -1;
+}
+
+void pmu_thread_exit(void)
+{
+  if (pt.state > 0)
+    close_group(&pt);
+  pt.state = 0;
+}
+
+const char *lctx_pmu_source(void)
+{
+  return sources[lctx_pmu];
+}
+
+const char *lctx_pmu_name(int i)
+{
+  return lctx_pmu && i >= 0 && i < PMU_EVENTS ? names[lctx_pmu][i] : NULL;
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "arena.h"
+#include "delegation.h"
+#include "epoch.h"
+#include "reclaim.h"
+
+int lctx_reclaim;
+_Atomic unsigned lctx_lru_gen = 1;
+
+static size_t mem_cap;
+/* One sweep at a time. Threads that find a sweep due wait for it rather
+ * than keep adding records faster than it frees them. */
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+// Records added so far, and how many had been when the last sweep began.
+static _Atomic unsigned long created, swept_at;
+static _Atomic size_t live_ctxs, live_dels, live_bytes, peak_bytes;
+static _Atomic unsigned long n_reclaimed, n_evicted;
+
+// Records a sweep may free, in the order it tries them.
+struct victim {
+  void *rec;
+  unsigned gen;
+  int del;
+};
+
+struct victims {
+  struct victim *v;
+  size_t n, cap;
+  // Only take records last used before this generation.
+  unsigned before;
+};
+
+static void free_ctx(void *p)
+{
+  ctxshm_ctx_release(((struct context *) p)->acct);
+  arena_free(p, sizeof(struct context));
+}
+
+static void free_del(void *p)
+{
+  arena_free(p, sizeof(struct delegator));
+}
+
+static size_t mem_usage(void)
+{
+  size_t bytes = atomic_load(&live_bytes) + ctbl_bytes(&ctx_tbl) +
+                 ctbl_bytes(&del_tbl);
+  size_t peak = atomic_load(&peak_bytes);
+
+  while (bytes > peak &&
+         !atomic_compare_exchange_weak(&peak_bytes, &peak, bytes))
+    ;
+  return bytes;
+}
+
+int ctx_tryget(struct context *ctx)
+{
+  int r = atomic_load_explicit(&ctx->refs, memory_order_relaxed);
+
+  do {
+    if (r < 0)
+      return -1;
+  } while (!atomic_compare_exchange_weak_explicit(&ctx->refs, &r, r + 1,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed));
+  return 0;
+}
+
+void ctx_put(struct context *ctx)
+{
+  atomic_fetch_sub_explicit(&ctx->refs, 1, memory_order_release);
+}
+
+void ctx_put_id(int ctx_id)
+{
+  struct context *ctx;
+
+  // The reference being dropped keeps the record in the table.
+  epoch_enter();
+  if ((ctx = _get_ctx(ctx_id)))
+    ctx_put(ctx);
+  epoch_exit();
+}
+
+// Free ctx unless it is referenced. Caller is in an epoch section.
+static int evict_ctx(struct context *ctx)
+{
+  int zero = 0;
+
+  if (!atomic_compare_exchange_strong(&ctx->refs, &zero, CTX_DEAD))
+    return -1;
+  ctbl_remove(&ctx_tbl, ctx->id);
+  atomic_fetch_sub(&live_ctxs, 1);
+  atomic_fetch_sub(&live_bytes, sizeof(struct context));
+  epoch_retire(ctx, free_ctx);
+  return 0;
+}
+
+/* Free del unless another thread already is. Threads binding it see
+ * DEL_DEAD and make a new one. Caller is in an epoch section. */
+static int evict_del(struct delegator *del)
+{
+  int ctx_id = __atomic_exchange_n(&del->ctx_id, DEL_DEAD, __ATOMIC_ACQ_REL);
+
+  if (ctx_id == DEL_DEAD)
+    return -1;
+  ctbl_remove(&del_tbl, del->id);
+  if (ctx_id != NO_CTX)
+    ctx_put_id(ctx_id);
+  atomic_fetch_sub(&live_dels, 1);
+  atomic_fetch_sub(&live_bytes, sizeof(struct delegator));
+  epoch_retire(del, free_del);
+  return 0;
+}
+
+static void add_victim(struct victims *vs, void *rec, unsigned gen, int del)
+{
+  struct victim *v;
+
+  if (vs->n == vs->cap) {
+    v = realloc(vs->v, (vs->cap ? vs->cap * 2 : 256) * sizeof(*v));
+    // Sweep what fits.
+    if (!v)
+      return;
+    vs->v = v;
+    vs->cap = vs->cap ? vs->cap * 2 : 256;
+  }
+  vs->v[vs->n++] = (struct victim) { rec, gen, del };
+}
+
+static void find_idle_ctx(int ctx_id, uintptr_t value, void *arg)
+{
+  struct context *ctx = (struct context *) value;
+  struct victims *vs = arg;
+  unsigned gen = atomic_load_explicit(&ctx->gen, memory_order_relaxed);
+
+  (void) ctx_id;
+  if (!atomic_load_explicit(&ctx->refs, memory_order_relaxed) &&
+      gen < vs->before)
+    add_victim(vs, ctx, gen, 0);
+}
+
+static void find_idle_del(int del_id, uintptr_t value, void *arg)
+{
+  struct delegator *del = (struct delegator *) value;
+  struct victims *vs = arg;
+  unsigned gen = atomic_load_explicit(&del->gen, memory_order_relaxed);
+
+  (void) del_id;
+  if (gen + RECLAIM_DEL_IDLE_SWEEPS <= vs->before)
+    add_victim(vs, del, gen, 1);
+}
+
+static void find_del(int del_id, uintptr_t value, void *arg)
+{
+  struct delegator *del = (struct delegator *) value;
+
+  (void) del_id;
+  add_victim(arg, del, atomic_load_explicit(&del->gen, memory_order_relaxed),
+             1);
+}
+
+static int cmp_victims(const void *a, const void *b)
+{
+  unsigned x = ((const struct victim *) a)->gen;
+  unsigned y = ((const struct victim *) b)->gen;
+
+  return (x > y) - (x < y);
+}
+
+static int sweep_due(void)
+{
+  return atomic_load(&created) - atomic_load(&swept_at) >=
+         RECLAIM_SWEEP_EVERY;
+}
+
+/* Free idle delegators, then contexts that have not been used since the
+ * previous sweep, then evict least recently used records while over the
+ * cap. */
+static void sweep(void)
+{
+  struct victims vs = { 0 };
+  size_t i, live, target, usage;
+  int round;
+
+  pthread_mutex_lock(&sweep_lock);
+  // The sweep we waited for may have done the job.
+  usage = mem_usage();
+  if (!sweep_due() && !(mem_cap && usage > mem_cap)) {
+    pthread_mutex_unlock(&sweep_lock);
+    return;
+  }
+  epoch_enter();
+  if (sweep_due()) {
+    atomic_store(&swept_at, atomic_load(&created));
+    vs.before = atomic_fetch_add(&lctx_lru_gen, 1);
+    // Delegators first, so the contexts they held can go in this sweep.
+    ctbl_foreach(&del_tbl, find_idle_del, &vs);
+    for (i = 0; i < vs.n; i++) {
+      if (!evict_del(vs.v[i].rec))
+        atomic_fetch_add(&n_reclaimed, 1);
+    }
+    vs.n = 0;
+    ctbl_foreach(&ctx_tbl, find_idle_ctx, &vs);
+    for (i = 0; i < vs.n; i++) {
+      if (!evict_ctx(vs.v[i].rec))
+        atomic_fetch_add(&n_reclaimed, 1);
+    }
+    usage = mem_usage();
+  }
+
+  // Evicting delegators can leave more contexts unreferenced.
+  for (round = 0; mem_cap && round < 2 && usage > mem_cap; round++) {
+    vs.n = 0;
+    vs.before = -1U;
+    atomic_fetch_add(&lctx_lru_gen, 1);
+    ctbl_foreach(&ctx_tbl, find_idle_ctx, &vs);
+    ctbl_foreach(&del_tbl, find_del, &vs);
+    qsort(vs.v, vs.n, sizeof(*vs.v), cmp_victims);
+
+    // Table slots shrink with the records, so aim for a record count.
+    live = atomic_load(&live_ctxs) + atomic_load(&live_dels);
+    target = live * (mem_cap * RECLAIM_LOW_WATER / usage);
+    for (i = 0; i < vs.n && live > target; i++) {
+      if (!(vs.v[i].del ? evict_del(vs.v[i].rec) : evict_ctx(vs.v[i].rec))) {
+        atomic_fetch_add(&n_evicted, 1);
+        live--;
+      }
+    }
+    usage = mem_usage();
+  }
+  epoch_exit();
+  pthread_mutex_unlock(&sweep_lock);
+  free(vs.v);
+  epoch_reclaim();
+}
+
+void reclaim_added(int del)
+{
+  unsigned long n;
+  size_t usage;
+
+  atomic_fetch_add(del ? &live_dels : &live_ctxs, 1);
+  atomic_fetch_add(&live_bytes, del ? sizeof(struct delegator) :
+                                      sizeof(struct context));
+  n = atomic_fetch_add_explicit(&created, 1, memory_order_relaxed) + 1;
+  if (n % RECLAIM_CHECK_EVERY)
+    return;
+  usage = mem_usage();
+  if (lctx_reclaim && (sweep_due() || (mem_cap && usage > mem_cap)))
+    sweep();
+}
+
+void lctx_release_delegator(int del_id)
+{
+  struct delegator *del;
+
+  if (!lctx_reclaim)
+    return;
+  epoch_enter();
+  if (!ctbl_get(&del_tbl, del_id, &del))
+    evict_del(del);
+  epoch_exit();
+}
+
+void lctx_get_mem_stats(struct lctx_mem_stats *st)
+{
+  struct rusage ru;
+
+  st->bytes = mem_usage();
+  st->contexts = atomic_load(&live_ctxs);
+  st->delegators = atomic_load(&live_dels);
+  st->peak_bytes = atomic_load(&peak_bytes);
+  st->reclaimed = atomic_load(&n_reclaimed);
+  st->evicted = atomic_load(&n_evicted);
+  st->maxrss_kb = getrusage(RUSAGE_SELF, &ru) ? -1 : ru.ru_maxrss;
+}
+
+static void print_mem_stats(void)
+{
+  struct lctx_mem_stats st;
+
+  lctx_get_mem_stats(&st);
+  fprintf(stderr, "lctx: contexts=%zu delegators=%zu bytes=%zu "
+          "peak_bytes=%zu reclaimed=%lu evicted=%lu maxrss_kb=%ld\n",
+          st.contexts, st.delegators, st.bytes, st.peak_bytes, st.reclaimed,
+          st.evicted, st.maxrss_kb);
+}
+
+// "<n>[k|m|g]" to bytes.
+static size_t parse_size(const char *s)
+{
+  char *end;
+  size_t n = strtoull(s, &end, 10);
+
+  switch (*end) {
+  case 'g': case 'G': n <<= 10; /* fall through */
+  case 'm': case 'M': n <<= 10; /* fall through */
+  case 'k': case 'K': n <<= 10; end++;
+  }
+  if (end == s || *end || !n)
+    fail("LCTX_MEM_CAP must be a size in bytes, not %s\n", s);
+  return n;
+}
+
+void reclaim_init(void)
+{
+  const char *reclaim = getenv("LCTX_RECLAIM");
+  const char *cap = getenv("LCTX_MEM_CAP");
+  const char *stats = getenv("LCTX_MEM_STATS");
+
+  lctx_reclaim = reclaim && strcmp(reclaim, "0");
+  if (cap) {
+    mem_cap = parse_size(cap);
+    lctx_reclaim = 1;
+  }
+  if (stats && strcmp(stats, "0"))
+    atexit(print_mem_stats);
+}
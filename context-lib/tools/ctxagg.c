@@ -0,0 +1,132 @@
+/*
+ * ctxagg - per-context totals of a text context log.
+ *
+ * Usage: ctxagg [-t threads] [-i scalar|sse42|avx2] [log|-]
+ *
+ * Reads tid|ctx|sec|usec lines (see ctxparse.h), e.g. `ctxdecode | ctxagg
+ * -`, on one thread per CPU by default, and prints ctx|records|first|last
+ * sorted by ctx, with times as sec.usec. Bad lines are skipped and
+ * counted; the totals and the parse rate go to stderr. -i caps the
+ * instruction set the parser uses.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ctxparse.h"
+
+static const char *isa_names[] = { "scalar", "sse42", "avx2" };
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: ctxagg [-t threads] [-i scalar|sse42|avx2] "
+                  "[log|-]\n");
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// All of stdin, in a malloc'd buffer.
+static char *read_all(FILE *in, size_t *len)
+{
+  size_t cap = 1 << 20, n = 0, got;
+  char *buf = malloc(cap), *p;
+
+  if (!buf)
+    fail("Failed to allocate the input buffer\n");
+  while ((got = fread(buf + n, 1, cap - n, in)) > 0) {
+    n += got;
+    if (n == cap) {
+      p = realloc(buf, cap *= 2);
+      if (!p)
+        fail("Failed to grow the input buffer to %zu bytes\n", cap);
+      buf = p;
+    }
+  }
+  *len = n;
+  return buf;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = NULL;
+  struct ctxparse_agg *agg;
+  struct stat st;
+  size_t len, lines, bad;
+  char *buf;
+  double t;
+  long n, i;
+  int opt, n_threads = 0, isa = ctxparse_best_isa(), fd, mapped = 0;
+
+  while ((opt = getopt(argc, argv, "t:i:")) != -1) {
+    switch (opt) {
+    case 't':
+      n_threads = atoi(optarg);
+      break;
+    case 'i':
+      for (isa = 0; isa <= CTXPARSE_AVX2; isa++) {
+        if (!strcmp(optarg, isa_names[isa]))
+          break;
+      }
+      if (isa > CTXPARSE_AVX2)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind < argc - 1)
+    usage();
+  if (optind < argc && strcmp(argv[optind], "-"))
+    path = argv[optind];
+  isa = ctxparse_set_isa(isa);
+
+  if (!path) {
+    buf = read_all(stdin, &len);
+  } else {
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+      fail("Failed to open %s\n", path);
+    len = st.st_size;
+    buf = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (buf == MAP_FAILED)
+      fail("Failed to map %s\n", path);
+    madvise(buf, len, MADV_SEQUENTIAL);
+    close(fd);
+    mapped = 1;
+  }
+
+  t = now();
+  n = ctxparse_aggregate(buf, len, n_threads, &agg, &lines, &bad);
+  t = now() - t;
+  if (n < 0)
+    fail("Failed to aggregate the log\n");
+  for (i = 0; i < n; i++)
+    printf("%d|%lu|%lu.%06u|%lu.%06u\n", agg[i].ctx,
+           (unsigned long) agg[i].records, (unsigned long) agg[i].first_sec,
+           agg[i].first_usec, (unsigned long) agg[i].last_sec,
+           agg[i].last_usec);
+  fprintf(stderr, "ctxagg: %zu records, %zu bad lines, %ld contexts; "
+                  "%.1f MB/s (%s)\n", lines, bad, n,
+          t > 0 ? len / t / 1e6 : 0, isa_names[isa]);
+
+  free(agg);
+  if (mapped && len)
+    munmap(buf, len);
+  else if (!mapped)
+    free(buf);
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * ctxdecode - print a binary context.log as tid|ctx|sec|usec text.
+ *
+ * Usage: ctxdecode [context.log]
+ *
+ * A segmented (LCTX_LOG_MODE=mmap) log is followed through context.log.1,
+ * context.log.2, ... until a segment is missing. Its unwritten slots, and
+ * records a crash left half-written, have tid 0 and are skipped.
+ *
+ * Chain links (LCTX_CHAINS) are printed as link|ctx|id|parent or
+ * link|del|id|parent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "common.h"
+#include "ctxlog.h"
+
+#define DECODE_BATCH 4096
+
+// Print one log file. Returns -1 on error, else whether it is segmented.
+static int decode_file(const char *path)
+{
+  struct ctxlog_rec recs[DECODE_BATCH];
+  struct ctxlog_hdr hdr;
+  size_t n, i;
+  FILE *in;
+
+  in = fopen(path, "rb");
+  if (!in)
+    fail("Failed to open %s\n", path);
+
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+      memcmp(hdr.magic, CTXLOG_MAGIC, sizeof(CTXLOG_MAGIC))) {
+    fprintf(stderr, "%s: not a context log\n", path);
+    fclose(in);
+    return -1;
+  }
+  if (hdr.version != CTXLOG_VERSION ||
+      hdr.rec_size != sizeof(struct ctxlog_rec)) {
+    fprintf(stderr, "%s: unsupported log version %u (record size %u)\n",
+            path, hdr.version, hdr.rec_size);
+    fclose(in);
+    return -1;
+  }
+  if (hdr.dropped)
+    fprintf(stderr, "%s: %u records were dropped by the writer\n", path,
+            hdr.dropped);
+  if ((hdr.flags & CTXLOG_F_SAMPLED) && !hdr.segment)
+    fprintf(stderr, "%s: sampled, %.4f%% of context switches logged\n",
+            path, hdr.sample_ppm / 1e4);
+
+  while ((n = fread(recs, sizeof(recs[0]), DECODE_BATCH, in)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (!recs[i].tid)
+        continue;
+      if (recs[i].tid == CTXLOG_LINK_TID) {
+        printf("link|%s|%d|%d\n",
+               recs[i].usec == CTXLOG_LINK_DEL ? "del" : "ctx",
+               recs[i].ctx_id, (int32_t) recs[i].sec);
+        continue;
+      }
+      printf("%u|%d|%u|%u\n", recs[i].tid, recs[i].ctx_id,
+             recs[i].sec, recs[i].usec);
+    }
+  }
+
+  fclose(in);
+  return !!(hdr.flags & CTXLOG_F_SEGMENTED);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = argc > 1 ? argv[1] : "context.log";
+  char seg_path[PATH_MAX];
+  unsigned seg;
+  FILE *f;
+  int ret;
+
+  ret = decode_file(path);
+  for (seg = 1; ret == 1; seg++) {
+    snprintf(seg_path, sizeof(seg_path), "%s.%u", path, seg);
+    f = fopen(seg_path, "rb");
+    if (!f)
+      break;
+    fclose(f);
+    ret = decode_file(seg_path);
+  }
+  return ret < 0;
+}
@@ -0,0 +1,1329 @@
+/*
+ * Build and query the context log index described in ctxindex.h.
+ *
+ * The build makes two external sorts:
+ * 1. Log records by (tid, time). Walking them in that order gives each
+ *    record's interval end (the thread's next record) and the by-thread
+ *    columns, and feeds the intervals to
+ * 2. Intervals by (ctx_id, start), which give the by-context columns.
+ * Each sort keeps at most run_recs records in memory and spills sorted
+ * runs to unlinked temporary files next to the index, which are then
+ * merged with a heap.
+ *
+ * The parallel build does the same in memory, in three phases with a
+ * barrier between each:
+ * 1. The mapped log is cut into one share of records per part, which each
+ *    worker sorts by (tid, time).
+ * 2. Each worker takes a range of threads with about nrecs / parts records
+ *    in all, and merges each thread's runs from every part with a heap,
+ *    giving its by-thread rows and intervals. It sorts its intervals by
+ *    (ctx_id, start).
+ * 3. Each worker takes a range of contexts and merges each one's runs of
+ *    intervals from every part the same way.
+ * Each worker writes its range of the columns itself; as the row counts of
+ * every thread and context are known before phases 2 and 3, so are the
+ * offsets. The result is the same file the external sort writes.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ctxindex.h"
+#include "ctxlog.h"
+
+#define READ_BATCH 4096
+#define XRUN_BUF_RECS 4096
+#define COLW_BUF (64 * 1024)
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+#define USEC(sec, usec) ((uint64_t) (sec) * 1000000 + (usec))
+
+// A log record, numbered so records with equal times keep their order.
+struct trec {
+  uint32_t tid;
+  int32_t ctx;
+  uint64_t t;
+  uint64_t seq;
+};
+
+struct crec {
+  int32_t ctx;
+  uint32_t tid;
+  uint64_t start;
+  uint64_t end;
+};
+
+typedef void (*emit_fn)(void *arg, const void *rec);
+
+struct xrun {
+  FILE *f;
+  char *buf;
+  size_t n, pos;
+};
+
+struct xsort {
+  size_t rec_size, cap, n;
+  char *buf;
+  int (*cmp)(const void *, const void *);
+  const char *tmp_prefix;
+  struct xrun *runs;
+  size_t nruns;
+};
+
+// Buffered writer for one column of the index file.
+struct colw {
+  int fd;
+  uint64_t off;
+  size_t n;
+  char *buf;
+};
+
+
+static int cmp_trec(const void *pa, const void *pb)
+{
+  const struct trec *a = pa, *b = pb;
+
+  if (a->tid != b->tid)
+    return a->tid < b->tid ? -1 : 1;
+  if (a->t != b->t)
+    return a->t < b->t ? -1 : 1;
+  return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+static int cmp_crec(const void *pa, const void *pb)
+{
+  const struct crec *a = pa, *b = pb;
+
+  if (a->ctx != b->ctx)
+    return a->ctx < b->ctx ? -1 : 1;
+  if (a->start != b->start)
+    return a->start < b->start ? -1 : 1;
+  if (a->tid != b->tid)
+    return a->tid < b->tid ? -1 : 1;
+  // Only for equal-time records of a thread; keeps both builds identical.
+  return (a->end > b->end) - (a->end < b->end);
+}
+
+
+static void xsort_init(struct xsort *xs, size_t rec_size, size_t cap,
+                       int (*cmp)(const void *, const void *),
+                       const char *tmp_prefix)
+{
+  memset(xs, 0, sizeof(*xs));
+  xs->rec_size = rec_size;
+  xs->cap = cap;
+  xs->cmp = cmp;
+  xs->tmp_prefix = tmp_prefix;
+  xs->buf = malloc(rec_size * cap);
+  if (!xs->buf)
+    fail("Failed to allocate a %zu record sort run!\n", cap);
+}
+
+// Sort the buffered records and write them out as a new run.
+static void xsort_spill(struct xsort *xs)
+{
+  char path[PATH_MAX];
+  struct xrun *r;
+  int fd;
+
+  qsort(xs->buf, xs->n, xs->rec_size, xs->cmp);
+  xs->runs = realloc(xs->runs, (xs->nruns + 1) * sizeof(*xs->runs));
+  if (!xs->runs)
+    fail("Failed to allocate sort runs!\n");
+  r = &xs->runs[xs->nruns++];
+  memset(r, 0, sizeof(*r));
+
+  snprintf(path, sizeof(path), "%s.runXXXXXX", xs->tmp_prefix);
+  fd = mkstemp(path);
+  if (fd < 0)
+    fail("Failed to create sort run %s!\n", path);
+  unlink(path);
+  r->f = fdopen(fd, "w+");
+  if (!r->f || fwrite(xs->buf, xs->rec_size, xs->n, r->f) != xs->n)
+    fail("Failed to write sort run!\n");
+  xs->n = 0;
+}
+
+static void xsort_add(struct xsort *xs, const void *rec)
+{
+  if (xs->n == xs->cap)
+    xsort_spill(xs);
+  memcpy(xs->buf + xs->n * xs->rec_size, rec, xs->rec_size);
+  xs->n++;
+}
+
+// Returns 0 once the run is exhausted.
+static int xrun_fill(struct xrun *r, size_t rec_size)
+{
+  if (r->pos < r->n)
+    return 1;
+  r->n = fread(r->buf, rec_size, XRUN_BUF_RECS, r->f);
+  r->pos = 0;
+  if (!r->n && ferror(r->f))
+    fail("Failed to read sort run!\n");
+  return r->n > 0;
+}
+
+#define XRUN_CUR(xs, i) \
+  ((xs)->runs[i].buf + (xs)->runs[i].pos * (xs)->rec_size)
+
+static void heap_down(struct xsort *xs, size_t *heap, size_t n, size_t i)
+{
+  size_t c, tmp;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n &&
+        xs->cmp(XRUN_CUR(xs, heap[c + 1]), XRUN_CUR(xs, heap[c])) < 0)
+      c++;
+    if (xs->cmp(XRUN_CUR(xs, heap[c]), XRUN_CUR(xs, heap[i])) >= 0)
+      break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+// Pass every added record to emit in sorted order, then free xs.
+static void xsort_finish(struct xsort *xs, emit_fn emit, void *arg)
+{
+  size_t *heap, n = 0, i;
+
+  if (!xs->nruns) {
+    qsort(xs->buf, xs->n, xs->rec_size, xs->cmp);
+    for (i = 0; i < xs->n; i++)
+      emit(arg, xs->buf + i * xs->rec_size);
+    free(xs->buf);
+    return;
+  }
+
+  if (xs->n)
+    xsort_spill(xs);
+  free(xs->buf);
+  heap = malloc(xs->nruns * sizeof(*heap));
+  if (!heap)
+    fail("Failed to allocate merge heap!\n");
+  for (i = 0; i < xs->nruns; i++) {
+    struct xrun *r = &xs->runs[i];
+
+    r->buf = malloc(XRUN_BUF_RECS * xs->rec_size);
+    if (!r->buf)
+      fail("Failed to allocate run buffer!\n");
+    rewind(r->f);
+    if (xrun_fill(r, xs->rec_size))
+      heap[n++] = i;
+  }
+  for (i = n / 2; i-- > 0;)
+    heap_down(xs, heap, n, i);
+
+  while (n) {
+    struct xrun *r = &xs->runs[heap[0]];
+
+    emit(arg, XRUN_CUR(xs, heap[0]));
+    r->pos++;
+    if (!xrun_fill(r, xs->rec_size))
+      heap[0] = heap[--n];
+    heap_down(xs, heap, n, 0);
+  }
+
+  for (i = 0; i < xs->nruns; i++) {
+    fclose(xs->runs[i].f);
+    free(xs->runs[i].buf);
+  }
+  free(xs->runs);
+  free(heap);
+}
+
+
+static void colw_init(struct colw *c, int fd, uint64_t off)
+{
+  c->fd = fd;
+  c->off = off;
+  c->n = 0;
+  c->buf = malloc(COLW_BUF);
+  if (!c->buf)
+    fail("Failed to allocate column buffer!\n");
+}
+
+static void colw_flush(struct colw *c)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < c->n) {
+    ret = pwrite(c->fd, c->buf + done, c->n - done, c->off);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fail("Failed to write context index!\n");
+    }
+    done += ret;
+    c->off += ret;
+  }
+  c->n = 0;
+}
+
+static void colw_put(struct colw *c, const void *p, size_t len)
+{
+  if (c->n + len > COLW_BUF)
+    colw_flush(c);
+  memcpy(c->buf + c->n, p, len);
+  c->n += len;
+}
+
+static void colw_close(struct colw *c)
+{
+  colw_flush(c);
+  free(c->buf);
+}
+
+
+/* Call fn on every committed record of the log at path and the segments
+ * that follow it. Returns -1 if path is not a readable context log. */
+static int read_log(const char *path,
+                    void (*fn)(void *, const struct ctxlog_rec *), void *arg)
+{
+  struct ctxlog_rec recs[READ_BATCH];
+  struct ctxlog_hdr hdr;
+  char seg_path[PATH_MAX];
+  const char *cur = path;
+  unsigned seg = 0;
+  size_t n, i;
+  FILE *in;
+
+  for (;;) {
+    in = fopen(cur, "rb");
+    if (!in) {
+      if (seg)
+        return 0;
+      fprintf(stderr, "%s: %s\n", cur, strerror(errno));
+      return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, CTXLOG_MAGIC, sizeof(CTXLOG_MAGIC)) ||
+        hdr.version != CTXLOG_VERSION ||
+        hdr.rec_size != sizeof(struct ctxlog_rec)) {
+      fprintf(stderr, "%s: not a version %u context log\n", cur,
+              CTXLOG_VERSION);
+      fclose(in);
+      return -1;
+    }
+    while ((n = fread(recs, sizeof(recs[0]), READ_BATCH, in)) > 0) {
+      for (i = 0; i < n; i++) {
+        if (recs[i].tid && recs[i].tid != CTXLOG_LINK_TID)
+          fn(arg, &recs[i]);
+      }
+    }
+    fclose(in);
+
+    if (!(hdr.flags & CTXLOG_F_SEGMENTED))
+      return 0;
+    snprintf(seg_path, sizeof(seg_path), "%s.%u", path, ++seg);
+    cur = seg_path;
+  }
+}
+
+// Total size and newest mtime of the log and any segments after it.
+static int log_signature(const char *path, uint64_t *size, uint64_t *mtime)
+{
+  char seg_path[PATH_MAX];
+  struct stat st;
+  unsigned seg;
+
+  if (stat(path, &st))
+    return -1;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  for (seg = 1;; seg++) {
+    snprintf(seg_path, sizeof(seg_path), "%s.%u", path, seg);
+    if (stat(seg_path, &st))
+      return 0;
+    *size += st.st_size;
+    if ((uint64_t) st.st_mtime > *mtime)
+      *mtime = st.st_mtime;
+  }
+}
+
+
+struct build {
+  struct ctxidx_hdr hdr;
+  struct xsort by_tid, by_ctx;
+  struct colw t_ctx, t_start, c_tid, c_start, c_end, c_maxend;
+  // Pass 1: the previous record, whose end is not known yet.
+  struct trec prev;
+  int have_prev;
+  struct ctxidx_thread *threads;
+  struct ctxidx_ctx *ctxs;
+  size_t threads_cap, ctxs_cap;
+  uint64_t row, maxend;
+};
+
+static void *grow(void *p, size_t *cap, size_t n, size_t size)
+{
+  if (n < *cap)
+    return p;
+  *cap = *cap ? *cap * 2 : 1024;
+  p = realloc(p, *cap * size);
+  if (!p)
+    fail("Failed to grow context index directory!\n");
+  return p;
+}
+
+static void add_log_rec(void *arg, const struct ctxlog_rec *rec)
+{
+  struct build *b = arg;
+  struct trec r;
+
+  r.tid = rec->tid;
+  r.ctx = rec->ctx_id;
+  r.t = USEC(rec->sec, rec->usec);
+  r.seq = b->hdr.nrecs++;
+  if (r.t < b->hdr.t_min)
+    b->hdr.t_min = r.t;
+  if (r.t > b->hdr.t_max)
+    b->hdr.t_max = r.t;
+  xsort_add(&b->by_tid, &r);
+}
+
+static void end_interval(struct build *b, uint64_t end)
+{
+  struct crec c;
+
+  c.ctx = b->prev.ctx;
+  c.tid = b->prev.tid;
+  c.start = b->prev.t;
+  c.end = end;
+  xsort_add(&b->by_ctx, &c);
+}
+
+static void emit_by_tid(void *arg, const void *p)
+{
+  struct build *b = arg;
+  const struct trec *r = p;
+  struct ctxidx_thread *t;
+
+  if (b->have_prev && b->prev.tid == r->tid) {
+    t = &b->threads[b->hdr.nthreads - 1];
+    end_interval(b, r->t);
+    t->switches += r->ctx != b->prev.ctx;
+  } else {
+    if (b->have_prev)
+      end_interval(b, b->hdr.t_max);
+    b->threads = grow(b->threads, &b->threads_cap, b->hdr.nthreads,
+                      sizeof(*b->threads));
+    t = &b->threads[b->hdr.nthreads++];
+    memset(t, 0, sizeof(*t));
+    t->tid = r->tid;
+    t->first = b->row;
+    t->switches = 1;
+    t->t_first = r->t;
+  }
+  colw_put(&b->t_ctx, &r->ctx, sizeof(r->ctx));
+  colw_put(&b->t_start, &r->t, sizeof(r->t));
+  t->count++;
+  t->t_last = r->t;
+  b->row++;
+  b->prev = *r;
+  b->have_prev = 1;
+}
+
+static void emit_by_ctx(void *arg, const void *p)
+{
+  struct build *b = arg;
+  const struct crec *r = p;
+  struct ctxidx_ctx *c = b->hdr.nctxs ? &b->ctxs[b->hdr.nctxs - 1] : NULL;
+
+  if (!c || c->ctx_id != r->ctx) {
+    b->ctxs = grow(b->ctxs, &b->ctxs_cap, b->hdr.nctxs, sizeof(*b->ctxs));
+    c = &b->ctxs[b->hdr.nctxs++];
+    memset(c, 0, sizeof(*c));
+    c->ctx_id = r->ctx;
+    c->first = b->row;
+    b->maxend = 0;
+  }
+  if (r->end > b->maxend)
+    b->maxend = r->end;
+  colw_put(&b->c_tid, &r->tid, sizeof(r->tid));
+  colw_put(&b->c_start, &r->start, sizeof(r->start));
+  colw_put(&b->c_end, &r->end, sizeof(r->end));
+  colw_put(&b->c_maxend, &b->maxend, sizeof(b->maxend));
+  c->count++;
+  c->residency += r->end - r->start;
+  b->row++;
+}
+
+static void pwrite_all(int fd, const void *p, size_t len, uint64_t off)
+{
+  struct colw c = { fd, off, len, (char *) p };
+
+  colw_flush(&c);
+}
+
+// Column offsets for h->nrecs records.
+static void layout(struct ctxidx_hdr *h)
+{
+  uint64_t off, n = h->nrecs;
+
+  off = ALIGN8(sizeof(*h));
+  h->off_t_ctx = off;
+  off += ALIGN8(n * sizeof(int32_t));
+  h->off_t_start = off;
+  off += n * sizeof(uint64_t);
+  h->off_c_tid = off;
+  off += ALIGN8(n * sizeof(uint32_t));
+  h->off_c_start = off;
+  off += n * sizeof(uint64_t);
+  h->off_c_end = off;
+  off += n * sizeof(uint64_t);
+  h->off_c_maxend = off;
+  off += n * sizeof(uint64_t);
+  h->off_threads = off;
+}
+
+// Write the directories and the header, and publish tmp_path as idx_path.
+static void finish_index(int fd, struct ctxidx_hdr *h,
+                         const struct ctxidx_thread *threads,
+                         const struct ctxidx_ctx *ctxs,
+                         const char *tmp_path, const char *idx_path)
+{
+  h->off_ctxs = h->off_threads + h->nthreads * sizeof(*threads);
+  pwrite_all(fd, threads, h->nthreads * sizeof(*threads), h->off_threads);
+  pwrite_all(fd, ctxs, h->nctxs * sizeof(*ctxs), h->off_ctxs);
+  // The header goes last, so a build that dies midway leaves no valid index.
+  memcpy(h->magic, CTXIDX_MAGIC, sizeof(CTXIDX_MAGIC));
+  h->version = CTXIDX_VERSION;
+  pwrite_all(fd, h, sizeof(*h), 0);
+  if (close(fd))
+    fail("Failed to write context index!\n");
+  if (rename(tmp_path, idx_path))
+    fail("Failed to publish context index %s!\n", idx_path);
+}
+
+int ctxindex_build(const char *log_path, const char *idx_path,
+                   size_t run_recs)
+{
+  char tmp_path[PATH_MAX];
+  struct ctxidx_hdr *h;
+  struct build *b;
+  int fd;
+
+  if (!run_recs)
+    run_recs = CTXIDX_RUN_RECS;
+  b = calloc(1, sizeof(*b));
+  if (!b)
+    fail("Failed to allocate context index builder!\n");
+  h = &b->hdr;
+  if (log_signature(log_path, &h->log_size, &h->log_mtime)) {
+    fprintf(stderr, "%s: %s\n", log_path, strerror(errno));
+    free(b);
+    return -1;
+  }
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+
+  h->t_min = UINT64_MAX;
+  xsort_init(&b->by_tid, sizeof(struct trec), run_recs, cmp_trec, tmp_path);
+  if (read_log(log_path, add_log_rec, b)) {
+    free(b->by_tid.buf);
+    free(b);
+    return -1;
+  }
+  if (!h->nrecs)
+    h->t_min = 0;
+
+  layout(h);
+
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    fail("Failed to create %s!\n", tmp_path);
+
+  // Pass 1: by thread, producing the intervals for pass 2.
+  xsort_init(&b->by_ctx, sizeof(struct crec), run_recs, cmp_crec, tmp_path);
+  colw_init(&b->t_ctx, fd, h->off_t_ctx);
+  colw_init(&b->t_start, fd, h->off_t_start);
+  xsort_finish(&b->by_tid, emit_by_tid, b);
+  if (b->have_prev)
+    end_interval(b, h->t_max);
+  colw_close(&b->t_ctx);
+  colw_close(&b->t_start);
+
+  // Pass 2: by context.
+  b->row = 0;
+  colw_init(&b->c_tid, fd, h->off_c_tid);
+  colw_init(&b->c_start, fd, h->off_c_start);
+  colw_init(&b->c_end, fd, h->off_c_end);
+  colw_init(&b->c_maxend, fd, h->off_c_maxend);
+  xsort_finish(&b->by_ctx, emit_by_ctx, b);
+  colw_close(&b->c_tid);
+  colw_close(&b->c_start);
+  colw_close(&b->c_end);
+  colw_close(&b->c_maxend);
+
+  finish_index(fd, h, b->threads, b->ctxs, tmp_path, idx_path);
+
+  free(b->threads);
+  free(b->ctxs);
+  free(b);
+  return 0;
+}
+
+
+/*---------------------------Parallel build.------------------------------*/
+struct seg {
+  void *map;
+  size_t map_len;
+  const struct ctxlog_rec *recs;
+  uint64_t first, n;    // raw record numbers across all segments
+};
+
+// Merges sorted runs with a heap of cursors, one per run.
+struct kway {
+  size_t rec_size;
+  int (*cmp)(const void *, const void *);
+  const char **cur, **end;
+  size_t *heap, n;
+};
+
+struct pbuild;
+
+/* A worker's share of the build. It reads raw records [lo, hi) and sorts
+ * them by (tid, time) into recs, then merges threads [k0, k1) of every
+ * part's recs into their intervals, sorted by (ctx, start) into ivs, then
+ * merges contexts [k0, k1) of every part's ivs. */
+struct part {
+  struct pbuild *pb;
+  uint64_t lo, hi;
+  struct trec *recs;
+  struct crec *ivs;
+  size_t nrecs, nivs;
+  uint64_t t_min, t_max;
+  // The distinct tids of recs, then ctx ids of ivs, and where each starts.
+  int64_t *keys;
+  size_t *key_at, nkeys;
+  // run[k]: where the build's key k starts in recs, then in ivs.
+  size_t *run;
+  size_t k0, k1;
+};
+
+struct pbuild {
+  struct ctxidx_hdr hdr;
+  struct seg *segs;
+  unsigned nsegs;
+  int fd, nparts;
+  struct part *parts;
+  // The keys of every part, sorted, and the rows before each.
+  int64_t *keys;
+  uint64_t *key_first;
+  size_t nkeys;
+  struct ctxidx_thread *threads;
+  struct ctxidx_ctx *ctxs;
+};
+
+
+static void kway_init(struct kway *k, size_t rec_size, size_t nruns,
+                      int (*cmp)(const void *, const void *))
+{
+  k->rec_size = rec_size;
+  k->cmp = cmp;
+  k->cur = malloc(nruns * sizeof(*k->cur));
+  k->end = malloc(nruns * sizeof(*k->end));
+  k->heap = malloc(nruns * sizeof(*k->heap));
+  if (!k->cur || !k->end || !k->heap)
+    fail("Failed to allocate merge heap!\n");
+  k->n = 0;
+}
+
+static void kway_free(struct kway *k)
+{
+  free(k->cur);
+  free(k->end);
+  free(k->heap);
+}
+
+static void kway_down(struct kway *k, size_t i)
+{
+  size_t c, tmp;
+
+  while ((c = 2 * i + 1) < k->n) {
+    if (c + 1 < k->n &&
+        k->cmp(k->cur[k->heap[c + 1]], k->cur[k->heap[c]]) < 0)
+      c++;
+    if (k->cmp(k->cur[k->heap[c]], k->cur[k->heap[i]]) >= 0)
+      break;
+    tmp = k->heap[i];
+    k->heap[i] = k->heap[c];
+    k->heap[c] = tmp;
+    i = c;
+  }
+}
+
+// Add run i, of n records at p. Call kway_start() once all are added.
+static void kway_add(struct kway *k, size_t i, const void *p, size_t n)
+{
+  if (!n)
+    return;
+  k->cur[i] = p;
+  k->end[i] = (const char *) p + n * k->rec_size;
+  k->heap[k->n++] = i;
+}
+
+static void kway_start(struct kway *k)
+{
+  size_t i;
+
+  for (i = k->n / 2; i-- > 0;)
+    kway_down(k, i);
+}
+
+// The next record in order, or NULL once every run is exhausted.
+static const void *kway_next(struct kway *k)
+{
+  const char *p;
+  size_t r;
+
+  if (!k->n)
+    return NULL;
+  r = k->heap[0];
+  p = k->cur[r];
+  k->cur[r] += k->rec_size;
+  if (k->cur[r] == k->end[r])
+    k->heap[0] = k->heap[--k->n];
+  kway_down(k, 0);
+  return p;
+}
+
+
+/* Map the log at path and the segments that follow it. Returns -1 if path
+ * is not a readable context log. */
+static int map_log(struct pbuild *pb, const char *path)
+{
+  const struct ctxlog_hdr *hdr;
+  char seg_path[PATH_MAX];
+  const char *cur = path;
+  uint64_t first = 0;
+  struct stat st;
+  struct seg *s;
+  void *map;
+  int fd;
+
+  for (;;) {
+    fd = open(cur, O_RDONLY);
+    if (fd < 0) {
+      if (pb->nsegs)
+        return 0;
+      fprintf(stderr, "%s: %s\n", cur, strerror(errno));
+      return -1;
+    }
+    map = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t) st.st_size >= sizeof(*hdr))
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    hdr = map;
+    if (map == MAP_FAILED ||
+        memcmp(hdr->magic, CTXLOG_MAGIC, sizeof(CTXLOG_MAGIC)) ||
+        hdr->version != CTXLOG_VERSION ||
+        hdr->rec_size != sizeof(struct ctxlog_rec)) {
+      fprintf(stderr, "%s: not a version %u context log\n", cur,
+              CTXLOG_VERSION);
+      if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+      return -1;
+    }
+
+    pb->segs = realloc(pb->segs, (pb->nsegs + 1) * sizeof(*pb->segs));
+    if (!pb->segs)
+      fail("Failed to allocate log segments!\n");
+    s = &pb->segs[pb->nsegs++];
+    s->map = map;
+    s->map_len = st.st_size;
+    s->recs = (const struct ctxlog_rec *) (hdr + 1);
+    s->first = first;
+    s->n = (st.st_size - sizeof(*hdr)) / sizeof(struct ctxlog_rec);
+    first += s->n;
+
+    if (!(hdr->flags & CTXLOG_F_SEGMENTED))
+      return 0;
+    snprintf(seg_path, sizeof(seg_path), "%s.%u", path, pb->nsegs);
+    cur = seg_path;
+  }
+}
+
+// Run fn on every part, the first on the calling thread.
+static void run_parts(struct pbuild *pb, void *(*fn)(void *))
+{
+  pthread_t *threads = malloc(pb->nparts * sizeof(*threads));
+  int i;
+
+  if (!threads)
+    fail("Failed to allocate index workers!\n");
+  for (i = 1; i < pb->nparts; i++) {
+    if (pthread_create(&threads[i], NULL, fn, &pb->parts[i]))
+      fail("Failed to start an index worker!\n");
+  }
+  fn(&pb->parts[0]);
+  for (i = 1; i < pb->nparts; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+/* Set p's keys from n sorted rows of size bytes, which start with a tid
+ * (struct trec) or a ctx id (struct crec). */
+static void part_keys(struct part *p, const void *rows, size_t n,
+                      size_t size, int is_ctx)
+{
+  const char *row = rows;
+  int64_t key;
+  size_t i;
+
+  p->keys = malloc((n + 1) * sizeof(*p->keys));
+  p->key_at = malloc((n + 1) * sizeof(*p->key_at));
+  if (!p->keys || !p->key_at)
+    fail("Failed to allocate %zu index keys!\n", n);
+  p->nkeys = 0;
+  for (i = 0; i < n; i++, row += size) {
+    if (is_ctx)
+      key = *(const int32_t *) row;
+    else
+      key = *(const uint32_t *) row;
+    if (!p->nkeys || p->keys[p->nkeys - 1] != key) {
+      p->keys[p->nkeys] = key;
+      p->key_at[p->nkeys++] = i;
+    }
+  }
+  p->key_at[p->nkeys] = n;
+}
+
+// Where each of the build's keys starts in p's rows.
+static void *find_runs(void *arg)
+{
+  struct part *p = arg;
+  struct pbuild *pb = p->pb;
+  size_t j = 0, k;
+
+  free(p->run);
+  p->run = malloc((pb->nkeys + 1) * sizeof(*p->run));
+  if (!p->run)
+    fail("Failed to allocate %zu index runs!\n", pb->nkeys);
+  for (k = 0; k < pb->nkeys; k++) {
+    p->run[k] = p->key_at[j];
+    if (j < p->nkeys && p->keys[j] == pb->keys[k])
+      j++;
+  }
+  p->run[k] = p->key_at[p->nkeys];
+  free(p->keys);
+  free(p->key_at);
+  p->keys = NULL;
+  p->key_at = NULL;
+  return NULL;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Collect the parts' keys into the build's, count the rows of each, and
+ * give each part a range of keys with about as many rows as the others. */
+static void split_keys(struct pbuild *pb)
+{
+  uint64_t rows;
+  size_t n = 0, i, k;
+  int p, q;
+
+  for (p = 0; p < pb->nparts; p++)
+    n += pb->parts[p].nkeys;
+  free(pb->keys);
+  free(pb->key_first);
+  pb->keys = malloc((n ? n : 1) * sizeof(*pb->keys));
+  if (!pb->keys)
+    fail("Failed to allocate %zu index keys!\n", n);
+  for (p = 0, n = 0; p < pb->nparts; p++) {
+    memcpy(pb->keys + n, pb->parts[p].keys,
+           pb->parts[p].nkeys * sizeof(*pb->keys));
+    n += pb->parts[p].nkeys;
+  }
+  qsort(pb->keys, n, sizeof(*pb->keys), cmp_key);
+  for (i = k = 0; i < n; i++) {
+    if (!k || pb->keys[k - 1] != pb->keys[i])
+      pb->keys[k++] = pb->keys[i];
+  }
+  pb->nkeys = k;
+
+  run_parts(pb, find_runs);
+  pb->key_first = malloc((pb->nkeys + 1) * sizeof(*pb->key_first));
+  if (!pb->key_first)
+    fail("Failed to allocate index directory!\n");
+  pb->key_first[0] = 0;
+  for (k = 0; k < pb->nkeys; k++) {
+    rows = 0;
+    for (q = 0; q < pb->nparts; q++)
+      rows += pb->parts[q].run[k + 1] - pb->parts[q].run[k];
+    pb->key_first[k + 1] = pb->key_first[k] + rows;
+  }
+
+  rows = pb->key_first[pb->nkeys];
+  for (p = 0, k = 0; p < pb->nparts; p++) {
+    pb->parts[p].k0 = k;
+    while (k < pb->nkeys && (p == pb->nparts - 1 ||
+                             pb->key_first[k] < rows * (p + 1) / pb->nparts))
+      k++;
+    pb->parts[p].k1 = k;
+  }
+}
+
+// Read raw records [lo, hi) and sort them by (tid, time).
+static void *sort_recs(void *arg)
+{
+  struct part *p = arg;
+  struct pbuild *pb = p->pb;
+  const struct ctxlog_rec *r;
+  uint64_t i = p->lo, end;
+  unsigned s = 0;
+  struct trec *t;
+
+  p->recs = malloc((p->hi - p->lo + 1) * sizeof(*p->recs));
+  if (!p->recs)
+    fail("Failed to allocate %lu records!\n", (unsigned long) (p->hi - p->lo));
+  p->t_min = UINT64_MAX;
+  while (i < p->hi) {
+    while (i >= pb->segs[s].first + pb->segs[s].n)
+      s++;
+    r = pb->segs[s].recs + (i - pb->segs[s].first);
+    end = pb->segs[s].first + pb->segs[s].n;
+    if (end > p->hi)
+      end = p->hi;
+    for (; i < end; i++, r++) {
+      if (!r->tid || r->tid == CTXLOG_LINK_TID)
+        continue;
+      t = &p->recs[p->nrecs++];
+      t->tid = r->tid;
+      t->ctx = r->ctx_id;
+      t->t = USEC(r->sec, r->usec);
+      // Raw record numbers keep records with equal times in log order.
+      t->seq = i;
+      if (t->t < p->t_min)
+        p->t_min = t->t;
+      if (t->t > p->t_max)
+        p->t_max = t->t;
+    }
+  }
+  qsort(p->recs, p->nrecs, sizeof(*p->recs), cmp_trec);
+  part_keys(p, p->recs, p->nrecs, sizeof(*p->recs), 0);
+  return NULL;
+}
+
+/* Merge every part's records of threads [k0, k1), writing the by-thread
+ * columns and sorting the intervals by (ctx, start). */
+static void *merge_threads(void *arg)
+{
+  struct part *p = arg;
+  struct pbuild *pb = p->pb;
+  const struct trec *r, *prev;
+  struct ctxidx_thread *th;
+  struct colw t_ctx, t_start;
+  uint64_t first = pb->key_first[p->k0];
+  size_t n = pb->key_first[p->k1] - first, k;
+  struct kway kw;
+  int q;
+
+  p->ivs = malloc((n + 1) * sizeof(*p->ivs));
+  if (!p->ivs)
+    fail("Failed to allocate %zu intervals!\n", n);
+  colw_init(&t_ctx, pb->fd, pb->hdr.off_t_ctx + first * sizeof(int32_t));
+  colw_init(&t_start, pb->fd, pb->hdr.off_t_start + first * sizeof(uint64_t));
+  kway_init(&kw, sizeof(struct trec), pb->nparts, cmp_trec);
+
+  for (k = p->k0; k < p->k1; k++) {
+    th = &pb->threads[k];
+    for (q = 0; q < pb->nparts; q++)
+      kway_add(&kw, q, pb->parts[q].recs + pb->parts[q].run[k],
+               pb->parts[q].run[k + 1] - pb->parts[q].run[k]);
+    kway_start(&kw);
+    prev = NULL;
+    while ((r = kway_next(&kw))) {
+      if (prev) {
+        p->ivs[p->nivs++] = (struct crec) { prev->ctx, prev->tid, prev->t,
+                                            r->t };
+        th->switches += r->ctx != prev->ctx;
+      } else {
+        th->switches = 1;
+        th->t_first = r->t;
+      }
+      colw_put(&t_ctx, &r->ctx, sizeof(r->ctx));
+      colw_put(&t_start, &r->t, sizeof(r->t));
+      th->t_last = r->t;
+      prev = r;
+    }
+    p->ivs[p->nivs++] = (struct crec) { prev->ctx, prev->tid, prev->t,
+                                        pb->hdr.t_max };
+  }
+  kway_free(&kw);
+  colw_close(&t_ctx);
+  colw_close(&t_start);
+  qsort(p->ivs, p->nivs, sizeof(*p->ivs), cmp_crec);
+  return NULL;
+}
+
+// Merge every part's intervals of contexts [k0, k1).
+static void *merge_ctxs(void *arg)
+{
+  struct part *p = arg;
+  struct pbuild *pb = p->pb;
+  struct colw c_tid, c_start, c_end, c_maxend;
+  uint64_t first = pb->key_first[p->k0], maxend;
+  struct ctxidx_ctx *cx;
+  const struct crec *r;
+  struct kway kw;
+  size_t k;
+  int q;
+
+  colw_init(&c_tid, pb->fd, pb->hdr.off_c_tid + first * sizeof(uint32_t));
+  colw_init(&c_start, pb->fd, pb->hdr.off_c_start + first * sizeof(uint64_t));
+  colw_init(&c_end, pb->fd, pb->hdr.off_c_end + first * sizeof(uint64_t));
+  colw_init(&c_maxend, pb->fd,
+            pb->hdr.off_c_maxend + first * sizeof(uint64_t));
+  kway_init(&kw, sizeof(struct crec), pb->nparts, cmp_crec);
+
+  for (k = p->k0; k < p->k1; k++) {
+    cx = &pb->ctxs[k];
+    for (q = 0; q < pb->nparts; q++)
+      kway_add(&kw, q, pb->parts[q].ivs + pb->parts[q].run[k],
+               pb->parts[q].run[k + 1] - pb->parts[q].run[k]);
+    kway_start(&kw);
+    maxend = 0;
+    while ((r = kway_next(&kw))) {
+      if (r->end > maxend)
+        maxend = r->end;
+      colw_put(&c_tid, &r->tid, sizeof(r->tid));
+      colw_put(&c_start, &r->start, sizeof(r->start));
+      colw_put(&c_end, &r->end, sizeof(r->end));
+      colw_put(&c_maxend, &maxend, sizeof(maxend));
+      cx->residency += r->end - r->start;
+    }
+  }
+  kway_free(&kw);
+  colw_close(&c_tid);
+  colw_close(&c_start);
+  colw_close(&c_end);
+  colw_close(&c_maxend);
+  return NULL;
+}
+
+int ctxindex_build_parallel(const char *log_path, const char *idx_path,
+                            int n_threads)
+{
+  char tmp_path[PATH_MAX];
+  struct ctxidx_hdr *h;
+  struct pbuild *pb;
+  struct part *p;
+  uint64_t nraw;
+  size_t k;
+  int i;
+
+  pb = calloc(1, sizeof(*pb));
+  if (!pb)
+    fail("Failed to allocate context index builder!\n");
+  h = &pb->hdr;
+  if (log_signature(log_path, &h->log_size, &h->log_mtime)) {
+    fprintf(stderr, "%s: %s\n", log_path, strerror(errno));
+    free(pb);
+    return -1;
+  }
+  if (map_log(pb, log_path)) {
+    for (i = 0; i < (int) pb->nsegs; i++)
+      munmap(pb->segs[i].map, pb->segs[i].map_len);
+    free(pb->segs);
+    free(pb);
+    return -1;
+  }
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  pb->nparts = n_threads > 0 ? n_threads : 1;
+  pb->parts = calloc(pb->nparts, sizeof(*pb->parts));
+  if (!pb->parts)
+    fail("Failed to allocate index workers!\n");
+  nraw = pb->segs[pb->nsegs - 1].first + pb->segs[pb->nsegs - 1].n;
+  for (i = 0; i < pb->nparts; i++) {
+    p = &pb->parts[i];
+    p->pb = pb;
+    p->lo = nraw * i / pb->nparts;
+    p->hi = nraw * (i + 1) / pb->nparts;
+  }
+
+  // 1. Each part sorts its share of the log.
+  run_parts(pb, sort_recs);
+  h->t_min = UINT64_MAX;
+  for (i = 0; i < pb->nparts; i++) {
+    p = &pb->parts[i];
+    h->nrecs += p->nrecs;
+    if (p->t_min < h->t_min)
+      h->t_min = p->t_min;
+    if (p->t_max > h->t_max)
+      h->t_max = p->t_max;
+  }
+  if (!h->nrecs)
+    h->t_min = 0;
+  layout(h);
+
+  pb->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (pb->fd < 0)
+    fail("Failed to create %s!\n", tmp_path);
+
+  // 2. By thread, each part merging its threads' runs from every part.
+  split_keys(pb);
+  h->nthreads = pb->nkeys;
+  pb->threads = calloc(pb->nkeys + 1, sizeof(*pb->threads));
+  if (!pb->threads)
+    fail("Failed to allocate context index directory!\n");
+  for (k = 0; k < pb->nkeys; k++) {
+    pb->threads[k].tid = pb->keys[k];
+    pb->threads[k].first = pb->key_first[k];
+    pb->threads[k].count = pb->key_first[k + 1] - pb->key_first[k];
+  }
+  run_parts(pb, merge_threads);
+  for (i = 0; i < pb->nparts; i++) {
+    p = &pb->parts[i];
+    free(p->recs);
+    p->recs = NULL;
+    part_keys(p, p->ivs, p->nivs, sizeof(*p->ivs), 1);
+  }
+
+  // 3. By context, the same way.
+  split_keys(pb);
+  h->nctxs = pb->nkeys;
+  pb->ctxs = calloc(pb->nkeys + 1, sizeof(*pb->ctxs));
+  if (!pb->ctxs)
+    fail("Failed to allocate context index directory!\n");
+  for (k = 0; k < pb->nkeys; k++) {
+    pb->ctxs[k].ctx_id = pb->keys[k];
+    pb->ctxs[k].first = pb->key_first[k];
+    pb->ctxs[k].count = pb->key_first[k + 1] - pb->key_first[k];
+  }
+  run_parts(pb, merge_ctxs);
+
+  finish_index(pb->fd, h, pb->threads, pb->ctxs, tmp_path, idx_path);
+
+  for (i = 0; i < pb->nparts; i++) {
+    free(pb->parts[i].ivs);
+    free(pb->parts[i].run);
+  }
+  for (i = 0; i < (int) pb->nsegs; i++)
+    munmap(pb->segs[i].map, pb->segs[i].map_len);
+  free(pb->segs);
+  free(pb->parts);
+  free(pb->keys);
+  free(pb->key_first);
+  free(pb->threads);
+  free(pb->ctxs);
+  free(pb);
+  return 0;
+}
+
+
+// Map idx_path. Returns NULL if it is missing, invalid or not for sig.
+static struct ctxindex *map_index(const char *idx_path, uint64_t log_size,
+                                  uint64_t log_mtime)
+{
+  const struct ctxidx_hdr *h;
+  struct ctxindex *ix;
+  struct stat st;
+  void *map;
+  char *base;
+  int fd;
+
+  fd = open(idx_path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*h)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  h = map;
+  if (memcmp(h->magic, CTXIDX_MAGIC, sizeof(CTXIDX_MAGIC)) ||
+      h->version != CTXIDX_VERSION ||
+      h->log_size != log_size || h->log_mtime != log_mtime ||
+      h->off_ctxs + h->nctxs * sizeof(struct ctxidx_ctx) >
+        (uint64_t) st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  ix = malloc(sizeof(*ix));
+  if (!ix)
+    fail("Failed to allocate context index!\n");
+  base = map;
+  ix->hdr = h;
+  ix->t_ctx = (const int32_t *) (base + h->off_t_ctx);
+  ix->t_start = (const uint64_t *) (base + h->off_t_start);
+  ix->c_tid = (const uint32_t *) (base + h->off_c_tid);
+  ix->c_start = (const uint64_t *) (base + h->off_c_start);
+  ix->c_end = (const uint64_t *) (base + h->off_c_end);
+  ix->c_maxend = (const uint64_t *) (base + h->off_c_maxend);
+  ix->threads = (const struct ctxidx_thread *) (base + h->off_threads);
+  ix->ctxs = (const struct ctxidx_ctx *) (base + h->off_ctxs);
+  ix->map_size = st.st_size;
+  return ix;
+}
+
+struct ctxindex *ctxindex_open(const char *log_path, const char *idx_path,
+                               size_t run_recs, int n_threads)
+{
+  char def_path[PATH_MAX];
+  uint64_t size, mtime;
+  struct ctxindex *ix;
+
+  if (!idx_path) {
+    snprintf(def_path, sizeof(def_path), "%s.idx", log_path);
+    idx_path = def_path;
+  }
+  if (log_signature(log_path, &size, &mtime)) {
+    fprintf(stderr, "%s: %s\n", log_path, strerror(errno));
+    return NULL;
+  }
+  ix = map_index(idx_path, size, mtime);
+  if (ix)
+    return ix;
+  if (n_threads < 0 ? ctxindex_build(log_path, idx_path, run_recs) :
+      ctxindex_build_parallel(log_path, idx_path, n_threads))
+    return NULL;
+  ix = map_index(idx_path, size, mtime);
+  if (!ix)
+    fprintf(stderr, "%s: failed to map the new index\n", idx_path);
+  return ix;
+}
+
+void ctxindex_close(struct ctxindex *ix)
+{
+  munmap((void *) ix->hdr, ix->map_size);
+  free(ix);
+}
+
+
+const struct ctxidx_thread *ctxindex_thread(const struct ctxindex *ix,
+                                            uint32_t tid)
+{
+  size_t lo = 0, hi = ix->hdr->nthreads, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ix->threads[mid].tid < tid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < ix->hdr->nthreads && ix->threads[lo].tid == tid ?
+         &ix->threads[lo] : NULL;
+}
+
+const struct ctxidx_ctx *ctxindex_ctx(const struct ctxindex *ix,
+                                      int32_t ctx_id)
+{
+  size_t lo = 0, hi = ix->hdr->nctxs, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ix->ctxs[mid].ctx_id < ctx_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < ix->hdr->nctxs && ix->ctxs[lo].ctx_id == ctx_id ?
+         &ix->ctxs[lo] : NULL;
+}
+
+// First index in [lo, hi) with col[i] > t; col is sorted there.
+static size_t upper_bound(const uint64_t *col, size_t lo, size_t hi,
+                          uint64_t t)
+{
+  size_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (col[mid] <= t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int cmp_tid(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+long ctxindex_threads_in(const struct ctxindex *ix, int32_t ctx_id,
+                         uint64_t t0, uint64_t t1, uint32_t **tids)
+{
+  const struct ctxidx_ctx *c = ctxindex_ctx(ix, ctx_id);
+  size_t lo, hi, i, n = 0, out;
+  uint32_t *v;
+
+  *tids = NULL;
+  if (!c)
+    return 0;
+  /* Intervals ending after t0 start at the first row whose running max
+   * end passes t0; those starting by t1 end before the first start past
+   * t1. */
+  lo = upper_bound(ix->c_maxend, c->first, c->first + c->count, t0);
+  hi = upper_bound(ix->c_start, lo, c->first + c->count, t1);
+  if (lo >= hi)
+    return 0;
+
+  v = malloc((hi - lo) * sizeof(*v));
+  if (!v)
+    return -1;
+  for (i = lo; i < hi; i++) {
+    if (ix->c_end[i] > t0)
+      v[n++] = ix->c_tid[i];
+  }
+  qsort(v, n, sizeof(*v), cmp_tid);
+  for (i = 0, out = 0; i < n; i++) {
+    if (!out || v[out - 1] != v[i])
+      v[out++] = v[i];
+  }
+  *tids = v;
+  return out;
+}
+
+uint64_t ctxindex_row_end(const struct ctxindex *ix,
+                          const struct ctxidx_thread *t, size_t i)
+{
+  return i + 1 < t->first + t->count ? ix->t_start[i + 1] : ix->hdr->t_max;
+}
+
+size_t ctxindex_thread_rows(const struct ctxindex *ix, uint32_t tid,
+                            uint64_t t0, uint64_t t1, size_t *first)
+{
+  const struct ctxidx_thread *t = ctxindex_thread(ix, tid);
+  size_t lo, hi;
+
+  *first = 0;
+  if (!t)
+    return 0;
+  hi = upper_bound(ix->t_start, t->first, t->first + t->count, t1);
+  // The row in effect at t0 is the last one starting at or before it.
+  lo = upper_bound(ix->t_start, t->first, hi, t0);
+  if (lo > t->first)
+    lo--;
+  while (lo < hi && ctxindex_row_end(ix, t, lo) <= t0)
+    lo++;
+  *first = lo;
+  return hi - lo;
+}
@@ -0,0 +1,526 @@
+/*
+ * Text context log parser and aggregation; see ctxparse.h.
+ *
+ * The vector paths work a line at a time: one 32-byte load finds the
+ * line's delimiters, and each field is converted from a 16-byte load with
+ * pshufb (right-align the digits), pmaddubsw and pmaddwd (pairs, then
+ * groups of four) and packusdw + pmaddwd (two groups of eight). Lines they
+ * do not take whole go to the scalar parser, so the two only have to
+ * agree on lines the vector path accepts; app/parsefuzz.c checks that.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CTXPARSE_X86 1
+#endif
+
+#include "ctxparse.h"
+
+// Input the vector paths may load from, past the start of a line.
+#define FAST_WINDOW 64
+#define FAST_DIGITS 16
+
+// Initial per-thread table size; a power of 2.
+#define AGG_SLOTS 1024
+
+typedef void (*parse_fn)(const char **p, const char *end,
+                         struct ctxparse_cols *c);
+
+static parse_fn cur_parse;
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+
+/*------------------------------Scalar.---------------------------------*/
+// 1-20 digits of [*s, end) up to max. Advances *s past them.
+static int scalar_uint(const char **s, const char *end, uint64_t max,
+                       uint64_t *v)
+{
+  const char *p = *s;
+  uint64_t x = 0;
+  unsigned d;
+
+  for (; p < end && (d = (unsigned char) *p - '0') <= 9; p++) {
+    if (p - *s == 20 || x > (max - d) / 10)
+      return -1;
+    x = x * 10 + d;
+  }
+  if (p == *s)
+    return -1;
+  *s = p;
+  *v = x;
+  return 0;
+}
+
+static int expect(const char **s, const char *end, char ch)
+{
+  if (*s == end || **s != ch)
+    return -1;
+  (*s)++;
+  return 0;
+}
+
+/* Parse the line at p onto the end of c. Returns 0, or -1 if it is bad;
+ * either way *next is the start of the following line. */
+static int scalar_line(const char *p, const char *end,
+                       struct ctxparse_cols *c, const char **next)
+{
+  const char *nl = memchr(p, '\n', end - p);
+  const char *le = nl ? nl : end;
+  uint64_t tid, ctx, sec, usec;
+  int neg;
+
+  *next = nl ? nl + 1 : end;
+  if (scalar_uint(&p, le, UINT64_MAX, &tid) || expect(&p, le, '|'))
+    return -1;
+  neg = !expect(&p, le, '-');
+  if (scalar_uint(&p, le, (uint64_t) INT32_MAX + neg, &ctx) ||
+      expect(&p, le, '|') ||
+      scalar_uint(&p, le, UINT64_MAX, &sec) || expect(&p, le, '|') ||
+      scalar_uint(&p, le, UINT32_MAX, &usec) || p != le)
+    return -1;
+  c->tid[c->n] = tid;
+  c->ctx[c->n] = neg ? (int32_t) -(int64_t) ctx : (int32_t) ctx;
+  c->sec[c->n] = sec;
+  c->usec[c->n] = usec;
+  c->n++;
+  return 0;
+}
+
+static inline __attribute__((always_inline)) void
+parse_loop(const char **pp, const char *end, struct ctxparse_cols *c,
+           int (*fast)(const char *, struct ctxparse_cols *))
+{
+  const char *p = *pp;
+  int used;
+
+  while (p < end && c->n < c->cap) {
+    if (fast && end - p >= FAST_WINDOW && (used = fast(p, c))) {
+      p += used;
+      continue;
+    }
+    if (scalar_line(p, end, c, &p))
+      c->bad++;
+  }
+  *pp = p;
+}
+
+static void parse_scalar(const char **p, const char *end,
+                         struct ctxparse_cols *c)
+{
+  parse_loop(p, end, c, NULL);
+}
+
+/*------------------------------Vector.---------------------------------*/
+#ifdef CTXPARSE_X86
+/* The len (1-16) digits at s. Returns 0, or -1 if they are not all
+ * digits. */
+__attribute__((target("sse4.2"), always_inline)) static inline int
+digits16(const char *s, int len, uint64_t *out)
+{
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                     12, 13, 14, 15);
+  __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) s),
+                           _mm_set1_epi8('0'));
+  unsigned want = (1u << len) - 1;
+  unsigned ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, nine),
+                                                 nine));
+
+  if ((ok & want) != want)
+    return -1;
+  // Right-align; indices that go negative select zeros.
+  v = _mm_shuffle_epi8(v, _mm_add_epi8(iota, _mm_set1_epi8(len - 16)));
+  v = _mm_maddubs_epi16(v, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1,
+                                         10, 1, 10, 1, 10, 1));
+  v = _mm_madd_epi16(v, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+  v = _mm_packus_epi32(v, v);
+  v = _mm_madd_epi16(v, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1,
+                                       10000, 1));
+  *out = (uint64_t) (uint32_t) _mm_cvtsi128_si32(v) * 100000000 +
+         (uint32_t) _mm_extract_epi32(v, 1);
+  return 0;
+}
+
+/* Take the line at p whose '|' and '\n' bytes among its first 32 are the
+ * bits of mask. Returns its length, or 0 to leave it to the scalar
+ * parser. */
+__attribute__((target("sse4.2"), always_inline)) static inline int
+fast_fields(const char *p, uint32_t mask, struct ctxparse_cols *c)
+{
+  int d[4], i, s, neg;
+  uint64_t tid, ctx, sec, usec;
+
+  for (i = 0; i < 4; i++) {
+    if (!mask)
+      return 0;
+    d[i] = __builtin_ctz(mask);
+    mask &= mask - 1;
+  }
+  if (p[d[0]] != '|' || p[d[1]] != '|' || p[d[2]] != '|' ||
+      p[d[3]] != '\n')
+    return 0;
+  s = d[0] + 1;
+  neg = p[s] == '-';
+  s += neg;
+  if (d[0] < 1 || d[0] > FAST_DIGITS || d[1] - s < 1 ||
+      d[1] - s > FAST_DIGITS || d[2] - d[1] - 1 < 1 ||
+      d[2] - d[1] - 1 > FAST_DIGITS || d[3] - d[2] - 1 < 1 ||
+      d[3] - d[2] - 1 > FAST_DIGITS)
+    return 0;
+  if (digits16(p, d[0], &tid) || digits16(p + s, d[1] - s, &ctx) ||
+      digits16(p + d[1] + 1, d[2] - d[1] - 1, &sec) ||
+      digits16(p + d[2] + 1, d[3] - d[2] - 1, &usec) ||
+      ctx > (uint64_t) INT32_MAX + neg || usec > UINT32_MAX)
+    return 0;
+  c->tid[c->n] = tid;
+  c->ctx[c->n] = neg ? (int32_t) -(int64_t) ctx : (int32_t) ctx;
+  c->sec[c->n] = sec;
+  c->usec[c->n] = usec;
+  c->n++;
+  return d[3] + 1;
+}
+
+// pcmpestrm marks the bytes of each half that are any of "|\n".
+__attribute__((target("sse4.2"))) static int
+fast_sse42(const char *p, struct ctxparse_cols *c)
+{
+  const __m128i set = _mm_setr_epi8('|', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 0, 0);
+  const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+  __m128i a = _mm_loadu_si128((const __m128i *) p);
+  __m128i b = _mm_loadu_si128((const __m128i *) (p + 16));
+  uint32_t lo = _mm_cvtsi128_si32(_mm_cmpestrm(set, 2, a, 16, mode));
+  uint32_t hi = _mm_cvtsi128_si32(_mm_cmpestrm(set, 2, b, 16, mode));
+
+  return fast_fields(p, (lo & 0xffff) | hi << 16, c);
+}
+
+__attribute__((target("avx2"))) static int
+fast_avx2(const char *p, struct ctxparse_cols *c)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+                              _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+  return fast_fields(p, _mm256_movemask_epi8(m), c);
+}
+
+__attribute__((target("sse4.2"))) static void
+parse_sse42(const char **p, const char *end, struct ctxparse_cols *c)
+{
+  parse_loop(p, end, c, fast_sse42);
+}
+
+__attribute__((target("avx2"))) static void
+parse_avx2(const char **p, const char *end, struct ctxparse_cols *c)
+{
+  parse_loop(p, end, c, fast_avx2);
+}
+#endif
+
+enum ctxparse_isa ctxparse_best_isa(void)
+{
+#ifdef CTXPARSE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return CTXPARSE_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return CTXPARSE_SSE42;
+#endif
+  return CTXPARSE_SCALAR;
+}
+
+enum ctxparse_isa ctxparse_set_isa(enum ctxparse_isa isa)
+{
+  enum ctxparse_isa best = ctxparse_best_isa();
+
+  if (isa > best)
+    isa = best;
+  switch (isa) {
+#ifdef CTXPARSE_X86
+  case CTXPARSE_AVX2:
+    cur_parse = parse_avx2;
+    break;
+  case CTXPARSE_SSE42:
+    cur_parse = parse_sse42;
+    break;
+#endif
+  default:
+    isa = CTXPARSE_SCALAR;
+    cur_parse = parse_scalar;
+  }
+  return isa;
+}
+
+static void set_best_isa(void)
+{
+  if (!cur_parse)
+    ctxparse_set_isa(ctxparse_best_isa());
+}
+
+int ctxparse_cols_init(struct ctxparse_cols *c, size_t cap)
+{
+  memset(c, 0, sizeof(*c));
+  c->tid = malloc(cap * sizeof(*c->tid));
+  c->ctx = malloc(cap * sizeof(*c->ctx));
+  c->sec = malloc(cap * sizeof(*c->sec));
+  c->usec = malloc(cap * sizeof(*c->usec));
+  c->cap = cap;
+  if (c->tid && c->ctx && c->sec && c->usec)
+    return 0;
+  ctxparse_cols_free(c);
+  return -1;
+}
+
+void ctxparse_cols_free(struct ctxparse_cols *c)
+{
+  free(c->tid);
+  free(c->ctx);
+  free(c->sec);
+  free(c->usec);
+  memset(c, 0, sizeof(*c));
+}
+
+void ctxparse_lines(const char **p, const char *end,
+                    struct ctxparse_cols *c)
+{
+  pthread_once(&isa_once, set_best_isa);
+  cur_parse(p, end, c);
+}
+
+/*----------------------------Aggregation.--------------------------------*/
+// Open addressing by ctx; a slot with no records is empty.
+struct agg_tbl {
+  struct ctxparse_agg *slots;
+  size_t cap, n;
+};
+
+struct agg_part {
+  const char *start, *end;
+  struct agg_tbl tbl;
+  size_t lines, bad;
+  int started, failed;
+};
+
+static inline size_t agg_hash(int32_t ctx, size_t cap)
+{
+  return ((uint32_t) ctx * 0x9e3779b1u) & (cap - 1);
+}
+
+static int agg_init(struct agg_tbl *t, size_t cap)
+{
+  t->slots = calloc(cap, sizeof(*t->slots));
+  t->cap = cap;
+  t->n = 0;
+  return t->slots ? 0 : -1;
+}
+
+static struct ctxparse_agg *agg_slot(struct agg_tbl *t, int32_t ctx);
+
+static int agg_grow(struct agg_tbl *t)
+{
+  struct agg_tbl old = *t;
+  size_t i;
+
+  if (agg_init(t, old.cap * 2)) {
+    *t = old;
+    return -1;
+  }
+  for (i = 0; i < old.cap; i++) {
+    if (old.slots[i].records)
+      *agg_slot(t, old.slots[i].ctx) = old.slots[i];
+  }
+  t->n = old.n;
+  free(old.slots);
+  return 0;
+}
+
+/* ctx's slot, which may be empty. The table is kept at most half full, so
+ * there always is one. */
+static struct ctxparse_agg *agg_slot(struct agg_tbl *t, int32_t ctx)
+{
+  size_t i = agg_hash(ctx, t->cap);
+
+  while (t->slots[i].records && t->slots[i].ctx != ctx)
+    i = (i + 1) & (t->cap - 1);
+  return &t->slots[i];
+}
+
+static inline int time_before(uint64_t s1, uint32_t u1, uint64_t s2,
+                              uint32_t u2)
+{
+  return s1 < s2 || (s1 == s2 && u1 < u2);
+}
+
+// Fold a's totals into ctx's in t.
+static int agg_merge(struct agg_tbl *t, const struct ctxparse_agg *a)
+{
+  struct ctxparse_agg *s = agg_slot(t, a->ctx);
+
+  if (!s->records) {
+    *s = *a;
+    if (++t->n * 2 > t->cap)
+      return agg_grow(t);
+    return 0;
+  }
+  s->records += a->records;
+  if (time_before(a->first_sec, a->first_usec, s->first_sec,
+                  s->first_usec)) {
+    s->first_sec = a->first_sec;
+    s->first_usec = a->first_usec;
+  }
+  if (time_before(s->last_sec, s->last_usec, a->last_sec, a->last_usec)) {
+    s->last_sec = a->last_sec;
+    s->last_usec = a->last_usec;
+  }
+  return 0;
+}
+
+static int agg_cols(struct agg_tbl *t, const struct ctxparse_cols *c)
+{
+  struct ctxparse_agg a = { .records = 1 }, *s;
+  size_t i;
+
+  for (i = 0; i < c->n; i++) {
+    s = agg_slot(t, c->ctx[i]);
+    // Contexts seen before take the short way.
+    if (s->records) {
+      s->records++;
+      if (time_before(c->sec[i], c->usec[i], s->first_sec, s->first_usec)) {
+        s->first_sec = c->sec[i];
+        s->first_usec = c->usec[i];
+      }
+      if (time_before(s->last_sec, s->last_usec, c->sec[i], c->usec[i])) {
+        s->last_sec = c->sec[i];
+        s->last_usec = c->usec[i];
+      }
+      continue;
+    }
+    a.ctx = c->ctx[i];
+    a.first_sec = a.last_sec = c->sec[i];
+    a.first_usec = a.last_usec = c->usec[i];
+    if (agg_merge(t, &a))
+      return -1;
+  }
+  return 0;
+}
+
+static void *agg_worker(void *arg)
+{
+  struct agg_part *part = arg;
+  struct ctxparse_cols c;
+  const char *p = part->start;
+
+  if (ctxparse_cols_init(&c, CTXPARSE_BATCH) ||
+      agg_init(&part->tbl, AGG_SLOTS)) {
+    part->failed = 1;
+    return NULL;
+  }
+  while (p < part->end) {
+    c.n = 0;
+    ctxparse_lines(&p, part->end, &c);
+    part->lines += c.n;
+    if (agg_cols(&part->tbl, &c)) {
+      part->failed = 1;
+      break;
+    }
+  }
+  part->bad = c.bad;
+  ctxparse_cols_free(&c);
+  return NULL;
+}
+
+static int cmp_agg(const void *a, const void *b)
+{
+  int32_t x = ((const struct ctxparse_agg *) a)->ctx;
+  int32_t y = ((const struct ctxparse_agg *) b)->ctx;
+
+  return (x > y) - (x < y);
+}
+
+// Start of the first line at or after off.
+static size_t line_start(const char *buf, size_t len, size_t off)
+{
+  const char *nl;
+
+  if (!off || off >= len)
+    return off < len ? off : len;
+  nl = memchr(buf + off - 1, '\n', len - off + 1);
+  return nl ? (size_t) (nl + 1 - buf) : len;
+}
+
+long ctxparse_aggregate(const char *buf, size_t len, int n_threads,
+                        struct ctxparse_agg **out, size_t *lines,
+                        size_t *bad)
+{
+  struct agg_part *parts;
+  pthread_t *threads;
+  struct agg_tbl *all;
+  long n = -1;
+  size_t i, j, off, prev = 0;
+  int t;
+
+  pthread_once(&isa_once, set_best_isa);
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads <= 0)
+    n_threads = 1;
+  parts = calloc(n_threads, sizeof(*parts));
+  threads = calloc(n_threads, sizeof(*threads));
+  if (!parts || !threads)
+    goto out;
+
+  for (t = 0; t < n_threads; t++) {
+    off = line_start(buf, len, (size_t) ((double) len * t / n_threads));
+    parts[t].start = buf + (off > prev ? off : prev);
+    prev = parts[t].start - buf;
+    if (t)
+      parts[t - 1].end = parts[t].start;
+  }
+  parts[n_threads - 1].end = buf + len;
+  for (t = 1; t < n_threads; t++) {
+    parts[t].started = !pthread_create(&threads[t], NULL, agg_worker,
+                                       &parts[t]);
+    parts[t].failed = !parts[t].started;
+  }
+  agg_worker(&parts[0]);
+  for (t = 1; t < n_threads; t++) {
+    if (parts[t].started)
+      pthread_join(threads[t], NULL);
+  }
+
+  *lines = *bad = 0;
+  for (t = 0; t < n_threads; t++) {
+    if (parts[t].failed)
+      goto out;
+    *lines += parts[t].lines;
+    *bad += parts[t].bad;
+  }
+  all = &parts[0].tbl;
+  for (t = 1; t < n_threads; t++) {
+    for (i = 0; i < parts[t].tbl.cap; i++) {
+      if (parts[t].tbl.slots[i].records &&
+          agg_merge(all, &parts[t].tbl.slots[i]))
+        goto out;
+    }
+  }
+  // Compact in place and sort.
+  for (i = j = 0; i < all->cap; i++) {
+    if (all->slots[i].records)
+      all->slots[j++] = all->slots[i];
+  }
+  qsort(all->slots, j, sizeof(*all->slots), cmp_agg);
+  *out = all->slots;
+  all->slots = NULL;
+  n = j;
+out:
+  for (t = 0; parts && t < n_threads; t++)
+    free(parts[t].tbl.slots);
+  free(parts);
+  free(threads);
+  return n;
+}
@@ -0,0 +1,162 @@
+/*
+ * ctxquery - answer timeline questions about a binary context.log.
+ *
+ * Usage: ctxquery [-l context.log] [-i index] [-r run_recs] [-j threads]
+ *                 <query>
+ *
+ *   build                      (re)build the index
+ *   threads <ctx> <t0> <t1>    threads in ctx at some point in [t0, t1]
+ *   residency [ctx]            ctx|intervals|seconds spent in each context
+ *   rate [tid]                 tid|switches|seconds|switches per second
+ *   timeline <tid> [t0 t1]     tid|ctx|start|end intervals of a thread
+ *
+ * Times are seconds since the epoch, with an optional fraction. The index
+ * defaults to <log>.idx and is built on first use, or again whenever the
+ * log has changed since; see ctxindex.h. -j builds it in memory on that
+ * many threads (0: one per CPU) instead of by external sort.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ctxindex.h"
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: ctxquery [-l log] [-i index] [-r run_recs] [-j threads] "
+          "<query>\n"
+          "  build\n"
+          "  threads <ctx> <t0> <t1>\n"
+          "  residency [ctx]\n"
+          "  rate [tid]\n"
+          "  timeline <tid> [t0 t1]\n");
+  exit(1);
+}
+
+// "sec[.frac]" to microseconds.
+static uint64_t parse_time(const char *s)
+{
+  char *end;
+  double t = strtod(s, &end);
+
+  if (end == s || *end || t < 0)
+    usage();
+  return (uint64_t) (t * 1e6 + 0.5);
+}
+
+static void print_time(uint64_t t)
+{
+  printf("%lu.%06lu", (unsigned long) (t / 1000000),
+         (unsigned long) (t % 1000000));
+}
+
+static void print_residency(const struct ctxidx_ctx *c)
+{
+  printf("%d|%lu|", c->ctx_id, (unsigned long) c->count);
+  print_time(c->residency);
+  printf("\n");
+}
+
+static void print_rate(const struct ctxidx_thread *t)
+{
+  uint64_t span = t->t_last - t->t_first;
+
+  printf("%u|%lu|", t->tid, (unsigned long) t->switches);
+  print_time(span);
+  if (span)
+    printf("|%.3f\n", t->switches * 1e6 / span);
+  else
+    printf("|-\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *log_path = "context.log", *idx_path = NULL, *q;
+  char def_path[4096];
+  size_t run_recs = 0, i, n, first;
+  struct ctxindex *ix;
+  uint32_t *tids;
+  uint64_t t0 = 0, t1 = UINT64_MAX;
+  long ntids;
+  int opt, jobs = -1;
+
+  while ((opt = getopt(argc, argv, "l:i:r:j:")) != -1) {
+    switch (opt) {
+    case 'l': log_path = optarg; break;
+    case 'i': idx_path = optarg; break;
+    case 'r': run_recs = strtoul(optarg, NULL, 10); break;
+    case 'j': jobs = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind >= argc)
+    usage();
+  q = argv[optind++];
+  argc -= optind;
+  argv += optind;
+
+  if (!strcmp(q, "build")) {
+    if (!idx_path) {
+      snprintf(def_path, sizeof(def_path), "%s.idx", log_path);
+      idx_path = def_path;
+    }
+    if (jobs >= 0)
+      return ctxindex_build_parallel(log_path, idx_path, jobs) ? 1 : 0;
+    return ctxindex_build(log_path, idx_path, run_recs) ? 1 : 0;
+  }
+
+  ix = ctxindex_open(log_path, idx_path, run_recs, jobs);
+  if (!ix)
+    return 1;
+
+  if (!strcmp(q, "threads") && argc == 3) {
+    ntids = ctxindex_threads_in(ix, atoi(argv[0]), parse_time(argv[1]),
+                                parse_time(argv[2]), &tids);
+    if (ntids < 0)
+      fail("Failed to allocate thread list!\n");
+    for (i = 0; i < (size_t) ntids; i++)
+      printf("%u\n", tids[i]);
+    free(tids);
+  } else if (!strcmp(q, "residency") && argc <= 1) {
+    if (argc) {
+      const struct ctxidx_ctx *c = ctxindex_ctx(ix, atoi(argv[0]));
+      if (c)
+        print_residency(c);
+    } else {
+      for (i = 0; i < ix->hdr->nctxs; i++)
+        print_residency(&ix->ctxs[i]);
+    }
+  } else if (!strcmp(q, "rate") && argc <= 1) {
+    if (argc) {
+      const struct ctxidx_thread *t = ctxindex_thread(ix, atoi(argv[0]));
+      if (t)
+        print_rate(t);
+    } else {
+      for (i = 0; i < ix->hdr->nthreads; i++)
+        print_rate(&ix->threads[i]);
+    }
+  } else if (!strcmp(q, "timeline") && (argc == 1 || argc == 3)) {
+    const struct ctxidx_thread *t = ctxindex_thread(ix, atoi(argv[0]));
+
+    if (argc == 3) {
+      t0 = parse_time(argv[1]);
+      t1 = parse_time(argv[2]);
+    }
+    n = ctxindex_thread_rows(ix, t ? t->tid : 0, t0, t1, &first);
+    for (i = first; i < first + n; i++) {
+      printf("%u|%d|", t->tid, ix->t_ctx[i]);
+      print_time(ix->t_start[i]);
+      printf("|");
+      print_time(ctxindex_row_end(ix, t, i));
+      printf("\n");
+    }
+  } else {
+    usage();
+  }
+
+  ctxindex_close(ix);
+  return 0;
+}
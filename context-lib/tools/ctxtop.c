@@ -0,0 +1,171 @@
+/*
+ * ctxtop - watch a running program's contexts through LCTX_SHM.
+ *
+ * Usage: ctxtop <pid|name> [interval_ms] [samples]
+ *
+ * Attaches to the segment a program started with LCTX_SHM=1 (by pid) or
+ * LCTX_SHM=<name> publishes (see ctxshm.h), without stopping it. Every
+ * interval (default 1000 ms) it prints which context each thread is in,
+ * then the busiest contexts over the interval as
+ * ctx|switches|wall_ms|cpu_ms, until the program exits or after samples
+ * samples (default: no limit).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "common.h"
+#include "ctxshm.h"
+
+#define TOP_CTXS 10
+
+// A context's counters at the last sample, to print what changed.
+struct prev {
+  int ctx_id;
+  struct ctxshm_ctx_snap s;
+};
+
+struct delta {
+  int ctx_id;
+  uint64_t switches, ticks, cpu_ns;
+};
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: ctxtop <pid|name> [interval_ms] [samples]\n");
+  exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Ticks per ns, measured as the runtime does since its epoch.
+static double tick_rate(const struct ctxshm_hdr *hdr)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ns = now_ns() - hdr->t0_ns;
+  uint64_t t = __rdtsc() - hdr->t0_ticks;
+
+  if (hdr->tsc && ns && t)
+    return (double) t / ns;
+#else
+  (void) hdr;
+#endif
+  return 1;
+}
+
+static int cmp_delta(const void *a, const void *b)
+{
+  const struct delta *x = a, *y = b;
+
+  if (x->switches != y->switches)
+    return x->switches < y->switches ? 1 : -1;
+  return (x->ticks < y->ticks) - (x->ticks > y->ticks);
+}
+
+static void print_threads(const struct ctxshm_hdr *hdr)
+{
+  const struct ctxshm_thread *threads = ctxshm_threads(hdr);
+  struct ctxshm_thread_snap t;
+  uint32_t i, n = ctxshm_n_threads(hdr);
+
+  printf("tid|ctx|switches\n");
+  for (i = 0; i < n; i++) {
+    if (ctxshm_read_thread(&threads[i], &t))
+      continue;
+    if (t.ctx_id == CTXSHM_NO_CTX)
+      printf("%ld|-|%lu\n", t.tid, (unsigned long) t.switches);
+    else
+      printf("%ld|%d|%lu\n", t.tid, t.ctx_id, (unsigned long) t.switches);
+  }
+}
+
+/* Print the contexts that did the most since the last sample, and save
+ * their counters in prev (indexed by slot). */
+static void print_ctxs(const struct ctxshm_hdr *hdr, struct prev *prev,
+                       struct delta *d)
+{
+  const struct ctxshm_ctx *ctxs = ctxshm_ctxs(hdr);
+  struct ctxshm_ctx_snap c;
+  uint32_t i, n = ctxshm_n_ctxs(hdr), nd = 0, live = 0;
+  double rate = tick_rate(hdr);
+
+  for (i = 0; i < n; i++) {
+    if (ctxshm_read_ctx(&ctxs[i], &c)) {
+      prev[i].ctx_id = CTXSHM_FREE_CTX;
+      continue;
+    }
+    live++;
+    // A reused slot starts over.
+    if (prev[i].ctx_id != c.ctx_id)
+      memset(&prev[i].s, 0, sizeof(prev[i].s));
+    d[nd] = (struct delta) { c.ctx_id, c.switches - prev[i].s.switches,
+                             c.ticks - prev[i].s.ticks,
+                             c.cpu_ns - prev[i].s.cpu_ns };
+    if (d[nd].switches || d[nd].ticks)
+      nd++;
+    prev[i].ctx_id = c.ctx_id;
+    prev[i].s = c;
+  }
+  qsort(d, nd, sizeof(*d), cmp_delta);
+  printf("%u contexts, %u active\nctx|switches|wall_ms|cpu_ms\n", live, nd);
+  for (i = 0; i < nd && i < TOP_CTXS; i++)
+    printf("%d|%lu|%.3f|%.3f\n", d[i].ctx_id, (unsigned long) d[i].switches,
+           d[i].ticks / rate / 1e6, d[i].cpu_ns / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+  const struct ctxshm_hdr *hdr;
+  struct prev *prev;
+  struct delta *d;
+  char name[NAME_MAX], *end;
+  long pid, interval = 1000, samples = -1, i;
+
+  if (argc < 2 || argc > 4)
+    usage();
+  pid = strtol(argv[1], &end, 10);
+  if (*end || end == argv[1])
+    ctxshm_name(name, sizeof(name), argv[1], 0);
+  else
+    ctxshm_name(name, sizeof(name), NULL, pid);
+  if (argc > 2 && (interval = atol(argv[2])) <= 0)
+    usage();
+  if (argc > 3 && (samples = atol(argv[3])) <= 0)
+    usage();
+
+  hdr = ctxshm_map(name);
+  if (!hdr) {
+    fprintf(stderr, "ctxtop: no context segment %s\n", name);
+    return 1;
+  }
+  prev = malloc(hdr->n_ctxs * sizeof(*prev));
+  d = malloc(hdr->n_ctxs * sizeof(*d));
+  if (!prev || !d)
+    fail("Failed to allocate %u contexts\n", hdr->n_ctxs);
+  for (i = 0; i < hdr->n_ctxs; i++)
+    prev[i].ctx_id = CTXSHM_FREE_CTX;
+
+  for (i = 0; samples < 0 || i < samples; i++) {
+    usleep(interval * 1000);
+    printf("== pid %ld, %.3f s\n", (long) hdr->pid,
+           (now_ns() - hdr->t0_ns) / 1e9);
+    print_threads(hdr);
+    print_ctxs(hdr, prev, d);
+    fflush(stdout);
+    if (atomic_load(&hdr->exited))
+      break;
+  }
+  return 0;
+}
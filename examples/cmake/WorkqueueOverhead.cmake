@@ -0,0 +1,91 @@
+# Compare uninstrumented and instrumented workqueue-bench runs.
+#
+# Run as a script by the workqueue-overhead target:
+#   cmake -DPLAIN=<exe> -DINSTRUMENTED=<exe> -DRUNS=<n> -DARGS=<a|b>
+#         -P WorkqueueOverhead.cmake
+#
+# The two binaries run alternately RUNS times each, so drift in machine
+# load hits both alike, and the medians are compared. Overhead is the
+# throughput lost and the latency added by the instrumentation, relative
+# to the uninstrumented build.
+
+foreach(var PLAIN INSTRUMENTED RUNS)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "WorkqueueOverhead: ${var} is not set")
+  endif()
+endforeach()
+string(REPLACE "|" ";" ARGS "${ARGS}")
+set(metrics tasks_per_sec lat_p50_ns lat_p99_ns)
+
+# Zero-pad so that a plain string sort orders the values numerically.
+function(pad value out)
+  string(LENGTH "${value}" len)
+  while(len LESS 20)
+    set(value "0${value}")
+    math(EXPR len "${len} + 1")
+  endwhile()
+  set(${out} "${value}" PARENT_SCOPE)
+endfunction()
+
+function(median values out)
+  list(SORT values)
+  list(LENGTH values n)
+  math(EXPR mid "${n} / 2")
+  list(GET values ${mid} m)
+  # Drop the padding. REGEX REPLACE would strip zeros after the first digit
+  # too, as it applies ^ again at each match.
+  math(EXPR m "${m}")
+  set(${out} ${m} PARENT_SCOPE)
+endfunction()
+
+# delta / base as a percentage with two decimals.
+function(percent delta base out)
+  if(base EQUAL 0)
+    set(${out} "n/a" PARENT_SCOPE)
+    return()
+  endif()
+  math(EXPR bp "${delta} * 10000 / ${base}")
+  set(sign "")
+  if(bp LESS 0)
+    set(sign "-")
+    math(EXPR bp "0 - ${bp}")
+  endif()
+  math(EXPR whole "${bp} / 100")
+  math(EXPR frac "${bp} % 100")
+  if(frac LESS 10)
+    set(frac "0${frac}")
+  endif()
+  set(${out} "${sign}${whole}.${frac}%" PARENT_SCOPE)
+endfunction()
+
+foreach(run RANGE 1 ${RUNS})
+  foreach(kind PLAIN INSTRUMENTED)
+    execute_process(COMMAND ${${kind}} ${ARGS}
+                    OUTPUT_VARIABLE out RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+      message(FATAL_ERROR "WorkqueueOverhead: ${${kind}} failed: ${rc}")
+    endif()
+    foreach(m ${metrics})
+      if(NOT out MATCHES "${m}=([0-9]+)")
+        message(FATAL_ERROR "WorkqueueOverhead: no ${m} in: ${out}")
+      endif()
+      pad(${CMAKE_MATCH_1} v)
+      list(APPEND ${kind}_${m} ${v})
+    endforeach()
+  endforeach()
+endforeach()
+
+string(REPLACE ";" " " args_str "${ARGS}")
+message("workqueue-bench ${args_str}: median of ${RUNS} runs")
+foreach(m ${metrics})
+  median("${PLAIN_${m}}" plain)
+  median("${INSTRUMENTED_${m}}" inst)
+  if(m STREQUAL "tasks_per_sec")
+    math(EXPR delta "${plain} - ${inst}")
+  else()
+    math(EXPR delta "${inst} - ${plain}")
+  endif()
+  percent(${delta} ${plain} overhead)
+  message("  ${m}: uninstrumented ${plain}, instrumented ${inst}, "
+          "overhead ${overhead}")
+endforeach()
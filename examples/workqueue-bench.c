@@ -0,0 +1,273 @@
+/*
+ * End-to-end overhead benchmark for the delegation runtime.
+ *
+ * The work-queue pattern of mpi-tutorial.c, made to terminate and timed:
+ * the producer wraps each input in an input_buffer (@indicator
+ * curr_input), creates a subtask for it (@delegator) and pushes it on a
+ * bounded work_queue; worker threads pop subtasks into a @del_indicator
+ * and run them. A task upper-cases its input `passes` times.
+ *
+ * Usage: workqueue-bench [-n tasks] [-q queue_len] [-w workers]
+ *                        [-s task_size] [-p passes]
+ *
+ * Prints one line of key=value pairs: throughput in tasks/s and the
+ * enqueue-to-completion latency percentiles in ns. instrumented=1 means
+ * the binary was built with PartitionPass (it calls into the runtime).
+ * examples/CMakeLists.txt builds it both ways with the same compiler and
+ * flags, and the workqueue-overhead target compares the two.
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __clang__
+#define INDICATOR __attribute__((annotate("indicator")))
+#define DELEGATOR __attribute__((annotate("delegator")))
+#define DEL_INDICATOR __attribute__((annotate("del_indicator")))
+#define IND_IDENTIFIER __attribute__((annotate("ind_identifier")))
+#define DEL_IDENTIFIER __attribute__((annotate("del_identifier")))
+#else
+#define INDICATOR
+#define DELEGATOR
+#define DEL_INDICATOR
+#define IND_IDENTIFIER
+#define DEL_IDENTIFIER
+#endif
+
+// Present only when the runtime was linked in by the instrumentation.
+extern void init_lctx(void) __attribute__((weak));
+
+struct input_buffer {
+  char *user_input;
+  size_t size;
+  IND_IDENTIFIER int id;
+};
+
+INDICATOR struct input_buffer *curr_input;
+
+struct subtask {
+  void (*run)(struct input_buffer *input);
+  struct subtask *next;
+  DEL_IDENTIFIER int id;
+  struct input_buffer *input;
+  uint64_t enqueued;
+};
+
+// Bounded FIFO; the producer waits while it holds queue_len tasks.
+struct work_queue {
+  struct subtask *head, *tail;
+  int len, cap, done;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+};
+
+static long n_tasks = 100000;
+static int n_workers = 4;
+static int queue_len = 64;
+static size_t task_size = 256;
+static int passes = 1;
+
+static struct work_queue *que;
+// Enqueue-to-completion latency of each task, indexed by subtask id.
+static uint64_t *latency;
+static volatile long sink;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct work_queue *init_queue(int cap)
+{
+  struct work_queue *q = calloc(1, sizeof(*q));
+
+  if (!q) {
+    perror("calloc");
+    exit(1);
+  }
+  q->cap = cap;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  return q;
+}
+
+static void add_que(struct work_queue *q, struct subtask *tsk)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->len == q->cap)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  tsk->enqueued = now_ns();
+  if (q->tail)
+    q->tail->next = tsk;
+  else
+    q->head = tsk;
+  q->tail = tsk;
+  q->len++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// NULL once the queue is empty and the producer is done.
+static struct subtask *pop(struct work_queue *q)
+{
+  struct subtask *rc;
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->head && !q->done)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  rc = q->head;
+  if (rc) {
+    q->head = rc->next;
+    if (!q->head)
+      q->tail = NULL;
+    q->len--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return rc;
+}
+
+static void finish_queue(struct work_queue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->done = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static struct subtask *init_task(void)
+{
+  static int id = 0;
+  struct subtask *tsk = malloc(sizeof(struct subtask));
+
+  if (!tsk) {
+    perror("malloc");
+    exit(1);
+  }
+  tsk->next = NULL;
+  tsk->id = id++;
+  return tsk;
+}
+
+static void upper(struct input_buffer *input)
+{
+  size_t i;
+  int p;
+
+  for (p = 0; p < passes; p++) {
+    for (i = 0; i < input->size; i++)
+      input->user_input[i] = toupper(input->user_input[i] ^ p);
+  }
+  sink += input->user_input[0];
+}
+
+static void *work_loop(void *arg)
+{
+  DEL_INDICATOR struct subtask *current;
+
+  (void) arg;
+  while ((current = pop(que))) {
+    current->run(current->input);
+    latency[current->id] = now_ns() - current->enqueued;
+    free(current->input->user_input);
+    free(current->input);
+    free(current);
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: workqueue-bench [-n tasks] [-q queue_len] "
+          "[-w workers] [-s task_size] [-p passes]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct input_buffer *user_input;
+  DELEGATOR struct subtask *sub_task = NULL;
+  pthread_t *workers;
+  uint64_t start, elapsed;
+  long i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:q:w:s:p:")) != -1) {
+    switch (opt) {
+    case 'n': n_tasks = atol(optarg); break;
+    case 'q': queue_len = atoi(optarg); break;
+    case 'w': n_workers = atoi(optarg); break;
+    case 's': task_size = strtoul(optarg, NULL, 10); break;
+    case 'p': passes = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (n_tasks < 1 || queue_len < 1 || n_workers < 1 || !task_size ||
+      passes < 1)
+    usage();
+
+  latency = calloc(n_tasks, sizeof(*latency));
+  workers = calloc(n_workers, sizeof(*workers));
+  if (!latency || !workers) {
+    perror("calloc");
+    return 1;
+  }
+  que = init_queue(queue_len);
+  for (i = 0; i < n_workers; i++) {
+    if (pthread_create(&workers[i], NULL, work_loop, NULL)) {
+      fprintf(stderr, "pthread_create failed\n");
+      return 1;
+    }
+  }
+
+  start = now_ns();
+  for (i = 0; i < n_tasks; i++) {
+    user_input = malloc(sizeof(struct input_buffer));
+    if (!user_input || !(user_input->user_input = malloc(task_size))) {
+      perror("malloc");
+      return 1;
+    }
+    memset(user_input->user_input, 'a' + i % 26, task_size);
+    user_input->size = task_size;
+    user_input->id = i;
+
+    // Switches this thread's context to the new input.
+    curr_input = user_input;
+
+    // The subtask inherits that context.
+    sub_task = init_task();
+    sub_task->run = upper;
+    sub_task->input = user_input;
+    add_que(que, sub_task);
+  }
+  finish_queue(que);
+  for (i = 0; i < n_workers; i++)
+    pthread_join(workers[i], NULL);
+  elapsed = now_ns() - start;
+
+  qsort(latency, n_tasks, sizeof(*latency), cmp_u64);
+  printf("instrumented=%d tasks=%ld workers=%d queue=%d size=%zu passes=%d "
+         "seconds=%.6f tasks_per_sec=%.0f lat_p50_ns=%lu lat_p99_ns=%lu "
+         "lat_max_ns=%lu\n",
+         init_lctx != NULL, n_tasks, n_workers, queue_len, task_size, passes,
+         elapsed / 1e9, n_tasks * 1e9 / elapsed,
+         (unsigned long) latency[n_tasks / 2],
+         (unsigned long) latency[n_tasks * 99 / 100],
+         (unsigned long) latency[n_tasks - 1]);
+  return 0;
+}
@@ -0,0 +1,137 @@
+# Build instrumented executables with PartitionPass.
+#
+#   list(APPEND CMAKE_MODULE_PATH <repo>/mpi-pass/cmake)
+#   include(PartitionInstrument)
+#   partition_add_executable(<target> <sources>...
+#                            [COMPILE_OPTIONS <opts>...]
+#                            [COMPILE_DEFINITIONS <defs>...]
+#                            [INCLUDE_DIRECTORIES <dirs>...]
+#                            [LINK_LIBRARIES <libs>...]
+#                            [UNINSTRUMENTED])
+#
+# Each source is compiled to unoptimized bitcode, instrumented by opt and
+# compiled to an object with COMPILE_OPTIONS (so -O2 etc. apply after the
+# pass has seen the annotations). Every TU is its own build rule, so
+# `cmake --build . -j` instruments them in parallel, and the instrumented
+# objects are cached by bitcode hash in PARTITION_CACHE_DIR (see
+# PartitionInstrumentTU.cmake). The executable links the context-lib
+# `context` target; the pass and the runtime are built as part of the
+# same project unless the including project already defines them.
+#
+# UNINSTRUMENTED skips the pass but otherwise builds the same way, which
+# gives a baseline to measure the instrumentation overhead against.
+#
+# Cache variables: PARTITION_CLANG, PARTITION_OPT, PARTITION_CACHE_DIR,
+# PARTITION_PASS_OPTIONS (e.g. -partition-inline-fastpath, or
+# -partition-whole-program for single-TU programs).
+
+if(PARTITION_INSTRUMENT_INCLUDED)
+  return()
+endif()
+set(PARTITION_INSTRUMENT_INCLUDED TRUE)
+
+set(PARTITION_ROOT ${CMAKE_CURRENT_LIST_DIR}/../..)
+set(PARTITION_TU_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/PartitionInstrumentTU.cmake)
+
+find_package(LLVM REQUIRED CONFIG)
+find_program(PARTITION_CLANG NAMES clang-${LLVM_VERSION_MAJOR} clang
+             HINTS ${LLVM_TOOLS_BINARY_DIR})
+find_program(PARTITION_OPT NAMES opt-${LLVM_VERSION_MAJOR} opt
+             HINTS ${LLVM_TOOLS_BINARY_DIR})
+set(PARTITION_CACHE_DIR ${CMAKE_BINARY_DIR}/partition-cache CACHE PATH
+    "Instrumented objects keyed by bitcode hash; may be shared by builds")
+set(PARTITION_PASS_OPTIONS "" CACHE STRING
+    "Extra PartitionPass options, e.g. -partition-inline-fastpath")
+
+if(NOT TARGET PartitionPass)
+  enable_language(CXX)
+  add_subdirectory(${PARTITION_ROOT}/mpi-pass
+                   ${CMAKE_BINARY_DIR}/partition-pass)
+endif()
+if(NOT TARGET context)
+  add_subdirectory(${PARTITION_ROOT}/context-lib
+                   ${CMAKE_BINARY_DIR}/context-lib)
+endif()
+
+function(partition_add_executable target)
+  cmake_parse_arguments(ARG "UNINSTRUMENTED"  ""
+      "COMPILE_OPTIONS;COMPILE_DEFINITIONS;INCLUDE_DIRECTORIES;LINK_LIBRARIES"
+      ${ARGN})
+  if(NOT PARTITION_CLANG OR NOT PARTITION_OPT)
+    message(FATAL_ERROR
+        "partition_add_executable: clang/opt for LLVM ${LLVM_VERSION_MAJOR} "
+        "not found; set PARTITION_CLANG and PARTITION_OPT")
+  endif()
+
+  set(frontend_flags ${ARG_COMPILE_OPTIONS})
+  foreach(def ${ARG_COMPILE_DEFINITIONS})
+    list(APPEND frontend_flags -D${def})
+  endforeach()
+  foreach(dir ${ARG_INCLUDE_DIRECTORIES})
+    get_filename_component(dir ${dir} ABSOLUTE)
+    list(APPEND frontend_flags -I${dir})
+  endforeach()
+  # The pass matches the allocas and stores clang emits at -O0. Keep the
+  # functions optimizable for the codegen step.
+  list(APPEND frontend_flags -O0)
+  if(NOT LLVM_VERSION_MAJOR VERSION_LESS 5)
+    list(APPEND frontend_flags -Xclang -disable-O0-optnone)
+  endif()
+  string(REPLACE ";" "|" codegen_flags "${ARG_COMPILE_OPTIONS}")
+  string(REPLACE ";" "|" pass_options "${PARTITION_PASS_OPTIONS}")
+  if(ARG_UNINSTRUMENTED)
+    set(pass NONE)
+    set(pass_dep)
+    set(verb "Compiling")
+  else()
+    set(pass $<TARGET_FILE:PartitionPass>)
+    set(pass_dep PartitionPass)
+    set(verb "Instrumenting")
+  endif()
+
+  set(objects)
+  set(work_dir ${CMAKE_CURRENT_BINARY_DIR}/${target}.partition)
+  foreach(src ${ARG_UNPARSED_ARGUMENTS})
+    get_filename_component(src ${src} ABSOLUTE)
+    file(RELATIVE_PATH rel ${CMAKE_CURRENT_SOURCE_DIR} ${src})
+    string(REPLACE ".." "__" rel ${rel})
+    set(bc ${work_dir}/${rel}.bc)
+    set(obj ${work_dir}/${rel}.o)
+    get_filename_component(bc_dir ${bc} DIRECTORY)
+    file(MAKE_DIRECTORY ${bc_dir})
+
+    if(CMAKE_GENERATOR MATCHES "Ninja")
+      set(deps DEPFILE ${bc}.d)
+      set(dep_flags -MD -MF ${bc}.d)
+    else()
+      set(deps IMPLICIT_DEPENDS C ${src})
+      set(dep_flags)
+    endif()
+    add_custom_command(
+      OUTPUT ${bc}
+      COMMAND ${PARTITION_CLANG} ${frontend_flags} ${dep_flags}
+              -c -emit-llvm ${src} -o ${bc}
+      DEPENDS ${src}
+      ${deps}
+      COMMENT "Emitting bitcode for ${rel}"
+      VERBATIM)
+    add_custom_command(
+      OUTPUT ${obj}
+      COMMAND ${CMAKE_COMMAND}
+              -DBC=${bc} -DOUTPUT=${obj} -DCACHE_DIR=${PARTITION_CACHE_DIR}
+              -DPASS=${pass} -DOPT=${PARTITION_OPT}
+              -DCLANG=${PARTITION_CLANG} -DLLVM_MAJOR=${LLVM_VERSION_MAJOR}
+              -DPASS_OPTIONS=${pass_options} -DCODEGEN_FLAGS=${codegen_flags}
+              -P ${PARTITION_TU_SCRIPT}
+      DEPENDS ${bc} ${pass_dep} ${PARTITION_TU_SCRIPT}
+      COMMENT "${verb} ${rel}"
+      VERBATIM)
+    list(APPEND objects ${obj})
+  endforeach()
+
+  set_source_files_properties(${objects} PROPERTIES
+      EXTERNAL_OBJECT TRUE GENERATED TRUE)
+  add_executable(${target} ${objects})
+  set_target_properties(${target} PROPERTIES LINKER_LANGUAGE C)
+  target_link_libraries(${target} PRIVATE context ${ARG_LINK_LIBRARIES})
+endfunction()
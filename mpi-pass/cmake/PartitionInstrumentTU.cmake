@@ -0,0 +1,74 @@
+# Instrument one translation unit's bitcode and compile it to an object.
+#
+# Run as a script by partition_add_executable():
+#   cmake -DBC=<in.bc> -DOUTPUT=<out.o> -DCACHE_DIR=<dir> -DPASS=<pass.so>
+#         -DOPT=<opt> -DCLANG=<clang> -DLLVM_MAJOR=<n>
+#         -DPASS_OPTIONS=<a|b> -DCODEGEN_FLAGS=<a|b>
+#         -P PartitionInstrumentTU.cmake
+#
+# Objects are cached under CACHE_DIR by a hash of the bitcode, the pass
+# library and the flags, so a rebuild that leaves a TU's bitcode unchanged
+# (or switches back to a tree built before) skips opt and codegen. Lists
+# arrive '|'-separated since ';' would split the -D argument. PASS=NONE
+# compiles the bitcode as is, for an uninstrumented baseline built the same
+# way.
+
+foreach(var BC OUTPUT CACHE_DIR PASS OPT CLANG LLVM_MAJOR)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "PartitionInstrumentTU: ${var} is not set")
+  endif()
+endforeach()
+string(REPLACE "|" ";" PASS_OPTIONS "${PASS_OPTIONS}")
+string(REPLACE "|" ";" CODEGEN_FLAGS "${CODEGEN_FLAGS}")
+
+file(SHA256 ${BC} bc_hash)
+if(PASS STREQUAL "NONE")
+  set(pass_hash none)
+else()
+  file(SHA256 ${PASS} pass_hash)
+endif()
+string(SHA256 key "${bc_hash}:${pass_hash}:${PASS_OPTIONS}:${CODEGEN_FLAGS}")
+set(cached ${CACHE_DIR}/${key}.o)
+
+if(NOT EXISTS ${cached})
+  if(LLVM_MAJOR GREATER 10)
+    # Pass options are only parsed from libraries loaded with -load.
+    set(load_pass -load-pass-plugin ${PASS} -passes=partition)
+    if(PASS_OPTIONS)
+      list(INSERT load_pass 0 -load ${PASS})
+    endif()
+  else()
+    set(load_pass -load ${PASS} -PartitionPass)
+  endif()
+
+  # Build under a unique name and rename into place, so concurrent builds
+  # sharing CACHE_DIR never see a partial object.
+  file(MAKE_DIRECTORY ${CACHE_DIR})
+  string(RANDOM LENGTH 8 tmp_tag)
+  set(inst_bc ${OUTPUT}.inst.bc)
+  set(tmp_obj ${cached}.${tmp_tag}.tmp)
+  if(PASS STREQUAL "NONE")
+    configure_file(${BC} ${inst_bc} COPYONLY)
+  else()
+    execute_process(
+      COMMAND ${OPT} ${load_pass} ${PASS_OPTIONS} ${BC} -o ${inst_bc}
+      RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+      message(FATAL_ERROR "PartitionInstrumentTU: ${OPT} failed on ${BC}")
+    endif()
+  endif()
+  execute_process(
+    COMMAND ${CLANG} ${CODEGEN_FLAGS} -c ${inst_bc} -o ${tmp_obj}
+    RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "PartitionInstrumentTU: ${CLANG} failed on ${inst_bc}")
+  endif()
+  file(RENAME ${tmp_obj} ${cached})
+  file(REMOVE ${inst_bc})
+endif()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy ${cached} ${OUTPUT}
+                RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+  message(FATAL_ERROR "PartitionInstrumentTU: cannot copy ${cached}")
+endif()
@@ -0,0 +1,282 @@
+#include "ContextFlow.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+
+using namespace llvm;
+using namespace partition;
+
+namespace {
+  // Runtime calls that switch the calling thread's context.
+  const char *const Setters[] = {
+    "instrument_indicator",
+    "instrument_del_indicator",
+    "instrument_del_enter",
+    "update_thread_ctx",
+  };
+
+  bool is_setter(const Function &F) {
+    for (const char *Name : Setters) {
+      if (F.getName() == Name)
+        return true;
+    }
+    return false;
+  }
+
+  // The rest of the runtime, which leaves the context alone.
+  bool is_runtime(const Function &F) {
+    return F.getName() == "instrument_delegator" ||
+           F.getName().startswith("lctx_");
+  }
+
+  bool is_thread_spawn(const Function &F) {
+    return F.getName() == "pthread_create";
+  }
+
+  Value *called_value(CallInst *CI) {
+#if LLVM_VERSION_MAJOR >= 11
+    return CI->getCalledOperand();
+#else
+    return CI->getCalledValue();
+#endif
+  }
+
+  // Whether the function V refers to can be called through a pointer.
+  bool escapes(Value *V) {
+    for (Use &U : V->uses()) {
+      User *Us = U.getUser();
+      if (auto *CE = dyn_cast<ConstantExpr>(Us)) {
+        // Old-style C calls go through a bitcast of the callee.
+        if (!CE->isCast() || escapes(CE))
+          return true;
+        continue;
+      }
+      if (auto *CI = dyn_cast<CallInst>(Us)) {
+        if (called_value(CI) == V)
+          continue;
+        // Start routines are handled as calls, on a thread of their own.
+        auto *Callee =
+            dyn_cast<Function>(called_value(CI)->stripPointerCasts());
+        if (Callee && is_thread_spawn(*Callee))
+          continue;
+      }
+      return true;
+    }
+    return false;
+  }
+}
+
+ContextFlow::ContextFlow(Module &M, TLIFn getTLI, bool WholeProgram,
+                         const std::set<const Instruction *> &IndicatorStores)
+    : WholeProgram(WholeProgram), IndicatorStores(IndicatorStores) {
+  Function *Any = nullptr;
+
+  for (Function &F : M) {
+    if (!F.isDeclaration()) {
+      Any = &F;
+      break;
+    }
+  }
+  if (!Any)
+    return;
+
+  // Library calls are the same throughout a module.
+  const TargetLibraryInfo &TLI = getTLI(*Any);
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      classify_external(F, TLI);
+  }
+  find_escaped(M);
+  for (Function &F : M) {
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        if (isa<CallInst>(I) || isa<InvokeInst>(I))
+          CallTargets[&I] = targets_of(I);
+      }
+    }
+  }
+
+  // Which functions can switch context, bottom up through the calls.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Function &F : M) {
+      if (F.isDeclaration() || SetsCtx.count(&F))
+        continue;
+      for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+          if (sets_context(I)) {
+            SetsCtx.insert(&F);
+            changed = true;
+            break;
+          }
+        }
+        if (SetsCtx.count(&F))
+          break;
+      }
+    }
+  }
+
+  // Then where they do, top down from the entry points.
+  if (Function *Main = M.getFunction("main"))
+    enter(Main, false);
+  for (Function &F : M) {
+    if (!WholeProgram && !F.hasLocalLinkage() && F.getName() != "main")
+      enter(&F, true);
+  }
+  bool AnyCtx = false;
+  changed = true;
+  while (changed) {
+    changed = false;
+    for (Function &F : M) {
+      if (Reachable.count(&F))
+        changed |= propagate(F);
+    }
+    for (const Function *F : Reachable)
+      AnyCtx |= SetsCtx.count(F) || EntersCtx.count(F);
+    for (Function *F : Escaped)
+      changed |= enter(F, AnyCtx);
+  }
+}
+
+void ContextFlow::classify_external(Function &F, const TargetLibraryInfo &TLI) {
+  LibFunc LF;
+
+  if (is_setter(F)) {
+    SetsCtx.insert(&F);
+    return;
+  }
+  if (F.isIntrinsic() || is_runtime(F) || is_thread_spawn(F) ||
+      TLI.getLibFunc(F, LF))
+    return;
+  // Maybe instrumented code in another module.
+  if (!WholeProgram)
+    SetsCtx.insert(&F);
+}
+
+void ContextFlow::find_escaped(Module &M) {
+  for (Function &F : M) {
+    if (!F.isIntrinsic() && escapes(&F))
+      Escaped.push_back(&F);
+  }
+}
+
+ContextFlow::Targets ContextFlow::targets_of(Instruction &I) {
+  Targets T;
+  auto *CI = dyn_cast<CallInst>(&I);
+
+  // C has no invokes; don't guess.
+  if (!CI) {
+    T.Opaque = true;
+    return T;
+  }
+  Value *V = called_value(CI)->stripPointerCasts();
+  auto *Callee = dyn_cast<Function>(V);
+  if (!Callee) {
+    if (isa<InlineAsm>(V))
+      return T;
+    // Any function whose address escapes, here or in another module.
+    T.Fns.append(Escaped.begin(), Escaped.end());
+    T.Opaque = !WholeProgram;
+    return T;
+  }
+  if (Callee->isIntrinsic())
+    return T;
+  if (!Callee->isDeclaration()) {
+    T.Fns.push_back(Callee);
+    return T;
+  }
+
+  // External code may call back into functions passed to it.
+  for (auto A = CI->arg_begin(), E = CI->arg_end(); A != E; ++A) {
+    auto *Fn = dyn_cast<Function>((*A)->stripPointerCasts());
+    if (Fn && is_thread_spawn(*Callee))
+      T.Threads.push_back(Fn);
+    else if (Fn)
+      T.Fns.push_back(Fn);
+  }
+  T.Opaque = SetsCtx.count(Callee);
+  return T;
+}
+
+bool ContextFlow::sets_context(const Instruction &I) const {
+  if (IndicatorStores.count(&I))
+    return true;
+  auto it = CallTargets.find(&I);
+  if (it == CallTargets.end())
+    return false;
+  if (it->second.Opaque)
+    return true;
+  for (Function *F : it->second.Fns) {
+    if (SetsCtx.count(F))
+      return true;
+  }
+  return false;
+}
+
+bool ContextFlow::enter(Function *F, bool InContext) {
+  if (F->isDeclaration())
+    return false;
+  bool changed = Reachable.insert(F).second;
+  if (InContext)
+    changed |= EntersCtx.insert(F).second;
+  return changed;
+}
+
+/* Mark the blocks of F a thread can reach in a context, then enter F's
+ * callees in the state of each call. Returns whether a callee changed. */
+bool ContextFlow::propagate(Function &F) {
+  SmallVector<const BasicBlock *, 16> Work;
+  bool changed = false;
+
+  auto mark = [&](const BasicBlock *BB) {
+    if (BlockIn.insert(BB).second)
+      Work.push_back(BB);
+  };
+  if (EntersCtx.count(&F))
+    mark(&F.getEntryBlock());
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      if (sets_context(I)) {
+        for (const BasicBlock *Succ : successors(&BB))
+          mark(Succ);
+        break;
+      }
+    }
+  }
+  while (!Work.empty()) {
+    const BasicBlock *BB = Work.pop_back_val();
+    for (const BasicBlock *Succ : successors(BB))
+      mark(Succ);
+  }
+
+  for (BasicBlock &BB : F) {
+    bool InContext = BlockIn.count(&BB);
+    for (Instruction &I : BB) {
+      auto it = CallTargets.find(&I);
+      if (it != CallTargets.end()) {
+        for (Function *Fn : it->second.Fns)
+          changed |= enter(Fn, InContext);
+        for (Function *Fn : it->second.Threads)
+          changed |= enter(Fn, false);
+      }
+      InContext = InContext || sets_context(I);
+    }
+  }
+  return changed;
+}
+
+bool ContextFlow::may_observe(const Instruction *I) const {
+  const BasicBlock *BB = I->getParent();
+  bool InContext = BlockIn.count(BB);
+
+  for (const Instruction &J : *BB) {
+    if (&J == I || InContext)
+      break;
+    InContext = sets_context(J);
+  }
+  return InContext;
+}
@@ -0,0 +1,88 @@
+#ifndef PARTITION_CONTEXT_FLOW_H
+#define PARTITION_CONTEXT_FLOW_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include <functional>
+#include <set>
+
+namespace llvm {
+class TargetLibraryInfo;
+}
+
+namespace partition {
+
+/* Interprocedural may-analysis of where a thread can be in a context.
+ *
+ * A thread starts with no context and enters one through a runtime setter
+ * (instrument_indicator, instrument_del_indicator, instrument_del_enter,
+ * update_thread_ctx) or one of the given indicator stores, made directly
+ * or by a callee. A point can observe a context if some path from its
+ * thread's entry runs a setter before it. A function is entered in a
+ * context if any call to it can observe one; pthread_create start routines
+ * run on a new thread and are entered without one.
+ *
+ * Library functions known to TargetLibraryInfo only set contexts through
+ * the callbacks passed to them. Unless WholeProgram, any other external
+ * function may set one, and externally visible functions may be called
+ * from other modules, in a context. Functions whose address escapes may
+ * run whenever any context exists, and so can code they call.
+ */
+class ContextFlow {
+public:
+  using TLIFn =
+      std::function<const llvm::TargetLibraryInfo &(llvm::Function &)>;
+
+  ContextFlow(llvm::Module &M, TLIFn getTLI, bool WholeProgram,
+              const std::set<const llvm::Instruction *> &IndicatorStores);
+
+  // Whether F can run at all, from main, a thread or an external caller.
+  bool is_reachable(const llvm::Function *F) const {
+    return Reachable.count(F);
+  }
+  // Whether F can be entered by a thread that is in a context.
+  bool enters_in_context(const llvm::Function *F) const {
+    return EntersCtx.count(F);
+  }
+  // Whether a call to F can leave its thread in a different context.
+  bool may_set_context(const llvm::Function *F) const {
+    return SetsCtx.count(F);
+  }
+  // Whether the thread running I can be in a context just before I.
+  bool may_observe(const llvm::Instruction *I) const;
+
+private:
+  // What a call can run.
+  struct Targets {
+    // Functions entered in the caller's state: the callee, the possible
+    // targets of an indirect call, callbacks passed to external code.
+    llvm::SmallVector<llvm::Function *, 4> Fns;
+    // Start routines of threads it creates.
+    llvm::SmallVector<llvm::Function *, 1> Threads;
+    // A setter, or code this module cannot see that may be one.
+    bool Opaque = false;
+  };
+
+  bool WholeProgram;
+  const std::set<const llvm::Instruction *> &IndicatorStores;
+  llvm::SmallPtrSet<const llvm::Function *, 16> Reachable, EntersCtx, SetsCtx;
+  // Functions whose address is used other than to call them.
+  llvm::SmallVector<llvm::Function *, 8> Escaped;
+  llvm::DenseMap<const llvm::Instruction *, Targets> CallTargets;
+  // Blocks a thread can enter in a context.
+  llvm::SmallPtrSet<const llvm::BasicBlock *, 32> BlockIn;
+
+  void find_escaped(llvm::Module &M);
+  void classify_external(llvm::Function &F, const llvm::TargetLibraryInfo &TLI);
+  Targets targets_of(llvm::Instruction &I);
+  bool sets_context(const llvm::Instruction &I) const;
+  bool enter(llvm::Function *F, bool InContext);
+  bool propagate(llvm::Function &F);
+};
+
+}
+
+#endif
@@ -1,172 +1,515 @@
 #include "llvm/Pass.h"
-#include "llvm/IR/CallSite.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Config/llvm-config.h"
+#if LLVM_VERSION_MAJOR >= 11
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#endif
+#include "ContextFlow.h"
+#include "PartitionAnalysis.h"
+#include <functional>
+#include <memory>
 #include <set>
 
+#define DEBUG_TYPE "partition"
+
 using namespace llvm;
+using namespace partition;
+
+STATISTIC(NumIndicatorSites, "Indicator stores instrumented");
+STATISTIC(NumRedundantSites, "Indicator calls removed as redundant");
+STATISTIC(NumHoistedSites, "Indicator calls hoisted out of loops");
+STATISTIC(NumDelegatorSites, "Delegator id stores instrumented");
+STATISTIC(NumSkippedSites, "Sites left out because no context reaches them");
+
+static cl::opt<bool> ElimRedundant(
+    "partition-elim-redundant",
+    cl::desc("Drop indicator calls that provably leave the thread's context "
+             "unchanged and hoist loop-invariant ones"),
+    cl::init(true));
+
+static cl::opt<bool> InlineFastPath(
+    "partition-inline-fastpath",
+    cl::desc("Only call instrument_indicator when an indicator store changes "
+             "the thread's context (compared against lctx_cur_ctx)"),
+    cl::init(false));
+
+static cl::opt<bool> UseContextFlow(
+    "partition-context-flow",
+    cl::desc("Leave out indicator stores in functions that never run and "
+             "delegator stores no thread can reach in a context"),
+    cl::init(true));
+
+static cl::opt<bool> WholeProgram(
+    "partition-whole-program",
+    cl::desc("Assume the module is the whole program: only main is called "
+             "from outside, and external non-library functions never switch "
+             "context"),
+    cl::init(false));
+
+static cl::opt<std::string> ReportFile(
+    "partition-report",
+    cl::desc("Write a per-function instrumentation report to this file "
+             "('-' for stderr)"),
+    cl::value_desc("file"));
+
+/* These paper over API differences between LLVM releases. Only LLVM 14 is
+ * built and tested; the branches for releases before 9 and 11 keep the
+ * spellings the pass was first written with, and are not compiled. */
+static Value *get_runtime_func(Module &M, StringRef Name, FunctionType *Ty) {
+#if LLVM_VERSION_MAJOR >= 9
+  return M.getOrInsertFunction(Name, Ty).getCallee();
+#else
+  return M.getOrInsertFunction(Name, Ty);
+#endif
+}
+
+static Value *called_value(CallInst *CI) {
+#if LLVM_VERSION_MAJOR >= 11
+  return CI->getCalledOperand();
+#else
+  return CI->getCalledValue();
+#endif
+}
+
+static std::unique_ptr<raw_fd_ostream> open_text(StringRef Path,
+                                                 std::error_code &EC) {
+#if LLVM_VERSION_MAJOR >= 9
+  return std::unique_ptr<raw_fd_ostream>(
+      new raw_fd_ostream(Path, EC, sys::fs::OF_Text));
+#else
+  return std::unique_ptr<raw_fd_ostream>(
+      new raw_fd_ostream(Path, EC, sys::fs::F_Text));
+#endif
+}
 
 namespace {
-  struct PartitionPass : public ModulePass {
-    static char ID;
-    PartitionPass() : ModulePass(ID) {}
-    // Save creations/instantions of indicators & delegators.
-    std::set<Value*> indicators;
-    std::set<Value*> delegators;
-    std::set<Value*> identifiers;
-    std::set<Value*> del_identifiers;
+  /* Instruments one module from its PartitionInfo. Shared by the legacy
+   * and new pass manager passes, which differ only in where the annotations
+   * and per-function analyses come from. */
+  struct PartitionInstrumenter {
+    using DomTreeFn = std::function<DominatorTree &(Function &)>;
+    using LoopInfoFn = std::function<LoopInfo &(Function &)>;
+
+    Module *mM;
+    PartitionInfo &PI;
+    DomTreeFn getDomTree;
+    LoopInfoFn getLoopInfo;
+    ContextFlow::TLIFn getTLI;
     // Functions created for instrumentation.
-    Constant *IndicatorInitFunc = nullptr;
-    Constant *DelInitFunc = nullptr;
-    Constant *DelIDInitFunc = nullptr;
-    Module *mM = nullptr;
+    FunctionType *InstrumentTy = nullptr;
+    Value *IndicatorInitFunc = nullptr;
+    Value *DelInitFunc = nullptr;
+    Value *DelIDInitFunc = nullptr;
+    // The runtime's thread-local current context id (-partition-inline-fastpath).
+    GlobalVariable *CurCtxVar = nullptr;
 
-    //Maps A Indicator/Delegator struct mapped to the index into ID field.
-    std::map<Type *, std::vector<Value *>> id_map;
-  
-    virtual bool runOnModule(Module &M) {
-      this->mM = &M;
+    // An instrumented indicator store and the id load + call that report
+    // it. Call is null once the call has been removed.
+    struct IndicatorSite {
+      StoreInst *SI;
+      Value *Gep;
+      LoadInst *Load;
+      CallInst *Call;
+    };
+    std::vector<IndicatorSite> indicator_sites;
+    std::map<CallInst *, IndicatorSite *> site_of_call;
+    std::vector<CallInst *> delegator_calls;
+
+    // Where a context can be observed, computed before instrumenting.
+    std::set<const Instruction *> indicator_stores;
+    std::unique_ptr<ContextFlow> Flow;
+    // Annotated stores left uninstrumented.
+    std::set<const Instruction *> skipped;
+
+    PartitionInstrumenter(Module &M, PartitionInfo &PI, DomTreeFn DT,
+                          LoopInfoFn LI, ContextFlow::TLIFn TLI)
+        : mM(&M), PI(PI), getDomTree(DT), getLoopInfo(LI), getTLI(TLI) {}
+
+    bool run() {
+      if (PI.indicators.empty() && PI.del_identifiers.empty())
+        return false;
+      if (UseContextFlow || !ReportFile.empty())
+        analyze_context_flow();
       // Add the functions from runtime lib to this module.
       create_instrumentation_funcs();
-      // Step 1: Extract the necessary annotations.
-      find_global_annotations(M);
-      find_local_annotations(M);
-      find_identifiers(M);
-      find_del_identifiers(M);
-      // Step 2: Begin Instrumenting Source code. 
+      // Instrument the annotations found by PartitionAnalysis.
       instrument_indicators();
+      if (ElimRedundant)
+        optimize_indicator_sites();
+      if (InlineFastPath) {
+        for (auto &S : indicator_sites) {
+          if (S.Call)
+            emit_indicator_fastpath(S.Call);
+        }
+      }
       instrument_delegators();
+      if (!ReportFile.empty())
+        write_report();
+      return true;
     }
 
-  
-    virtual void create_instrumentation_funcs() {
+    void create_instrumentation_funcs() {
       // Create return, arg, and function Types.
       std::vector<Type*> paramTypes = {Type::getInt32Ty(mM->getContext())};
       auto *retType = Type::getVoidTy(mM->getContext());
-      auto *InstrumentTy = FunctionType::get(retType, paramTypes, false);
+      InstrumentTy = FunctionType::get(retType, paramTypes, false);
 
       // Create instrumentation function types.
-      IndicatorInitFunc = mM->getOrInsertFunction("instrument_indicator", InstrumentTy);
-      DelInitFunc = mM->getOrInsertFunction("instrument_delegator", InstrumentTy);
-      DelIDInitFunc = mM->getOrInsertFunction("instrument_del_indicator", InstrumentTy);
+      IndicatorInitFunc = get_runtime_func(*mM, "instrument_indicator", InstrumentTy);
+      DelInitFunc = get_runtime_func(*mM, "instrument_delegator", InstrumentTy);
+      DelIDInitFunc = get_runtime_func(*mM, "instrument_del_indicator", InstrumentTy);
+
+      if (InlineFastPath) {
+        CurCtxVar = mM->getNamedGlobal("lctx_cur_ctx");
+        if (!CurCtxVar) {
+          CurCtxVar = new GlobalVariable(
+              *mM, Type::getInt32Ty(mM->getContext()), false,
+              GlobalValue::ExternalLinkage, nullptr, "lctx_cur_ctx", nullptr,
+              GlobalValue::GeneralDynamicTLSModel);
+        }
+      }
+    }
+
+    std::vector<StoreInst *> find_indicator_stores() {
+      std::vector<StoreInst *> stores;
+      for (auto *indi : PI.indicators) {
+        for (auto *u : indi->users()) {
+          if (auto *I = dyn_cast<StoreInst>(u))
+            stores.push_back(I);
+        }
+      }
+      return stores;
+    }
+
+    /* ------------Methods for finding where contexts are observed.----------
+     *
+     * An indicator store only matters if its function can run. A delegator
+     * made while its thread has no context is bound to none, which is what
+     * the runtime reports for a delegator it never saw, so its store only
+     * needs instrumenting where a context may have been entered. ContextFlow
+     * answers both for the uninstrumented module, before any block is
+     * split.
+     * */
+    void analyze_context_flow() {
+      for (auto *SI : find_indicator_stores())
+        indicator_stores.insert(SI);
+      Flow.reset(new ContextFlow(*mM, getTLI, WholeProgram, indicator_stores));
+      if (!UseContextFlow)
+        return;
+
+      for (auto *SI : indicator_stores) {
+        if (!Flow->is_reachable(SI->getFunction()))
+          skipped.insert(SI);
+      }
+      for (auto *del : PI.del_identifiers) {
+        auto *SI = dyn_cast<StoreInst>(del);
+        if (SI && !Flow->may_observe(SI))
+          skipped.insert(SI);
+      }
+      NumSkippedSites += skipped.size();
+      errs() << "PartitionPass: left out " << skipped.size() << " of "
+             << indicator_stores.size() + PI.del_identifiers.size()
+             << " annotated stores no context reaches\n";
     }
 
     /* ------------------Methods for instrumenting code.-----------------------
      * */
     void instrument_indicators() {
-      for (auto *indi : indicators) {
-        for (auto *u : indi->users()) {
-          if (auto *I = dyn_cast<StoreInst>(u)) {
-            // The indexes into the struct where the ID field exists.
-            auto idx = ArrayRef<Value*>(id_map[I->getOperand(0)->getType()]);
-            // Create GEP, Store, and IndiFunc Call.
-            IRBuilder<> builder(I);
-            builder.SetInsertPoint(I->getParent(), ++builder.GetInsertPoint());
-            auto *gep = builder.CreateGEP(I->getOperand(0), idx);
-            auto *cid = builder.CreateLoad(gep);
-            builder.CreateCall(this->IndicatorInitFunc, {cid});
-          }
-        }
+      for (auto *I : find_indicator_stores()) {
+        if (skipped.count(I))
+          continue;
+        // The indexes into the struct where the ID field exists.
+        auto *ptr = I->getOperand(0);
+        auto idx = ArrayRef<Value*>(PI.id_map[ptr->getType()]);
+        // Create GEP, Store, and IndiFunc Call.
+        IRBuilder<> builder(I);
+        builder.SetInsertPoint(I->getParent(), ++builder.GetInsertPoint());
+        auto *gep = builder.CreateGEP(
+            ptr->getType()->getPointerElementType(), ptr, idx);
+        auto *cid = builder.CreateLoad(
+            gep->getType()->getPointerElementType(), gep);
+        auto *call = builder.CreateCall(InstrumentTy, IndicatorInitFunc,
+                                        {cid});
+        indicator_sites.push_back({I, gep, cid, call});
       }
+      for (auto &S : indicator_sites)
+        site_of_call[S.Call] = &S;
+      NumIndicatorSites += indicator_sites.size();
     }
 
-    void instrument_delegators() {
-      for (auto *del : del_identifiers) {
-        if (auto *SI = dyn_cast<StoreInst>(del)) {
-          IRBuilder<> builder(SI);
-          builder.SetInsertPoint(SI->getParent(), ++builder.GetInsertPoint());
-          builder.CreateCall(this->DelInitFunc, {SI->getOperand(0)});
-        }
+    // Turn `instrument_indicator(cid)` into
+    // `if (cid != lctx_cur_ctx) instrument_indicator(cid);`.
+    // The compare stays inline; the runtime call moves to a cold block.
+    void emit_indicator_fastpath(CallInst *call) {
+      IRBuilder<> builder(call);
+      auto *cid = call->getArgOperand(0);
+      auto *cur = builder.CreateLoad(CurCtxVar->getValueType(), CurCtxVar);
+      auto *changed = builder.CreateICmpNE(cid, cur);
+      MDBuilder MDB(mM->getContext());
+      auto *T = SplitBlockAndInsertIfThen(changed, call, false,
+                                          MDB.createBranchWeights(1, 100));
+      call->moveBefore(T);
+    }
+
+    /* ----------Methods for removing redundant indicator calls.-------------
+     *
+     * An indicator call sets the thread's context to the id of the struct
+     * stored into the indicator. The call is redundant when, on every path
+     * to it, the last indicator call was for the same stored SSA value and
+     * nothing in between could have changed the context or that struct's
+     * id field.
+     * */
+    void optimize_indicator_sites() {
+      std::map<Function *, std::vector<IndicatorSite *>> by_func;
+      unsigned hoisted = 0, removed = 0;
+
+      for (auto &S : indicator_sites)
+        by_func[S.Call->getFunction()].push_back(&S);
+
+      for (auto &kv : by_func) {
+        Function &F = *kv.first;
+        auto &LI = getLoopInfo(F);
+        auto &DT = getDomTree(F);
+
+        // Innermost loops first, so a call can keep moving outwards.
+        std::function<void(Loop *)> visit = [&](Loop *L) {
+          for (Loop *Sub : *L)
+            visit(Sub);
+          hoisted += hoist_indicator_call(L, DT);
+        };
+        for (Loop *L : LI)
+          visit(L);
+        removed += remove_redundant_calls(F);
       }
+
+      NumHoistedSites += hoisted;
+      NumRedundantSites += removed;
+      errs() << "PartitionPass: removed " << removed << " of "
+             << indicator_sites.size() << " indicator calls, hoisted "
+             << hoisted << " out of loops\n";
     }
 
+    IndicatorSite *site_of(Instruction *I) {
+      auto *CI = dyn_cast<CallInst>(I);
+      if (!CI)
+        return nullptr;
+      auto it = site_of_call.find(CI);
+      return it == site_of_call.end() ? nullptr : it->second;
+    }
 
-    bool find_del_identifiers(Module &M) {
-      auto *del_ident = _find_global(M, "del_identifier");
-      
-      errs() << *M.getFunction("main");
-      // GEP --> CALL --> Bitcast --> Store Function.
-      for (User *gep: del_ident->users()) {
-        for (User *CI: gep->users()) {
-          for (User *BI: CI->users()) {
-            for (User *id : BI->users()) {
-              errs() << *id << "\n";
-              del_identifiers.insert(u2v(id));
-            }
+    // Whether I may switch the thread's context or write an id field.
+    bool kills_context(Instruction *I) {
+      if (auto *CI = dyn_cast<CallInst>(I)) {
+        if (isa<MemIntrinsic>(CI))
+          return true;
+        if (isa<IntrinsicInst>(CI))
+          return false;
+        // Creating a delegator does not change the thread's context.
+        return called_value(CI) != DelInitFunc;
+      }
+      if (isa<InvokeInst>(I) || isa<AtomicRMWInst>(I) ||
+          isa<AtomicCmpXchgInst>(I))
+        return true;
+      // Any integer store might be to an id field.
+      if (auto *SI = dyn_cast<StoreInst>(I))
+        return SI->getValueOperand()->getType()->isIntegerTy();
+      return false;
+    }
+
+    /* If L contains no context-changing instructions and its indicator
+     * calls all store the same loop-invariant value, move the call to the
+     * preheader. The call's block must dominate every latch and exit, so
+     * the loop switches context on its first iteration anyway, and
+     * nothing observable runs before that point. */
+    unsigned hoist_indicator_call(Loop *L, DominatorTree &DT) {
+      BasicBlock *PH = L->getLoopPreheader();
+      IndicatorSite *cand = nullptr;
+
+      if (!PH)
+        return 0;
+      for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+          if (auto *S = site_of(&I)) {
+            if (cand &&
+                cand->SI->getValueOperand() != S->SI->getValueOperand())
+              return 0;
+            cand = cand ? cand : S;
+          } else if (kills_context(&I)) {
+            return 0;
           }
         }
       }
+      if (!cand || !L->isLoopInvariant(cand->SI->getValueOperand()))
+        return 0;
+
+      SmallVector<BasicBlock *, 8> blocks;
+      L->getExitingBlocks(blocks);
+      L->getLoopLatches(blocks);
+      for (BasicBlock *BB : blocks) {
+        if (!DT.dominates(cand->Call->getParent(), BB))
+          return 0;
+      }
+
+      auto *T = PH->getTerminator();
+      if (auto *G = dyn_cast<Instruction>(cand->Gep))
+        G->moveBefore(T);
+      cand->Load->moveBefore(T);
+      cand->Call->moveBefore(T);
+      return 1;
     }
 
+    // Forward must-analysis of the stored value the current context came
+    // from (nullptr: unknown). Returns the number of calls removed.
+    unsigned remove_redundant_calls(Function &F) {
+      DenseMap<BasicBlock *, Value *> Out;
+      ReversePostOrderTraversal<Function *> RPOT(&F);
+      std::vector<IndicatorSite *> redundant;
+      bool changed = true;
 
-    /*-----------------Methods for finding annotated variables-----------------*/
-    bool find_identifiers(Module &M) {
-      errs() << "Searching for Identifiers.\n";
-      // Get a reference to annotation function for pointers. 
-      Function *TF = M.getFunction("llvm.ptr.annotation.p0i8");
-      if (not TF) {
-        errs() << "No Identifiers Found!\n";
-        return false;
+      // Blocks not yet in Out have not been reached and do not constrain
+      // the meet.
+      auto in_state = [&](BasicBlock *BB) -> Value * {
+        Value *state = nullptr;
+        bool first = true;
+        if (BB == &F.getEntryBlock())
+          return nullptr;
+        for (BasicBlock *P : predecessors(BB)) {
+          auto it = Out.find(P);
+          if (it == Out.end())
+            continue;
+          if (first)
+            state = it->second;
+          else if (state != it->second)
+            return nullptr;
+          first = false;
+        }
+        return state;
+      };
+      auto transfer = [&](Instruction *I, Value *state) -> Value * {
+        if (auto *S = site_of(I))
+          return S->SI->getValueOperand();
+        return kills_context(I) ? nullptr : state;
+      };
+
+      while (changed) {
+        changed = false;
+        for (BasicBlock *BB : RPOT) {
+          Value *state = in_state(BB);
+          for (Instruction &I : *BB)
+            state = transfer(&I, state);
+          auto it = Out.find(BB);
+          if (it == Out.end() || it->second != state) {
+            Out[BB] = state;
+            changed = true;
+          }
+        }
       }
- 
-      // Get the ID field for each ID field.
-      for (auto *TFu : TF->users()) {
-        auto *gep = v2u(v2u(TFu->getOperand(0))->getOperand(0));
-        auto *S_ty = gep->getOperand(0)->getType();
-        auto g_op = [gep](int idx){return gep->getOperand(idx);};
-        id_map[S_ty] = std::vector<Value*>({g_op(1), g_op(2)});
+
+      for (BasicBlock *BB : RPOT) {
+        Value *state = in_state(BB);
+        for (Instruction &I : *BB) {
+          auto *S = site_of(&I);
+          if (S && state && state == S->SI->getValueOperand())
+            redundant.push_back(S);
+          state = transfer(&I, state);
+        }
       }
-      return true;
-    }
-  
-    bool find_global_annotations(Module &M) {
-      // Get a Reference to the global variable containing annotation info.
-      GlobalVariable* gv = M.getGlobalVariable("llvm.global.annotations");
-      if (not gv) {
-        errs() <<  "No Global Annotations Var Found!\n";
-        return false;
+
+      for (auto *S : redundant) {
+        site_of_call.erase(S->Call);
+        S->Call->eraseFromParent();
+        S->Call = nullptr;
+        if (S->Load->use_empty())
+          S->Load->eraseFromParent();
+        auto *G = dyn_cast<Instruction>(S->Gep);
+        if (G && G->use_empty())
+          G->eraseFromParent();
       }
-      
-      // Iterate through global annotations.
-      for (Value *u : gv->operands()) {
-        // Get Annotation type and variable annotated.
-        auto *a = dyn_cast<ConstantArray>(u);
-        auto *a_type = dyn_cast<ConstantExpr>(a->getOperand(0)->getOperand(1));
-        auto *a_var = dyn_cast<User>(
-              a->getOperand(0)->getOperand(0))->getOperand(0);
-        add_annotated(a_type, a_var);
+      return redundant.size();
+    }
+
+    void instrument_delegators() {
+      for (auto *del : PI.del_identifiers) {
+        auto *SI = dyn_cast<StoreInst>(del);
+        if (SI && !skipped.count(SI)) {
+          IRBuilder<> builder(SI);
+          builder.SetInsertPoint(SI->getParent(), ++builder.GetInsertPoint());
+          delegator_calls.push_back(builder.CreateCall(
+              InstrumentTy, DelInitFunc, {SI->getOperand(0)}));
+        }
       }
-      return true;
+      NumDelegatorSites += delegator_calls.size();
     }
-  
-    bool find_local_annotations(Module &M) {
-      // Check if local annotations exist.
-      Function *TF =  M.getFunction("llvm.var.annotation");
-      if (not TF) {
-        errs() << "No Local Annotation Vars Found!\n";
-        return false;
+
+    /* One line per defined function:
+     *   function|reachable|enters_ctx|sets_ctx|indicators|delegators|skipped
+     * with the instrumented indicator and delegator calls it ended up with
+     * and the annotated stores left out of it. */
+    void write_report() {
+      struct Counts {
+        unsigned indicators = 0, delegators = 0, skipped = 0;
+      };
+      std::map<const Function *, Counts> counts;
+      std::unique_ptr<raw_fd_ostream> file;
+      std::error_code EC;
+
+      for (auto &S : indicator_sites) {
+        if (S.Call)
+          counts[S.SI->getFunction()].indicators++;
       }
-  
-      for (User *u : TF->users()) {
-        // Get Annotation type and variable annotated.
-        auto *a_var = dyn_cast<User>(u->getOperand(0))->getOperand(0);
-        auto *a_type = dyn_cast<ConstantExpr>(u->getOperand(1));
-        add_annotated(a_type, a_var);
+      for (auto *CI : delegator_calls)
+        counts[CI->getFunction()].delegators++;
+      for (auto *I : skipped)
+        counts[I->getFunction()].skipped++;
+
+      if (ReportFile != "-") {
+        file = open_text(ReportFile, EC);
+        if (EC) {
+          errs() << "PartitionPass: cannot write " << ReportFile << ": "
+                 << EC.message() << "\n";
+          return;
+        }
+      }
+      raw_ostream &OS = file ? *file : errs();
+      OS << "# function|reachable|enters_ctx|sets_ctx|indicators|delegators"
+            "|skipped\n";
+      for (Function &F : *mM) {
+        if (F.isDeclaration())
+          continue;
+        auto &C = counts[&F];
+        OS << F.getName() << "|" << Flow->is_reachable(&F) << "|"
+           << Flow->enters_in_context(&F) << "|" << Flow->may_set_context(&F)
+           << "|" << C.indicators << "|" << C.delegators << "|" << C.skipped
+           << "\n";
       }
-      return true;
     }
-  
+
+
+    /*--------------------Debugging helpers.--------------------------------*/
     void print_globals(Module &M) {
-      for (auto g = M.global_object_begin(); g != M.global_object_end(); g++) {
-        errs() << "globals----------------: " << *g << "\n";
-        for(User *u: (*g).users()) {
+      for (GlobalObject &g : M.global_objects()) {
+        errs() << "globals----------------: " << g << "\n";
+        for(User *u: g.users()) {
           Value *v = dyn_cast<Value>(u);
           errs() << *u << "\n";
           for (User *vu : v->users()) {
@@ -176,24 +519,6 @@ namespace {
       }
     }
   
-    void add_annotated(ConstantExpr *ann_struct_expr, Value *ann_var) {
-      StringRef ann_type = gepToStr(ann_struct_expr);
-      if (ann_type.contains("indicator")) {
-        indicators.insert(ann_var);
-      } else if(ann_type.contains("delegator")) {
-        delegators.insert(ann_var);
-      } else {
-        errs() << "[BUG]: Invalid annotation type: " << ann_type << "\n";
-      }
-    }
-  
-    /*--------------------Util methods.---------------------------------------*/
-    StringRef gepToStr(ConstantExpr *annotation) {
-      auto *c_str = dyn_cast<GlobalVariable>(annotation->getOperand(0));
-      auto *c_data = dyn_cast<ConstantDataArray>(c_str->getInitializer());
-      return c_data->getAsString();
-    }
-  
     void print_annotations(){
       auto pa = [](std::set<Value*> a, std::string as) {
         errs() << as << "\n";
@@ -202,25 +527,69 @@ namespace {
         }
       };
   
-      pa(indicators, "indicators");
-      pa(delegators, "delegators");
-      pa(delegators, "indicators");
-    }
-
-    GlobalVariable * _find_global(Module &M, std::string contains) {
-      for (GlobalVariable &g : mM->globals()) {
-        if (!g.hasInitializer()) { continue;}
-        // Search for identifier.
-        if (auto *g_str = dyn_cast<ConstantDataArray>(g.getInitializer())) {
-          if (g_str->getAsString().contains(contains)) {
-            return &g;
-          }
-        }
-      }
-      return nullptr;
+      pa(PI.indicators, "indicators");
+      pa(PI.delegators, "delegators");
+      pa(PI.del_identifiers, "del_identifiers");
+    }
+  };
+
+  // Legacy pass manager: opt -load ... -PartitionPass, clang -Xclang -load.
+  struct PartitionPass : public ModulePass {
+    static char ID;
+    PartitionPass() : ModulePass(ID) {}
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<DominatorTreeWrapperPass>();
+      AU.addRequired<LoopInfoWrapperPass>();
+      AU.addRequired<TargetLibraryInfoWrapperPass>();
+    }
+
+    bool runOnModule(Module &M) override {
+      PartitionInfo PI = find_partition_info(M);
+      PartitionInstrumenter PInst(
+          M, PI,
+          [this](Function &F) -> DominatorTree & {
+            return getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+          },
+          [this](Function &F) -> LoopInfo & {
+            return getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+          },
+          [this](Function &F) -> const TargetLibraryInfo & {
+#if LLVM_VERSION_MAJOR >= 10
+            return getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+#else
+            return getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+#endif
+          });
+      return PInst.run();
+    }
+  };
+
+  /* New pass manager: opt -load-pass-plugin ... -passes=partition, clang
+   * -fpass-plugin. The annotations come from the cached PartitionAnalysis,
+   * so other passes in the pipeline can query them without a rescan. */
+  struct PartitionTransform : public PassInfoMixin<PartitionTransform> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+      auto &PI = MAM.getResult<PartitionAnalysis>(M);
+      auto &FAM =
+          MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      PartitionInstrumenter PInst(
+          M, PI,
+          [&FAM](Function &F) -> DominatorTree & {
+            return FAM.getResult<DominatorTreeAnalysis>(F);
+          },
+          [&FAM](Function &F) -> LoopInfo & {
+            return FAM.getResult<LoopAnalysis>(F);
+          },
+          [&FAM](Function &F) -> const TargetLibraryInfo & {
+            return FAM.getResult<TargetLibraryAnalysis>(F);
+          });
+      if (!PInst.run())
+        return PreservedAnalyses::all();
+      PreservedAnalyses PA;
+      PA.preserve<PartitionAnalysis>();
+      return PA;
     }
-    User *v2u(Value *v) {return dyn_cast<User>(v);}
-    Value *u2v(User *u) {return dyn_cast<Value>(u);}
   };
 }
 
@@ -228,4 +597,40 @@ char PartitionPass::ID = 0;
 static RegisterPass<PartitionPass> X(
     "PartitionPass", "PartitionPass Pass",
     false, 
-    true);
+    false);
+
+// Run inside clang's own pipeline, before the optimizer rewrites the
+// annotated allocas and stores.
+static void registerPartitionPass(const PassManagerBuilder &,
+                                  legacy::PassManagerBase &PM) {
+  PM.add(new PartitionPass());
+}
+static RegisterStandardPasses RegisterEarly(
+    PassManagerBuilder::EP_ModuleOptimizerEarly, registerPartitionPass);
+static RegisterStandardPasses RegisterO0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerPartitionPass);
+
+#if LLVM_VERSION_MAJOR >= 11
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "PartitionPass", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](ModuleAnalysisManager &MAM) {
+                  MAM.registerPass([] { return PartitionAnalysis(); });
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name != "partition")
+                    return false;
+                  MPM.addPass(PartitionTransform());
+                  return true;
+                });
+            // The optimization level type moved between releases.
+            PB.registerPipelineStartEPCallback(
+                [](ModulePassManager &MPM, auto) {
+                  MPM.addPass(PartitionTransform());
+                });
+          }};
+}
+#endif
@@ -0,0 +1,158 @@
+#include "PartitionAnalysis.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace partition;
+
+namespace {
+  // Fills a PartitionInfo from the annotations left by the annotate macros.
+  struct AnnotationFinder {
+    Module &M;
+    PartitionInfo &PI;
+
+    AnnotationFinder(Module &M, PartitionInfo &PI) : M(M), PI(PI) {}
+
+    void run() {
+      find_global_annotations();
+      find_local_annotations();
+      find_identifiers();
+      find_del_identifiers();
+    }
+
+    /* The stores to del_identifier fields: from each llvm.ptr.annotation
+     * call naming one, through any casts and GEPs of the annotated pointer
+     * to the stores through it. */
+    bool find_del_identifiers() {
+      bool found = false;
+
+      for (Function &F : M) {
+        if (F.getIntrinsicID() != Intrinsic::ptr_annotation)
+          continue;
+        for (User *u : F.users()) {
+          auto *CI = dyn_cast<CallInst>(u);
+          if (!CI || !annotation_is(CI->getArgOperand(1), "del_identifier"))
+            continue;
+          std::vector<Value *> work = {CI};
+          while (!work.empty()) {
+            Value *ptr = work.back();
+            work.pop_back();
+            for (User *pu : ptr->users()) {
+              if (isa<CastInst>(pu) || isa<GetElementPtrInst>(pu)) {
+                work.push_back(pu);
+              } else if (auto *SI = dyn_cast<StoreInst>(pu)) {
+                if (SI->getPointerOperand() == ptr) {
+                  PI.del_identifiers.insert(SI);
+                  found = true;
+                }
+              }
+            }
+          }
+        }
+      }
+      return found;
+    }
+
+    /*-----------------Methods for finding annotated variables-----------------*/
+    bool find_identifiers() {
+      errs() << "Searching for Identifiers.\n";
+      // Get a reference to annotation function for pointers.
+      Function *TF = M.getFunction("llvm.ptr.annotation.p0i8");
+      if (not TF) {
+        errs() << "No Identifiers Found!\n";
+        return false;
+      }
+
+      // Get the ID field for each ID field.
+      for (auto *TFu : TF->users()) {
+        auto *gep = v2u(v2u(TFu->getOperand(0))->getOperand(0));
+        auto *S_ty = gep->getOperand(0)->getType();
+        auto g_op = [gep](int idx){return gep->getOperand(idx);};
+        PI.id_map[S_ty] = std::vector<Value*>({g_op(1), g_op(2)});
+      }
+      return true;
+    }
+
+    bool find_global_annotations() {
+      // Get a Reference to the global variable containing annotation info.
+      GlobalVariable* gv = M.getGlobalVariable("llvm.global.annotations");
+      if (not gv) {
+        errs() <<  "No Global Annotations Var Found!\n";
+        return false;
+      }
+
+      // Iterate through global annotations, one struct per annotated global.
+      auto *a = dyn_cast<ConstantArray>(gv->getInitializer());
+      for (Value *e : a->operands()) {
+        // Get Annotation type and variable annotated.
+        auto *s = dyn_cast<ConstantStruct>(e);
+        auto *a_type = dyn_cast<ConstantExpr>(s->getOperand(1));
+        auto *a_var = s->getOperand(0)->stripPointerCasts();
+        add_annotated(a_type, a_var);
+      }
+      return true;
+    }
+
+    bool find_local_annotations() {
+      // Check if local annotations exist.
+      Function *TF =  M.getFunction("llvm.var.annotation");
+      if (not TF) {
+        errs() << "No Local Annotation Vars Found!\n";
+        return false;
+      }
+
+      for (User *u : TF->users()) {
+        // Get Annotation type and variable annotated.
+        auto *a_var = dyn_cast<User>(u->getOperand(0))->getOperand(0);
+        auto *a_type = dyn_cast<ConstantExpr>(u->getOperand(1));
+        add_annotated(a_type, a_var);
+      }
+      return true;
+    }
+
+    void add_annotated(ConstantExpr *ann_struct_expr, Value *ann_var) {
+      StringRef ann_type = gepToStr(ann_struct_expr);
+      if (ann_type.contains("indicator")) {
+        PI.indicators.insert(ann_var);
+      } else if(ann_type.contains("delegator")) {
+        PI.delegators.insert(ann_var);
+      } else {
+        errs() << "[BUG]: Invalid annotation type: " << ann_type << "\n";
+      }
+    }
+
+    /*--------------------Util methods.---------------------------------------*/
+    StringRef gepToStr(ConstantExpr *annotation) {
+      auto *c_str = dyn_cast<GlobalVariable>(annotation->getOperand(0));
+      auto *c_data = dyn_cast<ConstantDataArray>(c_str->getInitializer());
+      return c_data->getAsString();
+    }
+
+    // Whether the annotation string ann (an i8* to a global) contains name.
+    bool annotation_is(Value *ann, StringRef name) {
+      auto *g = dyn_cast<GlobalVariable>(ann->stripPointerCasts());
+      if (!g || !g->hasInitializer())
+        return false;
+      auto *g_str = dyn_cast<ConstantDataArray>(g->getInitializer());
+      return g_str && g_str->getAsString().contains(name);
+    }
+    User *v2u(Value *v) {return dyn_cast<User>(v);}
+  };
+}
+
+PartitionInfo partition::find_partition_info(Module &M) {
+  PartitionInfo PI;
+  AnnotationFinder(M, PI).run();
+  return PI;
+}
+
+AnalysisKey PartitionAnalysis::Key;
+
+PartitionAnalysis::Result PartitionAnalysis::run(Module &M,
+                                                 ModuleAnalysisManager &) {
+  return find_partition_info(M);
+}
@@ -0,0 +1,40 @@
+#ifndef PARTITION_ANALYSIS_H
+#define PARTITION_ANALYSIS_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include <map>
+#include <set>
+#include <vector>
+
+namespace partition {
+
+// The annotated indicators/delegators of a module.
+struct PartitionInfo {
+  // Save creations/instantions of indicators & delegators.
+  std::set<llvm::Value *> indicators;
+  std::set<llvm::Value *> delegators;
+  std::set<llvm::Value *> del_identifiers;
+  //Maps A Indicator/Delegator struct mapped to the index into ID field.
+  std::map<llvm::Type *, std::vector<llvm::Value *>> id_map;
+};
+
+// Scan llvm.global.annotations, llvm.var.annotation and
+// llvm.ptr.annotation users of M.
+PartitionInfo find_partition_info(llvm::Module &M);
+
+/* New pass manager analysis caching find_partition_info() per module.
+ * Instrumenting a module leaves its annotations intact, so the transform
+ * preserves it; any other pass that does not preserve it invalidates it. */
+class PartitionAnalysis : public llvm::AnalysisInfoMixin<PartitionAnalysis> {
+  friend llvm::AnalysisInfoMixin<PartitionAnalysis>;
+  static llvm::AnalysisKey Key;
+
+public:
+  using Result = PartitionInfo;
+  Result run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+}
+
+#endif